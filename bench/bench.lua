@@ -0,0 +1,106 @@
+--
+-- a minimal benchmark harness.
+--
+-- each measurement is written to stdout as a JSON object per line;
+--
+--   name        name of the benchmark
+--   iterations  number of calls of the function
+--   cpu_sec     client-side CPU time (os.clock)
+--   ops         iterations per second of the CPU time
+--   query_sec   total time of the queries measured by conn:stats()
+--   queries     number of queries sent
+--   rows        number of rows received
+--
+local libpq = require('libpq')
+local clock = os.clock
+local format = string.format
+local concat = table.concat
+local sort = table.sort
+
+local SCALE = tonumber(os.getenv('BENCH_SCALE')) or 1
+
+--- tojson encodes a flat table into a JSON object
+--- @param tbl table<string, string|number>
+--- @return string
+local function tojson(tbl)
+    local keys = {}
+    for k in pairs(tbl) do
+        keys[#keys + 1] = k
+    end
+    sort(keys)
+
+    local list = {}
+    for i, k in ipairs(keys) do
+        local v = tbl[k]
+        if type(v) == 'string' then
+            v = format('%q', v)
+        elseif v ~= v or v == math.huge or v == -math.huge then
+            v = 'null'
+        elseif math.type and math.type(v) == 'integer' then
+            v = format('%d', v)
+        else
+            v = format('%.9g', v)
+        end
+        list[i] = format('%q:%s', k, v)
+    end
+    return '{' .. concat(list, ',') .. '}'
+end
+
+--- connect connects to the database server specified by the environment
+--- variables
+--- @return libpq.conn
+local function connect()
+    local c = assert(libpq.connect())
+    assert(c:status() == libpq.CONNECTION_OK, c:error_message())
+    return c
+end
+
+--- iterations returns the number of iterations multiplied by BENCH_SCALE
+--- @param n integer
+--- @return integer
+local function iterations(n)
+    return math.max(1, math.floor(n * SCALE))
+end
+
+--- run calls the function n times and prints the measurement
+--- @param name string
+--- @param n integer
+--- @param fn fun(i:integer)
+--- @param c? libpq.conn connection to read the query statistics
+local function run(name, n, fn, c)
+    -- warm up
+    fn(1)
+    collectgarbage('collect')
+    collectgarbage('collect')
+    if c then
+        c:reset_stats()
+    end
+
+    local t = clock()
+    for i = 1, n do
+        fn(i)
+    end
+    t = clock() - t
+
+    local res = {
+        name = name,
+        iterations = n,
+        cpu_sec = t,
+        ops = t > 0 and n / t or 0,
+    }
+    if c then
+        local stats = c:stats()
+        res.query_sec = stats.total_time
+        res.queries = stats.queries
+        res.rows = stats.rows
+    end
+    io.stdout:write(tojson(res), '\n')
+    io.stdout:flush()
+end
+
+return {
+    connect = connect,
+    iterations = iterations,
+    run = run,
+    tojson = tojson,
+}
@@ -0,0 +1,202 @@
+local libpq = require('libpq')
+local bench = require('bench')
+
+local c = bench.connect()
+local N = bench.iterations(5000)
+
+--
+-- query execution
+--
+bench.run('exec', N, function()
+    assert(c:exec('SELECT 1, 2, 3'))
+end, c)
+
+bench.run('exec_params', N, function(i)
+    assert(c:exec_params('SELECT $1::int, $2::text, $3::bool', i, 'foo', true))
+end, c)
+
+assert(c:prepare('bench_stmt', 'SELECT $1::int, $2::text, $3::bool'))
+bench.run('exec_prepared', N, function(i)
+    assert(c:exec_prepared('bench_stmt', i, 'foo', true))
+end, c)
+
+-- the parameters are sent in the binary format of the described types
+assert(c:describe_prepared('bench_stmt'))
+bench.run('exec_prepared_described', N, function(i)
+    assert(c:exec_prepared('bench_stmt', i, 'foo', true))
+end, c)
+assert(c:exec('DEALLOCATE bench_stmt'))
+c:clear_param_types()
+
+assert(c:set_result_cache(16 * 1024 * 1024))
+bench.run('exec_params_cached', N, function(i)
+    assert(c:exec_params_cached(nil, 'SELECT $1::int, $2::text, $3::bool',
+                                i % 100, 'foo', true))
+end, c)
+assert(c:set_result_cache(0))
+
+--
+-- transactions
+--
+bench.run('transaction_exec', N, function(i)
+    assert(c:exec('BEGIN'))
+    assert(c:exec_params('SELECT $1::int', i))
+    assert(c:exec('COMMIT'))
+end, c)
+
+bench.run('transaction_helper', N, function(i)
+    assert(c:transaction(function(conn)
+        assert(conn:exec_params('SELECT $1::int', i))
+    end))
+end, c)
+
+--
+-- streaming in single row mode
+--
+local NROW = bench.iterations(10000)
+local SQL_ROWS = ([[
+    SELECT i, md5(i::text), i * 1.5, i % 2 = 0
+    FROM generate_series(1, %d) AS i
+]]):format(NROW)
+
+bench.run('single_row_mode', 10, function()
+    assert(c:send_query(SQL_ROWS))
+    assert(c:set_single_row_mode())
+    local res = c:get_result()
+    while res do
+        res:clear()
+        res = c:get_result()
+    end
+end, c)
+
+-- the rows are decoded and written in the arrow IPC stream format
+local ipcfile = assert(io.tmpfile())
+bench.run('write_arrow', 10, function()
+    ipcfile:seek('set')
+    assert(c:write_arrow(SQL_ROWS, ipcfile))
+end, c)
+ipcfile:close()
+
+-- the rows are kept in the compact row format, and spilled to the file
+for _, threshold in ipairs({
+    64 * 1024 * 1024,
+    0,
+}) do
+    local name = threshold == 0 and 'exec_spill_file' or 'exec_spill_memory'
+    bench.run(name, 10, function()
+        local s = assert(c:exec_spill(SQL_ROWS, threshold))
+        for i = 1, s:ntuples() do
+            s:get_value(i, 2)
+        end
+        s:clear()
+    end, c)
+end
+
+--
+-- pipelining
+--
+for _, depth in ipairs({
+    1,
+    8,
+    64,
+}) do
+    bench.run('pipeline_depth_' .. depth, math.max(1, math.floor(N / depth)), function(i)
+        assert(c:enter_pipeline_mode())
+        for j = 1, depth do
+            assert(c:send_query_params('SELECT $1::int', i + j))
+        end
+        assert(c:pipeline_sync())
+        for _ = 1, depth do
+            assert(c:get_result())
+            assert(c:get_result() == nil)
+        end
+        local res = assert(c:get_result())
+        assert(res:status() == libpq.PGRES_PIPELINE_SYNC)
+        assert(c:exit_pipeline_mode())
+    end, c)
+end
+
+--
+-- COPY in/out
+--
+assert(c:exec([[
+    CREATE TEMP TABLE bench_copy (
+        id integer,
+        str text,
+        num numeric
+    )
+]]))
+local LINE = '%d\tabcdefghijklmnopqrstuvwxyz\t12345.6789\n'
+
+bench.run('copy_in', 10, function()
+    local res = assert(c:exec('COPY bench_copy FROM STDIN'))
+    assert(res:status() == libpq.PGRES_COPY_IN)
+    for i = 1, NROW do
+        assert(c:put_copy_data(LINE:format(i)))
+    end
+    assert(c:put_copy_end())
+    res = assert(c:get_result())
+    assert(res:status() == libpq.PGRES_COMMAND_OK, res:error_message())
+    assert(c:get_result() == nil)
+end, c)
+
+-- text-heavy rows that contain the characters to be escaped
+local ROWS = {}
+for i = 1, 1000 do
+    ROWS[i] = {
+        i,
+        string.rep('abc\tdef\\ghi\n', 20),
+        12345.6789,
+    }
+end
+
+bench.run('copy_in_rows', 10, function()
+    local res = assert(c:exec('COPY bench_copy FROM STDIN'))
+    assert(res:status() == libpq.PGRES_COPY_IN)
+    for _ = 1, math.max(1, math.floor(NROW / #ROWS)) do
+        assert(c:put_copy_rows(ROWS, 3))
+    end
+    assert(c:put_copy_end())
+    res = assert(c:get_result())
+    assert(res:status() == libpq.PGRES_COMMAND_OK, res:error_message())
+    assert(c:get_result() == nil)
+end, c)
+
+bench.run('copy_out', 10, function()
+    local res = assert(c:exec('COPY bench_copy TO STDOUT'))
+    assert(res:status() == libpq.PGRES_COPY_OUT)
+    while c:get_copy_data() do
+    end
+    assert(c:get_result())
+    assert(c:get_result() == nil)
+end, c)
+
+bench.run('copy_out_rows', 10, function()
+    local res = assert(c:exec('COPY bench_copy TO STDOUT'))
+    assert(res:status() == libpq.PGRES_COPY_OUT)
+    local row = {}
+    while c:get_copy_row(false, row) do
+    end
+    assert(c:get_result())
+    assert(c:get_result() == nil)
+end, c)
+
+--
+-- multi-row INSERT
+--
+local SQL_INSERT = 'INSERT INTO bench_copy (id, str, num) VALUES'
+
+bench.run('insert_exec_params', 10, function()
+    for i = 1, NROW do
+        assert(c:exec_params(SQL_INSERT .. ' ($1, $2, $3)', i,
+                             'abcdefghijklmnopqrstuvwxyz', 12345.6789))
+    end
+end, c)
+
+bench.run('insert_batcher', 10, function()
+    local b = assert(c:insert_batcher(SQL_INSERT, 3))
+    for i = 1, NROW do
+        assert(b:add(i, 'abcdefghijklmnopqrstuvwxyz', 12345.6789))
+    end
+    assert(b:flush())
+end, c)
@@ -0,0 +1,183 @@
+--
+-- microbenchmarks of the result materialisation with synthetic results.
+--
+-- the results are built by make_empty_result, set_attrs and set_value
+-- without the network round trip.
+--
+--   BENCH_ROWS  number of rows (default: 1000000)
+--   BENCH_COLS  number of columns (default: 20)
+--
+local bench = require('bench')
+local libpq = require('libpq')
+local get_result_rows = libpq.util.get_result_rows
+local iterate_result_rows = libpq.util.iterate_result_rows
+local get_result_stat = libpq.util.get_result_stat
+
+local NROW = tonumber(os.getenv('BENCH_ROWS')) or 1000000
+local NCOL = tonumber(os.getenv('BENCH_COLS')) or 20
+-- OID of the text type
+local TEXTOID = 25
+
+local c = bench.connect()
+
+--- new_result creates a synthetic result of NROW x NCOL
+--- @param valuefn fun(row:integer, col:integer):string?
+--- @return libpq.result
+local function new_result(valuefn)
+    local res = assert(c:make_empty_result(libpq.PGRES_TUPLES_OK))
+    local attrs = {}
+    for col = 1, NCOL do
+        attrs[col] = {
+            name = 'col' .. col,
+            type = TEXTOID,
+        }
+    end
+    assert(res:set_attrs(attrs))
+    for row = 1, NROW do
+        for col = 1, NCOL do
+            assert(res:set_value(row, col, valuefn(row, col)))
+        end
+    end
+    return res
+end
+
+for _, grid in ipairs({
+    -- short strings are interned by lua
+    {
+        name = 'short',
+        valuefn = function(row, col)
+            return tostring(row % 1000 + col)
+        end,
+    },
+    -- long strings are not interned by lua 5.2 or later
+    {
+        name = 'long',
+        valuefn = function(row, col)
+            return string.format('%064d', row * NCOL + col)
+        end,
+    },
+    -- low-cardinality values such as the status or the country code
+    {
+        name = 'enum',
+        valuefn = function(row, col)
+            return ('status_%d_%s'):format((row + col) % 8,
+                                           string.rep('x', 40))
+        end,
+    },
+    -- half of the values are NULL
+    {
+        name = 'null',
+        valuefn = function(row, col)
+            if (row + col) % 2 == 0 then
+                return tostring(row)
+            end
+        end,
+    },
+}) do
+    local res = new_result(grid.valuefn)
+    local name = grid.name .. '_' .. NROW .. 'x' .. NCOL
+
+    bench.run('get_result_rows_' .. name, 3, function()
+        get_result_rows(res)
+    end)
+
+    bench.run('get_result_rows_intern_' .. name, 3, function()
+        get_result_rows(res, {
+            intern = true,
+        })
+    end)
+
+    local arena = assert(libpq.arena())
+    bench.run('get_result_rows_arena_' .. name, 3, function()
+        assert(get_result_rows(res, {
+            arena = arena,
+        }))
+        arena:release()
+    end)
+
+    bench.run('iterate_result_rows_' .. name, 3, function()
+        for _ in iterate_result_rows(res) do
+        end
+    end)
+
+    bench.run('get_value_' .. name, 3, function()
+        for row = 1, NROW do
+            for col = 1, NCOL do
+                res:get_value(row, col)
+            end
+        end
+    end)
+
+    local rows = {}
+    bench.run('get_values_' .. name, 3, function()
+        -- read the rows in pages of 100 rows
+        for row = 1, NROW, 100 do
+            res:get_values(row, row + 99, nil, rows)
+        end
+    end)
+
+    bench.run('get_result_stat_' .. name, bench.iterations(100000), function()
+        get_result_stat(res)
+    end)
+
+    res:clear()
+    collectgarbage('collect')
+end
+
+-- typed columns of int8, float8 and timestamptz
+do
+    local TYPES = {
+        20,
+        701,
+        1184,
+    }
+    local res = assert(c:make_empty_result(libpq.PGRES_TUPLES_OK))
+    local attrs = {}
+    for col = 1, NCOL do
+        attrs[col] = {
+            name = 'col' .. col,
+            type = TYPES[(col - 1) % #TYPES + 1],
+        }
+    end
+    assert(res:set_attrs(attrs))
+    for row = 1, NROW do
+        for col = 1, NCOL do
+            local v
+            if attrs[col].type == 20 then
+                v = tostring(row * col)
+            elseif attrs[col].type == 701 then
+                v = tostring(row / col)
+            else
+                v = os.date('!%Y-%m-%d %H:%M:%S.123456+00', row)
+            end
+            assert(res:set_value(row, col, v))
+        end
+    end
+    local name = 'typed_' .. NROW .. 'x' .. NCOL
+
+    bench.run('get_result_rows_' .. name, 3, function()
+        get_result_rows(res)
+    end)
+
+    for _, nthreads in ipairs({
+        1,
+        4,
+        16,
+    }) do
+        bench.run('get_result_rows_decode_' .. nthreads .. '_' .. name, 3,
+                  function()
+            assert(get_result_rows(res, {
+                decode = true,
+                nthreads = nthreads,
+            }))
+        end)
+
+        bench.run('to_columns_buffer_' .. nthreads .. '_' .. name, 3,
+                  function()
+            assert(res:to_columns_buffer(nthreads)):free()
+        end)
+    end
+
+    res:clear()
+    collectgarbage('collect')
+end
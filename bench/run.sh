@@ -0,0 +1,47 @@
+#!/usr/bin/env sh
+#
+# run the benchmarks against a throwaway PostgreSQL instance.
+#
+#   usage: ./bench/run.sh [./bench/<name>_bench.lua ...]
+#
+# the results are written to stdout as JSON lines, and also saved to
+# $BENCH_OUTPUT (default: ./bench_output.txt).
+#
+# environment variables:
+#   LUA          lua interpreter (default: lua)
+#   PGBINDIR     directory of initdb and pg_ctl (default: pg_config --bindir)
+#   BENCH_SCALE  multiplier of the number of iterations (default: 1)
+#
+set -e
+
+LUA=${LUA:-lua}
+BENCH_OUTPUT=${BENCH_OUTPUT:-./bench_output.txt}
+PGBINDIR=${PGBINDIR:-$(pg_config --bindir)}
+WORKDIR=$(mktemp -d)
+
+cleanup() {
+    "$PGBINDIR/pg_ctl" -D "$WORKDIR/data" -m immediate stop > /dev/null 2>&1 || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+# create a database cluster that listens only on the unix domain socket in
+# the temporary directory
+"$PGBINDIR/initdb" -D "$WORKDIR/data" -A trust -U postgres > /dev/null
+"$PGBINDIR/pg_ctl" -D "$WORKDIR/data" -l "$WORKDIR/postgres.log" -w \
+    -o "-k $WORKDIR -c listen_addresses='' -F" start > /dev/null
+
+export PGHOST="$WORKDIR"
+export PGPORT=5432
+export PGUSER=postgres
+export PGDATABASE=postgres
+export LUA_PATH="./bench/?.lua;${LUA_PATH:-;}"
+
+if [ $# -eq 0 ]; then
+    set -- ./bench/*_bench.lua
+fi
+
+: > "$BENCH_OUTPUT"
+for file in "$@"; do
+    "$LUA" "$file" | tee -a "$BENCH_OUTPUT"
+done
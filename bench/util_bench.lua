@@ -0,0 +1,38 @@
+local bench = require('bench')
+local libpq = require('libpq')
+local get_result_rows = libpq.util.get_result_rows
+local iterate_result_rows = libpq.util.iterate_result_rows
+
+local c = bench.connect()
+local NROW = bench.iterations(10000)
+local res = assert(c:exec(([[
+    SELECT i, md5(i::text), i * 1.5, i % 2 = 0, now(), NULL::text,
+           'foo', 'bar', 'baz', 'qux'
+    FROM generate_series(1, %d) AS i
+]]):format(NROW)))
+assert(res:status() == libpq.PGRES_TUPLES_OK, res:error_message())
+local ncol = res:nfields()
+
+--
+-- result materialisation
+--
+bench.run('get_result_rows', 20, function()
+    get_result_rows(res)
+end)
+
+bench.run('iterate_result_rows', 20, function()
+    for _ in iterate_result_rows(res) do
+    end
+end)
+
+bench.run('get_value', 20, function()
+    for row = 1, NROW do
+        for col = 1, ncol do
+            res:get_value(row, col)
+        end
+    end
+end)
+
+bench.run('get_result_stat', bench.iterations(100000), function()
+    libpq.util.get_result_stat(res)
+end)
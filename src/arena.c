@@ -0,0 +1,431 @@
+/**
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <stdlib.h>
+// lua
+#include "lua_libpq.h"
+
+/**
+ * the arena owns the rows that materialized by get_result_rows with the
+ * arena option. the values of each result are copied into a single block,
+ * and the rows and the values are accessed through the proxies, so that
+ * the GC never traces the tables and the strings of each value. all blocks
+ * are freed at once when the arena is released.
+ *
+ * the arena is referenced by the proxies, and the blocks are kept until
+ * the arena is released or the arena and all proxies are collected. the
+ * proxies that created before the release cannot be used after it.
+ */
+
+typedef struct {
+    // the length of the text value, or -1 if null
+    int64_t len;
+    union {
+        const char *str;
+        int64_t i;
+        double d;
+    } v;
+} cell_t;
+
+typedef struct rowset_s rowset_t;
+struct rowset_s {
+    rowset_t *next;
+    int nrow;
+    int ncol;
+    cell_t *cells;
+    char **names;
+    libpq_coltype_t *types;
+};
+
+struct libpq_arena_s {
+    // the number of the arena userdata and the proxies
+    int refs;
+    // incremented by the release to invalidate the proxies
+    uint32_t gen;
+    rowset_t *rowsets;
+    size_t size;
+};
+
+typedef struct {
+    libpq_arena_t *arena;
+} arena_t;
+
+typedef struct {
+    libpq_arena_t *arena;
+    uint32_t gen;
+    const rowset_t *rs;
+    // the row of the row proxy
+    int row;
+} proxy_t;
+
+static inline size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+static void release(libpq_arena_t *a)
+{
+    rowset_t *rs = a->rowsets;
+
+    while (rs) {
+        rowset_t *next = rs->next;
+        free(rs);
+        rs = next;
+    }
+    a->rowsets = NULL;
+    a->size    = 0;
+    a->gen++;
+}
+
+static void unref(libpq_arena_t *a)
+{
+    if (--a->refs == 0) {
+        release(a);
+        free(a);
+    }
+}
+
+/**
+ * copies the rows of res into a single block. the columns that decoded in
+ * cols are kept as the typed values, and the others are kept as the text.
+ */
+static rowset_t *new_rowset(const PGresult *res, const libpq_columns_t *cols,
+                            size_t *size)
+{
+    int nrow     = PQntuples(res);
+    int ncol     = PQnfields(res);
+    size_t ncell = (size_t)nrow * (size_t)ncol;
+    size_t nbyte = align8(sizeof(rowset_t)) + sizeof(cell_t) * ncell +
+                   sizeof(char *) * (size_t)ncol +
+                   align8(sizeof(libpq_coltype_t) * (size_t)ncol);
+    rowset_t *rs = NULL;
+    char *p      = NULL;
+
+    for (int col = 0; col < ncol; col++) {
+        nbyte += strlen(PQfname(res, col)) + 1;
+        if (!cols || cols->cols[col].type == LIBPQ_COL_TEXT) {
+            for (int row = 0; row < nrow; row++) {
+                nbyte += (size_t)PQgetlength(res, row, col);
+            }
+        }
+    }
+    if (!(rs = malloc(nbyte))) {
+        return NULL;
+    }
+    *size    = nbyte;
+    rs->next = NULL;
+    rs->nrow = nrow;
+    rs->ncol = ncol;
+    p        = (char *)rs + align8(sizeof(rowset_t));
+    rs->cells = (cell_t *)p;
+    p += sizeof(cell_t) * ncell;
+    rs->names = (char **)p;
+    p += sizeof(char *) * (size_t)ncol;
+    rs->types = (libpq_coltype_t *)p;
+    p += align8(sizeof(libpq_coltype_t) * (size_t)ncol);
+
+    for (int col = 0; col < ncol; col++) {
+        const char *name = PQfname(res, col);
+        size_t len       = strlen(name) + 1;
+
+        rs->names[col] = memcpy(p, name, len);
+        rs->types[col] = cols ? cols->cols[col].type : LIBPQ_COL_TEXT;
+        p += len;
+    }
+
+    for (int row = 0; row < nrow; row++) {
+        for (int col = 0; col < ncol; col++) {
+            const libpq_column_t *c = cols ? &cols->cols[col] : NULL;
+            cell_t *cell            = &rs->cells[(size_t)row * ncol + col];
+
+            if (PQgetisnull(res, row, col)) {
+                cell->len = -1;
+                continue;
+            }
+            cell->len = 0;
+            switch (rs->types[col]) {
+            case LIBPQ_COL_BOOL:
+                cell->v.i = (((uint8_t *)c->values)[row >> 3] >> (row & 7)) &
+                            1;
+                break;
+            case LIBPQ_COL_INT64:
+            case LIBPQ_COL_TIMESTAMP:
+                cell->v.i = ((int64_t *)c->values)[row];
+                break;
+            case LIBPQ_COL_DOUBLE:
+                cell->v.d = ((double *)c->values)[row];
+                break;
+            default:
+                cell->len   = PQgetlength(res, row, col);
+                cell->v.str = memcpy(p, PQgetvalue(res, row, col),
+                                     (size_t)cell->len);
+                p += cell->len;
+            }
+        }
+    }
+    return rs;
+}
+
+static inline proxy_t *checkproxy(lua_State *L, const char *tname)
+{
+    proxy_t *p = luaL_checkudata(L, 1, tname);
+    if (p->gen != p->arena->gen) {
+        luaL_error(L, "attempt to use a released arena");
+    }
+    return p;
+}
+
+static proxy_t *new_proxy(lua_State *L, const char *tname, proxy_t *src)
+{
+    proxy_t *p = lua_newuserdata(L, sizeof(proxy_t));
+
+    *p = *src;
+    p->arena->refs++;
+    lauxh_setmetatable(L, tname);
+    return p;
+}
+
+static int proxy_gc(lua_State *L)
+{
+    proxy_t *p = lua_touserdata(L, 1);
+    unref(p->arena);
+    return 0;
+}
+
+static void push_cell(lua_State *L, const rowset_t *rs, int row, int col)
+{
+    const cell_t *cell = &rs->cells[(size_t)row * rs->ncol + col];
+
+    if (cell->len == -1) {
+        lua_pushnil(L);
+        return;
+    }
+    switch (rs->types[col]) {
+    case LIBPQ_COL_BOOL:
+        lua_pushboolean(L, (int)cell->v.i);
+        break;
+    case LIBPQ_COL_INT64:
+        lua_pushinteger(L, (lua_Integer)cell->v.i);
+        break;
+    case LIBPQ_COL_DOUBLE:
+        lua_pushnumber(L, cell->v.d);
+        break;
+    case LIBPQ_COL_TIMESTAMP:
+        // seconds since the epoch
+        lua_pushnumber(L, (lua_Number)cell->v.i / 1e6);
+        break;
+    default:
+        lua_pushlstring(L, cell->v.str, (size_t)cell->len);
+    }
+}
+
+static int row_index_lua(lua_State *L)
+{
+    proxy_t *p         = checkproxy(L, LIBPQ_ARENA_ROW_MT);
+    const rowset_t *rs = p->rs;
+    int col            = -1;
+
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        const char *name = lua_tostring(L, 2);
+        for (int i = 0; i < rs->ncol; i++) {
+            if (strcmp(rs->names[i], name) == 0) {
+                col = i;
+                break;
+            }
+        }
+    } else if (lua_type(L, 2) == LUA_TNUMBER) {
+        col = (int)lua_tointeger(L, 2) - 1;
+    }
+    if (col < 0 || col >= rs->ncol) {
+        lua_pushnil(L);
+    } else {
+        push_cell(L, rs, p->row, col);
+    }
+    return 1;
+}
+
+static int row_len_lua(lua_State *L)
+{
+    proxy_t *p = checkproxy(L, LIBPQ_ARENA_ROW_MT);
+    lua_pushinteger(L, p->rs->ncol);
+    return 1;
+}
+
+static int row_tostring_lua(lua_State *L)
+{
+    return libpq_tostring(L, LIBPQ_ARENA_ROW_MT);
+}
+
+static int rows_index_lua(lua_State *L)
+{
+    proxy_t *p = checkproxy(L, LIBPQ_ARENA_ROWS_MT);
+    int row    = -1;
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        row = (int)lua_tointeger(L, 2) - 1;
+    }
+    if (row < 0 || row >= p->rs->nrow) {
+        lua_pushnil(L);
+    } else {
+        new_proxy(L, LIBPQ_ARENA_ROW_MT, p)->row = row;
+    }
+    return 1;
+}
+
+static int rows_len_lua(lua_State *L)
+{
+    proxy_t *p = checkproxy(L, LIBPQ_ARENA_ROWS_MT);
+    lua_pushinteger(L, p->rs->nrow);
+    return 1;
+}
+
+static int rows_tostring_lua(lua_State *L)
+{
+    return libpq_tostring(L, LIBPQ_ARENA_ROWS_MT);
+}
+
+libpq_arena_t *libpq_check_arena(lua_State *L, int idx)
+{
+    arena_t *a = luaL_checkudata(L, idx, LIBPQ_ARENA_MT);
+    if (!a->arena) {
+        luaL_error(L, "attempt to use a freed object");
+    }
+    return a->arena;
+}
+
+/**
+ * copies the rows of res into the arena, and pushes the proxy of the rows.
+ * cols is the decoded columns of res, or NULL to keep all values as the
+ * text. returns 0 on success, otherwise -1 and errno is set.
+ */
+int libpq_arena_push_rows(lua_State *L, libpq_arena_t *a, const PGresult *res,
+                          const libpq_columns_t *cols)
+{
+    size_t size = 0;
+    proxy_t src = {
+        .arena = a,
+        .gen   = a->gen,
+    };
+    rowset_t *rs = new_rowset(res, cols, &size);
+
+    if (!rs) {
+        errno = ENOMEM;
+        return -1;
+    }
+    rs->next   = a->rowsets;
+    a->rowsets = rs;
+    a->size += size;
+    src.rs = rs;
+    new_proxy(L, LIBPQ_ARENA_ROWS_MT, &src);
+    return 0;
+}
+
+static int release_lua(lua_State *L)
+{
+    release(libpq_check_arena(L, 1));
+    return 0;
+}
+
+static int size_lua(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)libpq_check_arena(L, 1)->size);
+    return 1;
+}
+
+static int gc_lua(lua_State *L)
+{
+    arena_t *a = luaL_checkudata(L, 1, LIBPQ_ARENA_MT);
+
+    if (a->arena) {
+        unref(a->arena);
+        a->arena = NULL;
+    }
+    return 0;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    return libpq_tostring(L, LIBPQ_ARENA_MT);
+}
+
+static int arena_lua(lua_State *L)
+{
+    arena_t *a = lua_newuserdata(L, sizeof(arena_t));
+
+    if (!(a->arena = calloc(1, sizeof(libpq_arena_t)))) {
+        lua_pushnil(L);
+        lua_errno_new(L, errno, "arena");
+        return 2;
+    }
+    a->arena->refs = 1;
+    lauxh_setmetatable(L, LIBPQ_ARENA_MT);
+    return 1;
+}
+
+/**
+ * the proxies have no method table, since all keys are looked up by the
+ * __index metamethod.
+ */
+static void register_proxy_mt(lua_State *L, const char *tname,
+                              struct luaL_Reg mmethod[])
+{
+    luaL_newmetatable(L, tname);
+    for (struct luaL_Reg *ptr = mmethod; ptr->name; ptr++) {
+        lauxh_pushfn2tbl(L, ptr->name, ptr->func);
+    }
+    lua_pop(L, 1);
+}
+
+void libpq_arena_init(lua_State *L)
+{
+    struct luaL_Reg mmethod[] = {
+        {"__gc",       gc_lua      },
+        {"__tostring", tostring_lua},
+        {NULL,         NULL        }
+    };
+    struct luaL_Reg method[] = {
+        {"release", release_lua},
+        {"size",    size_lua   },
+        {NULL,      NULL       }
+    };
+    struct luaL_Reg rows_mmethod[] = {
+        {"__gc",       proxy_gc         },
+        {"__index",    rows_index_lua   },
+        {"__len",      rows_len_lua     },
+        {"__tostring", rows_tostring_lua},
+        {NULL,         NULL             }
+    };
+    struct luaL_Reg row_mmethod[] = {
+        {"__gc",       proxy_gc        },
+        {"__index",    row_index_lua   },
+        {"__len",      row_len_lua     },
+        {"__tostring", row_tostring_lua},
+        {NULL,         NULL            }
+    };
+
+    libpq_register_mt(L, LIBPQ_ARENA_MT, mmethod, method);
+    register_proxy_mt(L, LIBPQ_ARENA_ROWS_MT, rows_mmethod);
+    register_proxy_mt(L, LIBPQ_ARENA_ROW_MT, row_mmethod);
+    lauxh_pushfn2tbl(L, "arena", arena_lua);
+}
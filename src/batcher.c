@@ -0,0 +1,406 @@
+/**
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+// lua
+#include "lua_libpq.h"
+
+/**
+ * the batcher buffers the rows of the multi-row INSERT statement and
+ * executes them at once as follows;
+ *  <prefix> ($1,$2),($3,$4),...[ <suffix>]
+ *
+ * a full batch is executed by the statement that prepared at the first
+ * flush, so that the server parses it only once. the statement is kept on
+ * the connection and shared by the batchers of the same shape. the rest of
+ * the rows are executed by the unnamed statement.
+ */
+
+// the number of parameters is sent as 16-bit integer
+#define BATCHER_MAXPARAMS 65535
+// offset of the NULL value
+#define BATCHER_NULL SIZE_MAX
+// registry field of the prepared statements of the connections
+#define BATCHER_STMTS "libpq.batcher.stmts"
+
+typedef struct {
+    int ref_conn;
+    int ncol;
+    int max_rows;
+    size_t max_bytes;
+    char *prefix;
+    size_t prefix_len;
+    char *suffix;
+    size_t suffix_len;
+    // values of the buffered rows. each value is terminated by NUL and
+    // located by the offset from the head of the buffer.
+    int nrows;
+    libpq_buf_t values;
+    size_t *offsets;
+    const char **params;
+    // the name of the prepared statement for a full batch
+    char stmt[48];
+    int prepared;
+    libpq_buf_t sql;
+    // stats
+    uint64_t flushes;
+    uint64_t flushed_rows;
+    uint64_t prepared_flushes;
+} batcher_t;
+
+static inline batcher_t *checkself(lua_State *L)
+{
+    batcher_t *b = luaL_checkudata(L, 1, LIBPQ_BATCHER_MT);
+    if (!b->offsets) {
+        luaL_error(L, "attempt to use a freed object");
+    }
+    return b;
+}
+
+/**
+ * builds the statement for the nrows rows into the sql buffer.
+ */
+static int build_sql(batcher_t *b, int nrows)
+{
+    // each placeholder takes at most 7 bytes: "$65535,"
+    size_t rowlen = 3 + (size_t)b->ncol * 7;
+    char *p       = NULL;
+    int n         = 1;
+
+    b->sql.len = 0;
+    if (libpq_buf_reserve(&b->sql, b->prefix_len + b->suffix_len + 3 +
+                                       rowlen * (size_t)nrows)) {
+        return -1;
+    }
+
+    p = b->sql.data;
+    memcpy(p, b->prefix, b->prefix_len);
+    p += b->prefix_len;
+    *p++ = ' ';
+    for (int i = 0; i < nrows; i++) {
+        *p++ = '(';
+        for (int j = 0; j < b->ncol; j++) {
+            p += sprintf(p, "$%d,", n++);
+        }
+        // replace the last comma
+        p[-1] = ')';
+        *p++  = ',';
+    }
+    p--;
+    if (b->suffix_len) {
+        *p++ = ' ';
+        memcpy(p, b->suffix, b->suffix_len);
+        p += b->suffix_len;
+    }
+    *p         = 0;
+    b->sql.len = (size_t)(p - b->sql.data);
+    return 0;
+}
+
+/**
+ * prepares the statement for a full batch on the connection at conn_idx, or
+ * reuses the statement that prepared by the batcher of the same prefix,
+ * ncol, suffix and max_rows. returns 0 on success, otherwise pushes nil and
+ * error and returns 2.
+ */
+static int prepare_stmt(lua_State *L, batcher_t *b, int conn_idx,
+                        const char *op)
+{
+    static unsigned long seq = 0;
+    int top                  = lua_gettop(L);
+    int rv                   = 0;
+
+    // the statements of the connection: stmts[conn][key] = name
+    lua_getfield(L, LUA_REGISTRYINDEX, BATCHER_STMTS);
+    lua_pushvalue(L, conn_idx);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, conn_idx);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_pushfstring(L, "%d:%d:%d:", b->ncol, b->max_rows, (int)b->prefix_len);
+    lua_pushlstring(L, b->prefix, b->prefix_len);
+    lua_pushlstring(L, b->suffix, b->suffix_len);
+    lua_concat(L, 3);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        snprintf(b->stmt, sizeof(b->stmt), "%s", lua_tostring(L, -1));
+        lua_settop(L, top);
+        return 0;
+    }
+    lua_pop(L, 1);
+
+    snprintf(b->stmt, sizeof(b->stmt), "libpq_batcher_%lu_%d",
+             __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED), b->max_rows);
+    if (build_sql(b, b->max_rows)) {
+        lua_pushnil(L);
+        lua_errno_new(L, errno, op);
+        return 2;
+    } else if ((rv = libpq_conn_prepare(L, conn_idx, b->stmt, b->sql.data,
+                                        b->sql.len, b->ncol * b->max_rows,
+                                        op))) {
+        return rv;
+    }
+    lua_pushstring(L, b->stmt);
+    lua_rawset(L, -3);
+    lua_settop(L, top);
+    return 0;
+}
+
+/**
+ * executes the buffered rows and pushes the result object, or nil and error.
+ * the rows are discarded even if the execution fails.
+ */
+static int flush_rows(lua_State *L, batcher_t *b, const char *op)
+{
+    int nrows    = b->nrows;
+    int nparams  = nrows * b->ncol;
+    int conn_idx = 0;
+    int rv       = 0;
+
+    if (!nrows) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    for (int i = 0; i < nparams; i++) {
+        if (b->offsets[i] == BATCHER_NULL) {
+            b->params[i] = NULL;
+        } else {
+            b->params[i] = b->values.data + b->offsets[i];
+        }
+    }
+    b->nrows      = 0;
+    b->values.len = 0;
+    b->flushes++;
+    b->flushed_rows += nrows;
+
+    lauxh_pushref(L, b->ref_conn);
+    conn_idx = lua_gettop(L);
+    if (nrows == b->max_rows) {
+        // reuse the prepared statement for a full batch
+        if (!b->prepared) {
+            if ((rv = prepare_stmt(L, b, conn_idx, op))) {
+                return rv;
+            }
+            b->prepared = 1;
+        }
+        b->prepared_flushes++;
+        return libpq_conn_exec(L, conn_idx, b->stmt, NULL, 0, nparams,
+                               b->params, op);
+    } else if (build_sql(b, nrows)) {
+        lua_pushnil(L);
+        lua_errno_new(L, errno, op);
+        return 2;
+    }
+    return libpq_conn_exec(L, conn_idx, NULL, b->sql.data, b->sql.len,
+                           nparams, b->params, op);
+}
+
+static int flush_lua(lua_State *L)
+{
+    batcher_t *b = checkself(L);
+    return flush_rows(L, b, "flush");
+}
+
+static int add_lua(lua_State *L)
+{
+    batcher_t *b    = checkself(L);
+    int narg        = lua_gettop(L) - 1;
+    size_t head     = b->values.len;
+    size_t *offsets = b->offsets + (size_t)b->nrows * b->ncol;
+
+    if (narg > b->ncol) {
+        return lauxh_argerror(L, b->ncol + 2,
+                              "at most %d values expected, got %d", b->ncol,
+                              narg);
+    }
+
+    for (int i = 0; i < b->ncol; i++) {
+        int idx         = i + 2;
+        size_t len      = 0;
+        const char *val = NULL;
+
+        if (i >= narg || !libpq_param2string(L, idx)) {
+            offsets[i] = BATCHER_NULL;
+            continue;
+        }
+        val = lua_tolstring(L, idx, &len);
+        if (libpq_buf_reserve(&b->values, len + 1)) {
+            // discard the partial row
+            b->values.len = head;
+            lua_pushnil(L);
+            lua_errno_new(L, errno, "add");
+            return 2;
+        }
+        offsets[i] = b->values.len;
+        memcpy(b->values.data + b->values.len, val, len + 1);
+        b->values.len += len + 1;
+    }
+    b->nrows++;
+
+    if (b->nrows < b->max_rows && b->values.len < b->max_bytes) {
+        // buffered
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    return flush_rows(L, b, "add");
+}
+
+static int pending_lua(lua_State *L)
+{
+    batcher_t *b = checkself(L);
+
+    lua_pushinteger(L, b->nrows);
+    lua_pushinteger(L, b->values.len);
+    return 2;
+}
+
+static int stat_lua(lua_State *L)
+{
+    batcher_t *b = checkself(L);
+
+    lua_createtable(L, 0, 6);
+    lauxh_pushint2tbl(L, "ncol", b->ncol);
+    lauxh_pushint2tbl(L, "max_rows", b->max_rows);
+    lauxh_pushint2tbl(L, "max_bytes", b->max_bytes);
+    lauxh_pushint2tbl(L, "flushes", b->flushes);
+    lauxh_pushint2tbl(L, "rows", b->flushed_rows);
+    lauxh_pushint2tbl(L, "prepared_flushes", b->prepared_flushes);
+    return 1;
+}
+
+static int conn_lua(lua_State *L)
+{
+    batcher_t *b = checkself(L);
+    lauxh_pushref(L, b->ref_conn);
+    return 1;
+}
+
+static int gc_lua(lua_State *L)
+{
+    batcher_t *b = luaL_checkudata(L, 1, LIBPQ_BATCHER_MT);
+
+    // the buffered rows are discarded
+    b->ref_conn = lauxh_unref(L, b->ref_conn);
+    free(b->prefix);
+    free(b->suffix);
+    free(b->offsets);
+    free(b->params);
+    libpq_buf_free(&b->values);
+    libpq_buf_free(&b->sql);
+    b->prefix  = NULL;
+    b->suffix  = NULL;
+    b->offsets = NULL;
+    b->params  = NULL;
+    return 0;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    return libpq_tostring(L, LIBPQ_BATCHER_MT);
+}
+
+/**
+ * pushes the batcher of the connection at index 1. max_rows is clamped to
+ * the parameter limit of the protocol. returns 0 on success, or -1 if
+ * failed to allocate memory.
+ */
+int libpq_batcher_new(lua_State *L, const char *prefix, size_t prefix_len,
+                      const char *suffix, size_t suffix_len, int ncol,
+                      int max_rows, size_t max_bytes)
+{
+    batcher_t *b   = NULL;
+    size_t nvalues = 0;
+
+    if (max_rows > BATCHER_MAXPARAMS / ncol) {
+        max_rows = BATCHER_MAXPARAMS / ncol;
+    }
+    nvalues = (size_t)max_rows * ncol;
+
+    b  = lua_newuserdata(L, sizeof(batcher_t));
+    *b = (batcher_t){
+        .ref_conn   = LUA_NOREF,
+        .ncol       = ncol,
+        .max_rows   = max_rows,
+        .max_bytes  = max_bytes,
+        .prefix_len = prefix_len,
+        .suffix_len = suffix_len,
+        .prefix     = malloc(prefix_len + 1),
+        .suffix     = malloc(suffix_len + 1),
+        .offsets    = malloc(sizeof(size_t) * nvalues),
+        .params     = malloc(sizeof(char *) * nvalues),
+    };
+    lauxh_setmetatable(L, LIBPQ_BATCHER_MT);
+    if (!b->prefix || !b->suffix || !b->offsets || !b->params) {
+        free(b->prefix);
+        free(b->suffix);
+        free(b->offsets);
+        free(b->params);
+        *b    = (batcher_t){.ref_conn = LUA_NOREF};
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(b->prefix, prefix, prefix_len + 1);
+    memcpy(b->suffix, suffix, suffix_len + 1);
+    b->ref_conn = lauxh_refat(L, 1);
+    return 0;
+}
+
+void libpq_batcher_init(lua_State *L)
+{
+    struct luaL_Reg mmethod[] = {
+        {"__gc",       gc_lua      },
+        {"__tostring", tostring_lua},
+        {NULL,         NULL        }
+    };
+    struct luaL_Reg method[] = {
+        {"conn",    conn_lua   },
+        {"add",     add_lua    },
+        {"flush",   flush_lua  },
+        {"pending", pending_lua},
+        {"stat",    stat_lua   },
+        {NULL,      NULL       }
+    };
+
+    libpq_register_mt(L, LIBPQ_BATCHER_MT, mmethod, method);
+
+    // create the table of the prepared statements. the statements are alive
+    // until the end of the session, so they are kept while the connection
+    // is alive.
+    lua_getfield(L, LUA_REGISTRYINDEX, BATCHER_STMTS);
+    if (lua_isnil(L, -1)) {
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lauxh_pushstr2tbl(L, "__mode", "k");
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, BATCHER_STMTS);
+    }
+    lua_pop(L, 1);
+}
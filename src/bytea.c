@@ -0,0 +1,206 @@
+/**
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+// lua
+#include "lua_libpq.h"
+
+/**
+ * decodes the bytea value in the hex or escape format into the luaL_Buffer
+ * directly, instead of decoding into the buffer allocated by
+ * PQunescapeBytea and copying it into the lua string.
+ * the invalid characters are handled in the same way as PQunescapeBytea.
+ */
+
+static const signed char HEXVAL[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x00
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x10
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x20
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  -1, -1, -1, -1, -1, -1, // 0x30
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x40
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x50
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x60
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x70
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x80
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x90
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xa0
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xb0
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xc0
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xd0
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xe0
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xf0
+};
+
+#if defined(__SSE2__)
+
+/**
+ * decodes the 32 hex characters into the 16 bytes.
+ * returns 0 if the src contains the non-hex characters.
+ */
+static inline int hex_decode32(unsigned char *dst, const unsigned char *src)
+{
+    const __m128i c0  = _mm_set1_epi8('0' - 1);
+    const __m128i c9  = _mm_set1_epi8('9' + 1);
+    const __m128i ca  = _mm_set1_epi8('a' - 1);
+    const __m128i cf  = _mm_set1_epi8('f' + 1);
+    const __m128i lc  = _mm_set1_epi8(0x20);
+    const __m128i d0  = _mm_set1_epi8('0');
+    const __m128i da  = _mm_set1_epi8('a' - 10);
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    __m128i v[2];
+
+    for (int i = 0; i < 2; i++) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i * 16));
+        __m128i l = _mm_or_si128(c, lc);
+        // the non-ascii characters are negative and fail the comparisons
+        __m128i isdigit =
+            _mm_and_si128(_mm_cmpgt_epi8(c, c0), _mm_cmplt_epi8(c, c9));
+        __m128i isalpha =
+            _mm_and_si128(_mm_cmpgt_epi8(l, ca), _mm_cmplt_epi8(l, cf));
+
+        if (_mm_movemask_epi8(_mm_or_si128(isdigit, isalpha)) != 0xffff) {
+            return 0;
+        }
+        c = _mm_or_si128(_mm_and_si128(isdigit, _mm_sub_epi8(c, d0)),
+                         _mm_and_si128(isalpha, _mm_sub_epi8(l, da)));
+        // combine the high nibble in the even byte and the low nibble in the
+        // odd byte of each 16-bit lane
+        v[i] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(c, low), 4),
+                            _mm_srli_epi16(c, 8));
+    }
+    _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(v[0], v[1]));
+    return 1;
+}
+
+#endif
+
+/**
+ * decodes the hex characters from *src until the end or the cap bytes are
+ * written to dst, and returns the number of bytes written.
+ */
+static size_t hex_decode(unsigned char *dst, size_t cap,
+                         const unsigned char **src, const unsigned char *end)
+{
+    const unsigned char *s = *src;
+    size_t n               = 0;
+
+    while (s < end && n < cap) {
+        signed char v1 = 0;
+        signed char v2 = 0;
+
+#if defined(__SSE2__)
+        while (end - s >= 32 && cap - n >= 16 && hex_decode32(dst + n, s)) {
+            s += 32;
+            n += 16;
+        }
+        if (s == end || n == cap) {
+            break;
+        }
+#endif
+        v1 = HEXVAL[*s++];
+        if (s == end || v1 == -1) {
+            continue;
+        }
+        v2 = HEXVAL[*s++];
+        if (v2 != -1) {
+            dst[n++] = (unsigned char)((v1 << 4) | v2);
+        }
+    }
+
+    *src = s;
+    return n;
+}
+
+#define ISFIRSTOCTDIGIT(c) ((c) >= '0' && (c) <= '3')
+#define ISOCTDIGIT(c)      ((c) >= '0' && (c) <= '7')
+
+/**
+ * decodes the escape format from *src until the end or the cap bytes are
+ * written to dst, and returns the number of bytes written.
+ */
+static size_t escape_decode(unsigned char *dst, size_t cap,
+                            const unsigned char **src,
+                            const unsigned char *end)
+{
+    const unsigned char *s = *src;
+    size_t n               = 0;
+
+    while (s < end && n < cap) {
+        if (*s != '\\') {
+            dst[n++] = *s++;
+        } else if (++s == end) {
+            break;
+        } else if (*s == '\\') {
+            dst[n++] = *s++;
+        } else if (end - s >= 3 && ISFIRSTOCTDIGIT(s[0]) &&
+                   ISOCTDIGIT(s[1]) && ISOCTDIGIT(s[2])) {
+            dst[n++] = (unsigned char)(((s[0] - '0') << 6) |
+                                       ((s[1] - '0') << 3) | (s[2] - '0'));
+            s += 3;
+        }
+        // the backslash followed by the unrecognized character is ignored,
+        // and the character is decoded as ordinary data
+    }
+
+    *src = s;
+    return n;
+}
+
+void libpq_push_bytea(lua_State *L, const char *str, size_t len)
+{
+    const unsigned char *s   = (const unsigned char *)str;
+    const unsigned char *end = s + len;
+    int hex                  = len >= 2 && s[0] == '\\' && s[1] == 'x';
+    luaL_Buffer b;
+
+#if LUA_VERSION_NUM >= 502
+    // decode into the buffer of the exact size at once
+    size_t cap         = hex ? (len - 2) / 2 : len;
+    unsigned char *dst = (unsigned char *)luaL_buffinitsize(L, &b, cap);
+
+    if (hex) {
+        s += 2;
+        luaL_pushresultsize(&b, hex_decode(dst, cap, &s, end));
+    } else {
+        luaL_pushresultsize(&b, escape_decode(dst, cap, &s, end));
+    }
+
+#else
+    luaL_buffinit(L, &b);
+    if (hex) {
+        s += 2;
+    }
+    while (s < end) {
+        unsigned char *dst = (unsigned char *)luaL_prepbuffer(&b);
+
+        if (hex) {
+            luaL_addsize(&b, hex_decode(dst, LUAL_BUFFERSIZE, &s, end));
+        } else {
+            luaL_addsize(&b, escape_decode(dst, LUAL_BUFFERSIZE, &s, end));
+        }
+    }
+    luaL_pushresult(&b);
+#endif
+}
@@ -0,0 +1,891 @@
+/**
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+// lua
+#include "lua_libpq.h"
+
+/**
+ * the column decoder converts the values of the result into the typed
+ * arrays. the columns are split into the units of rows that decoded on the
+ * worker threads, and the threads never touch the lua_State.
+ *
+ * a column falls back to text if any value cannot be decoded, e.g. the
+ * infinity timestamp or the date style other than ISO.
+ */
+
+// the minimum number of rows of the unit. the number of rows of each unit is
+// a multiple of 64, so that the units never share a byte of the bitmaps.
+#define DECODE_MINROWS 4096
+
+// microseconds between 1970-01-01 and the postgres epoch 2000-01-01
+#define PG_EPOCH_USEC 946684800000000LL
+
+typedef struct {
+    int col;
+    int row_from;
+    int row_to;
+} unit_t;
+
+typedef struct {
+    const PGresult *res;
+    libpq_columns_t *cols;
+    unit_t *units;
+    int nunit;
+    int next;
+    int eno;
+} job_t;
+
+static inline void set_bit(uint8_t *bitmap, int i)
+{
+    bitmap[i >> 3] |= (uint8_t)(1 << (i & 7));
+}
+
+static inline uint64_t load_be(const char *s, int len)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    uint64_t v             = 0;
+
+    for (int i = 0; i < len; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static int parse_int64(const char *s, size_t len, int64_t *v)
+{
+    const char *end = s + len;
+    uint64_t u      = 0;
+    int neg         = 0;
+
+    if (s < end && (*s == '-' || *s == '+')) {
+        neg = *s++ == '-';
+    }
+    if (s == end) {
+        return -1;
+    }
+    for (; s < end; s++) {
+        unsigned d = (unsigned char)*s - '0';
+        if (d > 9 || u > (UINT64_MAX - d) / 10) {
+            return -1;
+        }
+        u = u * 10 + d;
+    }
+
+    if (neg) {
+        if (u > (uint64_t)INT64_MAX + 1) {
+            return -1;
+        }
+        *v = (int64_t)(0 - u);
+    } else if (u > INT64_MAX) {
+        return -1;
+    } else {
+        *v = (int64_t)u;
+    }
+    return 0;
+}
+
+static int parse_double(const char *s, size_t len, double *v)
+{
+    char *end = NULL;
+
+    // the values of the result are terminated by NUL
+    if (!len) {
+        return -1;
+    }
+    *v = strtod(s, &end);
+    return end == s + len ? 0 : -1;
+}
+
+static int parse_digits(const char **s, const char *end, int n, int *v)
+{
+    int x = 0;
+
+    for (int i = 0; i < n; i++, (*s)++) {
+        if (*s >= end || (unsigned)(**s - '0') > 9) {
+            return -1;
+        }
+        x = x * 10 + (**s - '0');
+    }
+    *v = x;
+    return 0;
+}
+
+static inline int parse_char(const char **s, const char *end, char c)
+{
+    if (*s < end && **s == c) {
+        (*s)++;
+        return 0;
+    }
+    return -1;
+}
+
+static inline int64_t days_from_civil(int y, int m, int d)
+{
+    int64_t era = 0;
+    int yoe     = 0;
+    int doy     = 0;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (int)(y - era * 400);
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/**
+ * parses the timestamp in the ISO date style as follows;
+ *  YYYY-MM-DD HH:MM:SS[.ffffff][{+|-}HH[:MM[:SS]]]
+ */
+static int parse_timestamp(const char *s, size_t len, int64_t *v)
+{
+    const char *end = s + len;
+    int y = 0, mon = 0, d = 0, h = 0, min = 0, sec = 0, frac = 0;
+    int64_t usec = 0;
+
+    if (parse_digits(&s, end, 4, &y) || parse_char(&s, end, '-') ||
+        parse_digits(&s, end, 2, &mon) || parse_char(&s, end, '-') ||
+        parse_digits(&s, end, 2, &d) || parse_char(&s, end, ' ') ||
+        parse_digits(&s, end, 2, &h) || parse_char(&s, end, ':') ||
+        parse_digits(&s, end, 2, &min) || parse_char(&s, end, ':') ||
+        parse_digits(&s, end, 2, &sec) || mon < 1 || mon > 12 || d < 1 ||
+        d > 31 || h > 23 || min > 59 || sec > 59) {
+        return -1;
+    } else if (!parse_char(&s, end, '.')) {
+        int n = 0;
+
+        for (; s < end && (unsigned)(*s - '0') <= 9; s++, n++) {
+            if (n == 6) {
+                return -1;
+            }
+            frac = frac * 10 + (*s - '0');
+        }
+        if (!n) {
+            return -1;
+        }
+        for (; n < 6; n++) {
+            frac *= 10;
+        }
+    }
+    usec = ((days_from_civil(y, mon, d) * 86400 + h * 3600 + min * 60 + sec) *
+            1000000) +
+           frac;
+
+    // UTC offset of timestamptz
+    if (s < end && (*s == '+' || *s == '-')) {
+        int64_t sign = *s++ == '-' ? -1 : 1;
+        int oh = 0, om = 0, os = 0;
+
+        if (parse_digits(&s, end, 2, &oh) ||
+            (!parse_char(&s, end, ':') &&
+             (parse_digits(&s, end, 2, &om) ||
+              (!parse_char(&s, end, ':') && parse_digits(&s, end, 2, &os))))) {
+            return -1;
+        }
+        usec -= sign * (oh * 3600 + om * 60 + os) * 1000000;
+    }
+    if (s != end) {
+        return -1;
+    }
+    *v = usec;
+    return 0;
+}
+
+static int decode_value(libpq_column_t *c, int binary, const char *s,
+                        size_t len, int row)
+{
+    int64_t i64 = 0;
+    double dbl  = 0;
+
+    switch (c->type) {
+    case LIBPQ_COL_BOOL:
+        if (len != 1) {
+            return -1;
+        } else if (binary ? *s : *s == 't') {
+            set_bit(c->values, row);
+        } else if (!binary && *s != 'f') {
+            return -1;
+        }
+        return 0;
+
+    case LIBPQ_COL_INT64:
+        if (!binary) {
+            if (parse_int64(s, len, &i64)) {
+                return -1;
+            }
+        } else if (len == 2) {
+            i64 = (int16_t)load_be(s, 2);
+        } else if (len == 4) {
+            // oid is unsigned
+            i64 = c->oid == OIDOID ? (int64_t)(uint32_t)load_be(s, 4) :
+                                     (int64_t)(int32_t)load_be(s, 4);
+        } else if (len == 8) {
+            i64 = (int64_t)load_be(s, 8);
+        } else {
+            return -1;
+        }
+        ((int64_t *)c->values)[row] = i64;
+        return 0;
+
+    case LIBPQ_COL_DOUBLE:
+        if (!binary) {
+            if (parse_double(s, len, &dbl)) {
+                return -1;
+            }
+        } else if (len == 4) {
+            uint32_t u = (uint32_t)load_be(s, 4);
+            float f    = 0;
+            memcpy(&f, &u, sizeof(f));
+            dbl = f;
+        } else if (len == 8) {
+            uint64_t u = load_be(s, 8);
+            memcpy(&dbl, &u, sizeof(dbl));
+        } else {
+            return -1;
+        }
+        ((double *)c->values)[row] = dbl;
+        return 0;
+
+    case LIBPQ_COL_TIMESTAMP:
+        if (!binary) {
+            if (parse_timestamp(s, len, &i64)) {
+                return -1;
+            }
+        } else if (len != 8) {
+            return -1;
+        } else {
+            i64 = (int64_t)load_be(s, 8);
+            // infinity and -infinity
+            if (i64 == INT64_MAX || i64 == INT64_MIN) {
+                return -1;
+            }
+            i64 += PG_EPOCH_USEC;
+        }
+        ((int64_t *)c->values)[row] = i64;
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+static void decode_unit(const PGresult *res, libpq_column_t *c, unit_t *u)
+{
+    int binary    = PQfformat(res, u->col);
+    int64_t nnull = 0;
+
+    for (int row = u->row_from; row < u->row_to; row++) {
+        if (PQgetisnull(res, row, u->col)) {
+            nnull++;
+            continue;
+        } else if (decode_value(c, binary, PQgetvalue(res, row, u->col),
+                                PQgetlength(res, row, u->col), row)) {
+            __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        set_bit(c->validity, row);
+    }
+    __atomic_add_fetch(&c->null_count, nnull, __ATOMIC_RELAXED);
+}
+
+/**
+ * copies the values of the column into the offsets and data. returns 0 on
+ * success, or errno on failure.
+ */
+static int decode_text(const PGresult *res, libpq_column_t *c, int col,
+                       int nrow)
+{
+    size_t nbyte     = (size_t)(nrow + 7) / 8;
+    int64_t *offsets = NULL;
+    int64_t len      = 0;
+
+    if (!(c->validity = calloc(1, nbyte ? nbyte : 1)) ||
+        !(c->values = offsets = malloc(sizeof(int64_t) * (nrow + 1)))) {
+        return ENOMEM;
+    }
+
+    c->null_count = 0;
+    offsets[0]    = 0;
+    for (int row = 0; row < nrow; row++) {
+        if (PQgetisnull(res, row, col)) {
+            c->null_count++;
+        } else {
+            set_bit(c->validity, row);
+            len += PQgetlength(res, row, col);
+        }
+        offsets[row + 1] = len;
+    }
+
+    if (!(c->data = malloc(len ? len : 1))) {
+        return ENOMEM;
+    }
+    for (int row = 0; row < nrow; row++) {
+        memcpy(c->data + offsets[row], PQgetvalue(res, row, col),
+               offsets[row + 1] - offsets[row]);
+    }
+    return 0;
+}
+
+static void *decode_units(void *arg)
+{
+    job_t *j = (job_t *)arg;
+    int i    = 0;
+
+    while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) <
+           j->nunit) {
+        unit_t *u         = &j->units[i];
+        libpq_column_t *c = &j->cols->cols[u->col];
+        int eno           = 0;
+
+        if (c->type != LIBPQ_COL_TEXT) {
+            if (!__atomic_load_n(&c->failed, __ATOMIC_RELAXED)) {
+                decode_unit(j->res, c, u);
+            }
+        } else if ((eno = decode_text(j->res, c, u->col, j->cols->nrow))) {
+            __atomic_store_n(&j->eno, eno, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static libpq_coltype_t column_type(Oid oid)
+{
+    switch (oid) {
+    case BOOLOID:
+        return LIBPQ_COL_BOOL;
+    case INT2OID:
+    case INT4OID:
+    case INT8OID:
+    case OIDOID:
+        return LIBPQ_COL_INT64;
+    case FLOAT4OID:
+    case FLOAT8OID:
+        return LIBPQ_COL_DOUBLE;
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+        return LIBPQ_COL_TIMESTAMP;
+    default:
+        return LIBPQ_COL_TEXT;
+    }
+}
+
+static void free_column(libpq_column_t *c)
+{
+    free(c->validity);
+    free(c->values);
+    free(c->data);
+    c->validity = NULL;
+    c->values   = NULL;
+    c->data     = NULL;
+}
+
+void libpq_columns_free(libpq_columns_t *cols)
+{
+    if (cols->cols) {
+        for (int i = 0; i < cols->ncol; i++) {
+            free_column(&cols->cols[i]);
+            free(cols->cols[i].name);
+        }
+        free(cols->cols);
+        cols->cols = NULL;
+    }
+    free(cols->arrow);
+    cols->arrow = NULL;
+}
+
+/**
+ * allocates the arrays of the typed columns, and returns the number of the
+ * units. returns -1 on failure.
+ */
+static int alloc_columns(libpq_columns_t *cols, const PGresult *res,
+                         int with_text, const libpq_coltype_t *types,
+                         int chunk)
+{
+    size_t nbyte = (size_t)(cols->nrow + 7) / 8;
+    int nunit    = 0;
+
+    for (int col = 0; col < cols->ncol; col++) {
+        libpq_column_t *c = &cols->cols[col];
+
+        c->oid  = PQftype(res, col);
+        c->type = types ? types[col] : column_type(c->oid);
+        if (!(c->name = strdup(PQfname(res, col)))) {
+            return -1;
+        } else if (c->type == LIBPQ_COL_TEXT) {
+            nunit += with_text;
+            continue;
+        } else if (!(c->validity = calloc(1, nbyte ? nbyte : 1))) {
+            return -1;
+        } else if (c->type == LIBPQ_COL_BOOL) {
+            c->values = calloc(1, nbyte ? nbyte : 1);
+        } else {
+            c->values = calloc(cols->nrow ? cols->nrow : 1, 8);
+        }
+        if (!c->values) {
+            return -1;
+        }
+        nunit += (cols->nrow + chunk - 1) / chunk;
+    }
+    return nunit;
+}
+
+/**
+ * decodes the values of res into cols. nrow, ncol and the zero-filled cols
+ * array must be set before the call. if types is not NULL, the columns are
+ * decoded as the given types, and it fails with EINVAL instead of the
+ * fallback to text.
+ * cols must be released by libpq_columns_free even if it fails.
+ */
+int libpq_columns_decode(libpq_columns_t *cols, const PGresult *res,
+                         int nthreads, int with_text,
+                         const libpq_coltype_t *types)
+{
+    // split the rows to keep the threads busy until the end
+    int chunk      = (cols->nrow + nthreads * 4 - 1) / (nthreads * 4);
+    int nunit      = 0;
+    job_t j        = {.res = res, .cols = cols};
+    pthread_t *tid = NULL;
+    int nthr       = 0;
+
+    if (chunk < DECODE_MINROWS) {
+        chunk = DECODE_MINROWS;
+    }
+    chunk = (chunk + 63) & ~63;
+    if ((nunit = alloc_columns(cols, res, with_text, types, chunk)) < 0) {
+        return ENOMEM;
+    } else if (!(j.units = malloc(sizeof(unit_t) * (nunit ? nunit : 1)))) {
+        return ENOMEM;
+    }
+    for (int col = 0; col < cols->ncol; col++) {
+        if (cols->cols[col].type != LIBPQ_COL_TEXT) {
+            for (int row = 0; row < cols->nrow; row += chunk) {
+                j.units[j.nunit++] = (unit_t){
+                    .col      = col,
+                    .row_from = row,
+                    .row_to = row + chunk < cols->nrow ? row + chunk : cols->nrow,
+                };
+            }
+        } else if (with_text) {
+            j.units[j.nunit++] = (unit_t){.col = col};
+        }
+    }
+
+    // the calling thread is one of the workers
+    if (nthreads > nunit) {
+        nthreads = nunit;
+    }
+    if (nthreads > 1 && (tid = malloc(sizeof(pthread_t) * (nthreads - 1)))) {
+        for (; nthr < nthreads - 1; nthr++) {
+            if (pthread_create(&tid[nthr], NULL, decode_units, &j)) {
+                break;
+            }
+        }
+    }
+    decode_units(&j);
+    for (int i = 0; i < nthr; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    free(tid);
+    free(j.units);
+    if (j.eno) {
+        return j.eno;
+    }
+
+    for (int col = 0; col < cols->ncol; col++) {
+        libpq_column_t *c = &cols->cols[col];
+
+        if (c->failed) {
+            if (types) {
+                return EINVAL;
+            }
+            free_column(c);
+            c->type       = LIBPQ_COL_TEXT;
+            c->null_count = 0;
+            if (with_text && (j.eno = decode_text(res, c, col, cols->nrow))) {
+                return j.eno;
+            }
+        }
+        if (!c->null_count) {
+            free(c->validity);
+            c->validity = NULL;
+        }
+    }
+    return 0;
+}
+
+/**
+ * pushes the columns object that decoded from the result by nthreads
+ * threads. the text columns are copied only if with_text is true. returns
+ * NULL and sets errno on failure.
+ */
+libpq_columns_t *libpq_columns_new(lua_State *L, const PGresult *res,
+                                   int nthreads, int with_text)
+{
+    libpq_columns_t *cols = lua_newuserdata(L, sizeof(libpq_columns_t));
+    int eno               = 0;
+
+    *cols = (libpq_columns_t){
+        .nrow = PQntuples(res),
+        .ncol = PQnfields(res),
+    };
+    lauxh_setmetatable(L, LIBPQ_COLUMNS_MT);
+    if (!(cols->cols = calloc(cols->ncol ? cols->ncol : 1,
+                              sizeof(libpq_column_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    } else if ((eno = libpq_columns_decode(cols, res, nthreads, with_text,
+                                           NULL))) {
+        libpq_columns_free(cols);
+        errno = eno;
+        return NULL;
+    }
+    return cols;
+}
+
+/**
+ * the arrow C data interface. see
+ * https://arrow.apache.org/docs/format/CDataInterface.html
+ */
+#ifndef ARROW_C_DATA_INTERFACE
+# define ARROW_C_DATA_INTERFACE
+# define ARROW_FLAG_NULLABLE 2
+
+struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release)(struct ArrowSchema *);
+    void *private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release)(struct ArrowArray *);
+    void *private_data;
+};
+
+#endif
+
+/**
+ * the exported structures refer to the buffers of the columns object, and
+ * all of them are allocated in one block that freed with the object. the
+ * release callbacks only mark the structures as released.
+ */
+struct libpq_arrow_s {
+    struct ArrowSchema schema;
+    struct ArrowArray array;
+    struct ArrowSchema **schema_children;
+    struct ArrowArray **array_children;
+    struct ArrowSchema *schemas;
+    struct ArrowArray *arrays;
+    const void **buffers;
+};
+
+static void release_schema(struct ArrowSchema *schema)
+{
+    schema->release = NULL;
+}
+
+static void release_array(struct ArrowArray *array)
+{
+    array->release = NULL;
+}
+
+static const char *column_format(libpq_column_t *c)
+{
+    switch (c->type) {
+    case LIBPQ_COL_BOOL:
+        return "b";
+    case LIBPQ_COL_INT64:
+        return "l";
+    case LIBPQ_COL_DOUBLE:
+        return "g";
+    case LIBPQ_COL_TIMESTAMP:
+        return c->oid == TIMESTAMPTZOID ? "tsu:UTC" : "tsu:";
+    default:
+        // large utf8 with the 64-bit offsets
+        return "U";
+    }
+}
+
+/**
+ * returns the address and the size of the idx-th buffer of the column in
+ * the order of the arrow C data interface. returns NULL if not exists.
+ */
+const void *libpq_columns_buffer(const libpq_columns_t *cols,
+                                 const libpq_column_t *c, int idx, size_t *len)
+{
+    size_t nbyte = (size_t)(cols->nrow + 7) / 8;
+
+    switch (idx) {
+    case 0:
+        *len = c->validity ? nbyte : 0;
+        return c->validity;
+
+    case 1:
+        if (c->type == LIBPQ_COL_BOOL) {
+            *len = nbyte;
+        } else if (c->type == LIBPQ_COL_TEXT) {
+            *len = sizeof(int64_t) * (size_t)(cols->nrow + 1);
+        } else {
+            *len = sizeof(int64_t) * (size_t)cols->nrow;
+        }
+        return c->values;
+
+    case 2:
+        if (c->type == LIBPQ_COL_TEXT) {
+            *len = (size_t)((int64_t *)c->values)[cols->nrow];
+            return c->data;
+        }
+    }
+    *len = 0;
+    return NULL;
+}
+
+static libpq_arrow_t *export_arrow(libpq_columns_t *cols)
+{
+    int ncol         = cols->ncol;
+    libpq_arrow_t *a = NULL;
+
+    if (cols->arrow) {
+        return cols->arrow;
+    }
+    a = calloc(1, sizeof(libpq_arrow_t) +
+                      (sizeof(struct ArrowSchema *) +
+                       sizeof(struct ArrowArray *) +
+                       sizeof(struct ArrowSchema) + sizeof(struct ArrowArray) +
+                       sizeof(void *) * 3) *
+                          (size_t)ncol +
+                      sizeof(void *));
+    if (!a) {
+        return NULL;
+    }
+    a->schema_children = (struct ArrowSchema **)(a + 1);
+    a->array_children  = (struct ArrowArray **)(a->schema_children + ncol);
+    a->schemas         = (struct ArrowSchema *)(a->array_children + ncol);
+    a->arrays          = (struct ArrowArray *)(a->schemas + ncol);
+    // the first buffer is the validity of the struct array
+    a->buffers         = (const void **)(a->arrays + ncol);
+
+    for (int col = 0; col < ncol; col++) {
+        libpq_column_t *c = &cols->cols[col];
+        const void **bufs = a->buffers + 1 + col * 3;
+        size_t len        = 0;
+
+        for (int i = 0; i < 3; i++) {
+            bufs[i] = libpq_columns_buffer(cols, c, i, &len);
+        }
+        a->schemas[col] = (struct ArrowSchema){
+            .format  = column_format(c),
+            .name    = c->name,
+            .flags   = ARROW_FLAG_NULLABLE,
+            .release = release_schema,
+        };
+        a->arrays[col] = (struct ArrowArray){
+            .length     = cols->nrow,
+            .null_count = c->null_count,
+            .n_buffers  = c->type == LIBPQ_COL_TEXT ? 3 : 2,
+            .buffers    = bufs,
+            .release    = release_array,
+        };
+        a->schema_children[col] = &a->schemas[col];
+        a->array_children[col]  = &a->arrays[col];
+    }
+
+    // the columns are exported as the fields of the struct array
+    a->schema = (struct ArrowSchema){
+        .format     = "+s",
+        .name       = "",
+        .n_children = ncol,
+        .children   = a->schema_children,
+        .release    = release_schema,
+    };
+    a->array = (struct ArrowArray){
+        .length     = cols->nrow,
+        .n_buffers  = 1,
+        .n_children = ncol,
+        .buffers    = a->buffers,
+        .children   = a->array_children,
+        .release    = release_array,
+    };
+    cols->arrow = a;
+    return a;
+}
+
+static inline libpq_columns_t *checkself(lua_State *L)
+{
+    libpq_columns_t *cols = luaL_checkudata(L, 1, LIBPQ_COLUMNS_MT);
+    if (!cols->cols) {
+        luaL_error(L, "attempt to use a freed object");
+    }
+    return cols;
+}
+
+static inline libpq_column_t *checkcolumn(lua_State *L,
+                                          libpq_columns_t *cols)
+{
+    lua_Integer col = lauxh_checkinteger(L, 2);
+
+    if (col < 1 || col > cols->ncol) {
+        lauxh_argerror(L, 2, "column number must be between 1 and %d",
+                       cols->ncol);
+    }
+    return &cols->cols[col - 1];
+}
+
+static int export_arrow_lua(lua_State *L)
+{
+    libpq_columns_t *cols = checkself(L);
+    libpq_arrow_t *a      = export_arrow(cols);
+
+    if (!a) {
+        lua_pushnil(L);
+        lua_errno_new(L, errno, "export_arrow");
+        return 2;
+    }
+    // the structures can be exported again after released
+    a->schema.release = release_schema;
+    a->array.release  = release_array;
+    for (int col = 0; col < cols->ncol; col++) {
+        a->schemas[col].release = release_schema;
+        a->arrays[col].release  = release_array;
+    }
+    lua_pushlightuserdata(L, &a->schema);
+    lua_pushlightuserdata(L, &a->array);
+    return 2;
+}
+
+static int buffer_lua(lua_State *L)
+{
+    libpq_columns_t *cols = checkself(L);
+    libpq_column_t *c     = checkcolumn(L, cols);
+    int idx               = lauxh_checkinteger(L, 3);
+    size_t len            = 0;
+    const void *buf       = NULL;
+
+    if (idx < 0 || idx > 2) {
+        return lauxh_argerror(L, 3, "buffer index must be between 0 and 2");
+    } else if (!(buf = libpq_columns_buffer(cols, c, idx, &len))) {
+        return 0;
+    }
+    lua_pushlightuserdata(L, (void *)buf);
+    lua_pushinteger(L, len);
+    return 2;
+}
+
+static int null_count_lua(lua_State *L)
+{
+    libpq_columns_t *cols = checkself(L);
+    libpq_column_t *c     = checkcolumn(L, cols);
+
+    lua_pushinteger(L, c->null_count);
+    return 1;
+}
+
+static int format_lua(lua_State *L)
+{
+    libpq_columns_t *cols = checkself(L);
+    libpq_column_t *c     = checkcolumn(L, cols);
+
+    lua_pushstring(L, column_format(c));
+    return 1;
+}
+
+static int ftype_lua(lua_State *L)
+{
+    libpq_columns_t *cols = checkself(L);
+    libpq_column_t *c     = checkcolumn(L, cols);
+
+    lua_pushinteger(L, c->oid);
+    return 1;
+}
+
+static int fname_lua(lua_State *L)
+{
+    libpq_columns_t *cols = checkself(L);
+    libpq_column_t *c     = checkcolumn(L, cols);
+
+    lua_pushstring(L, c->name);
+    return 1;
+}
+
+static int nfields_lua(lua_State *L)
+{
+    libpq_columns_t *cols = checkself(L);
+    lua_pushinteger(L, cols->ncol);
+    return 1;
+}
+
+static int ntuples_lua(lua_State *L)
+{
+    libpq_columns_t *cols = checkself(L);
+    lua_pushinteger(L, cols->nrow);
+    return 1;
+}
+
+static int free_lua(lua_State *L)
+{
+    libpq_columns_t *cols = luaL_checkudata(L, 1, LIBPQ_COLUMNS_MT);
+    libpq_columns_free(cols);
+    return 0;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    return libpq_tostring(L, LIBPQ_COLUMNS_MT);
+}
+
+void libpq_columns_init(lua_State *L)
+{
+    struct luaL_Reg mmethod[] = {
+        {"__gc",       free_lua    },
+        {"__tostring", tostring_lua},
+        {NULL,         NULL        }
+    };
+    struct luaL_Reg method[] = {
+        {"free",         free_lua        },
+        {"ntuples",      ntuples_lua     },
+        {"nfields",      nfields_lua     },
+        {"fname",        fname_lua       },
+        {"ftype",        ftype_lua       },
+        {"format",       format_lua      },
+        {"null_count",   null_count_lua  },
+        {"buffer",       buffer_lua      },
+        {"export_arrow", export_arrow_lua},
+        {NULL,           NULL            }
+    };
+
+    libpq_register_mt(L, LIBPQ_COLUMNS_MT, mmethod, method);
+}
@@ -20,34 +20,561 @@
  *  DEALINGS IN THE SOFTWARE.
  */
 
+#include <libpq-events.h>
+#include <libpq/libpq-fs.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <strings.h>
+#include <unistd.h>
 // lua
 #include "lua_libpq.h"
 
+// number of buckets of the latency histograms
+#define STATS_NBUCKET   24
+// max number of SQLSTATE classes to be counted
+#define STATS_NERRCLASS 32
+// amount of the result memory to step the garbage collector
+#define GC_STEP_BYTES   (1024 * 1024)
+// default chunk size of the large object operations
+#define LO_BUFSIZE      (256 * 1024)
+// default retry policy of the transaction helper
+#define TXN_RETRIES     3
+#define TXN_BACKOFF     10
+#define TXN_MAX_BACKOFF 1000
+
+typedef struct {
+    char code[3];
+    uint64_t count;
+} errclass_t;
+
+typedef struct {
+    uint64_t queries;
+    uint64_t results;
+    uint64_t rows;
+    uint64_t errors;
+    uint64_t bytes_sent;
+    uint64_t bytes_recv;
+    // total elapsed time in nanoseconds
+    uint64_t first_result_time;
+    uint64_t total_time;
+    // the i-th bucket counts the durations less than 2^i microseconds, and
+    // the last bucket counts the rest.
+    uint64_t first_result_hist[STATS_NBUCKET];
+    uint64_t total_hist[STATS_NBUCKET];
+    int pipeline_depth_max;
+    // transactions of the transaction helper
+    uint64_t transactions;
+    uint64_t transaction_retries;
+    uint64_t transaction_failures;
+    int nerrclass;
+    errclass_t errclass[STATS_NERRCLASS];
+} stats_t;
+
+// max length of the query text to be recorded in the slowlog
+#define SLOWLOG_MAXSQL 256
+
+typedef struct {
+    uint64_t sent_at;
+    uint64_t rows;
+    int has_result;
+    int nparams;
+    // original length and head of the query text if slowlog is enabled
+    size_t sqllen;
+    char sql[SLOWLOG_MAXSQL];
+} pending_t;
+
+typedef struct {
+    time_t at;
+    uint64_t elapsed;
+    uint64_t rows;
+    int nparams;
+    size_t sqllen;
+    char sql[SLOWLOG_MAXSQL];
+} slowlog_entry_t;
+
+typedef struct {
+    // threshold in nanoseconds, 0 means disabled
+    uint64_t threshold;
+    uint64_t dropped;
+    slowlog_entry_t *entries;
+    int head;
+    int len;
+    int cap;
+} slowlog_t;
+
+typedef struct {
+    // BEGIN command that deferred until the first query
+    char begin[96];
+    int active;
+    int deferred;
+    // SQLSTATE of the serialization failure or deadlock in the transaction
+    char sqlstate[6];
+} txn_t;
+
 typedef struct {
     lua_State *L;
     int notice_proc_ref;
     int notice_recv_ref;
     int trace_ref;
+    libpq_trace_t *tracebuf;
+    // flags that set by set_trace_flags. PQtrace clears the flags, so they
+    // are set again when the tracing is started.
+    int trace_flags;
+    // timeout in milliseconds for the exec, exec_params and get_result
+    int query_timeout;
+    // the results of the query that cancelled by the timeout are not yet
+    // discarded
+    int cancelled;
+    // format of the results of exec_params and send_query_params
+    int result_format;
+    stats_t stats;
+    // ring buffer of the queries waiting for the results
+    pending_t *pending;
+    int pending_head;
+    int pending_len;
+    int pending_cap;
+    slowlog_t slowlog;
+    // result cache of exec_params_cached
+    libpq_rcache_t *rcache;
+    // parameter types of the prepared statements
+    libpq_ptypes_t *ptypes;
+    // state of the transaction helper
+    txn_t txn;
+    // the query that running in the offload pool
+    libpq_task_t *offload;
+    // notice receiver that replaced while the query is offloaded, and the
+    // notices that received on the worker thread
+    PQnoticeReceiver offload_recv;
+    libpq_buf_t offload_notices;
+    // queue of the notifications that received before notifies called
+    PGnotify *notify_head;
+    PGnotify *notify_tail;
+    // work buffer of the COPY rows and the batch escapes
+    libpq_buf_t workbuf;
+    // memory of the live results that created by the connection
+    size_t result_bytes;
+    size_t nresult;
+    // memory of the results that not yet reported to the garbage collector
+    size_t gc_debt;
     PQnoticeProcessor default_proc;
     PQnoticeReceiver default_recv;
     PGconn *conn;
 } conn_t;
 
-static inline conn_t *checkself(lua_State *L)
+static inline conn_t *checkconn(lua_State *L, int idx)
 {
-    conn_t *c = luaL_checkudata(L, 1, LIBPQ_CONN_MT);
+    conn_t *c = luaL_checkudata(L, idx, LIBPQ_CONN_MT);
     if (!c->conn) {
         luaL_error(L, "attempt to use a freed object");
+    } else if (c->offload) {
+        luaL_error(L, "attempt to use a connection in the offload pool");
     }
     return c;
 }
 
+static inline conn_t *checkself(lua_State *L)
+{
+    return checkconn(L, 1);
+}
+
+static int event_proc(PGEventId id, void *info, void *arg);
+
+static inline void track_result(conn_t *c, const PGresult *res)
+{
+    size_t size = PQresultMemorySize(res);
+
+    // remember the size to subtract it when the result is destroyed
+    PQresultSetInstanceData((PGresult *)res, event_proc,
+                            (void *)(uintptr_t)size);
+    // the results of the offloaded query are created on the worker thread
+    // while the other results can be destroyed on the main thread
+    __atomic_add_fetch(&c->result_bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->nresult, 1, __ATOMIC_RELAXED);
+    c->gc_debt += size;
+}
+
+static int event_proc(PGEventId id, void *info, void *arg)
+{
+    conn_t *c = (conn_t *)arg;
+
+    switch (id) {
+    case PGEVT_RESULTCREATE:
+        track_result(c, ((PGEventResultCreate *)info)->result);
+        break;
+
+    case PGEVT_RESULTCOPY:
+        track_result(c, ((PGEventResultCopy *)info)->dest);
+        break;
+
+    case PGEVT_RESULTDESTROY: {
+        PGresult *res = ((PGEventResultDestroy *)info)->result;
+        __atomic_sub_fetch(&c->result_bytes,
+                           (uintptr_t)PQresultInstanceData(res, event_proc),
+                           __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&c->nresult, 1, __ATOMIC_RELAXED);
+    } break;
+
+    default:
+        break;
+    }
+    return 1;
+}
+
+/**
+ * lua can only see the size of the result_t, so step the garbage collector
+ * by the amount of the result memory that created since the last step.
+ */
+static inline void gc_hint(lua_State *L, conn_t *c)
+{
+    if (c->gc_debt >= GC_STEP_BYTES) {
+        int kb     = (int)(c->gc_debt / 1024);
+        c->gc_debt = 0;
+        lua_gc(L, LUA_GCSTEP, kb);
+    }
+}
+
 PGconn *libpq_check_conn(lua_State *L)
 {
     conn_t *c = checkself(L);
     return c->conn;
 }
 
+static inline int stats_bucket(uint64_t nsec)
+{
+    uint64_t usec = nsec / 1000;
+    int i         = 0;
+
+    while (usec && i < STATS_NBUCKET - 1) {
+        usec >>= 1;
+        i++;
+    }
+    return i;
+}
+
+// push a query waiting for the results
+static pending_t *push_pending(lua_State *L, conn_t *c)
+{
+    pending_t *p = NULL;
+
+    if (c->pending_len == c->pending_cap) {
+        int cap        = c->pending_cap ? c->pending_cap * 2 : 8;
+        pending_t *buf = realloc(c->pending, sizeof(pending_t) * cap);
+
+        if (!buf) {
+            luaL_error(L, "failed to allocate memory: %s", strerror(errno));
+        }
+        // move the wrapped items to the end of new buffer
+        for (int i = 0; i < c->pending_head; i++) {
+            buf[c->pending_cap + i] = buf[i];
+        }
+        c->pending     = buf;
+        c->pending_cap = cap;
+    }
+
+    p             = &c->pending[(c->pending_head + c->pending_len) %
+                                    c->pending_cap];
+    p->rows       = 0;
+    p->has_result = 0;
+    p->nparams    = 0;
+    p->sqllen     = 0;
+    c->pending_len++;
+    if (c->pending_len > c->stats.pipeline_depth_max) {
+        c->stats.pipeline_depth_max = c->pending_len;
+    }
+    // the clock is read after the buffer is prepared
+    p->sent_at = libpq_getnsec();
+    return p;
+}
+
+static inline size_t sizeof_params(int nparams, const char **params,
+                                   const int *lengths)
+{
+    size_t nbytes = 0;
+
+    for (int i = 0; i < nparams; i++) {
+        if (!params[i]) {
+            continue;
+        } else if (lengths) {
+            nbytes += lengths[i];
+        } else {
+            nbytes += strlen(params[i]);
+        }
+    }
+    return nbytes;
+}
+
+static void drain_cancelled(conn_t *c);
+
+/**
+ * account a query that will be sent to the server, and returns the number of
+ * bytes to be sent. this function must be called before sending the query,
+ * and stats_unsent must be called if the query could not be sent. the rest
+ * of the results of the cancelled query are discarded first.
+ */
+static size_t stats_sent(lua_State *L, conn_t *c, const char *command,
+                         size_t len, int nparams, const char **params,
+                         const int *lengths)
+{
+    pending_t *p  = NULL;
+    size_t nbytes = len + sizeof_params(nparams, params, lengths);
+
+    drain_cancelled(c);
+    p = push_pending(L, c);
+
+    c->stats.queries++;
+    c->stats.bytes_sent += nbytes;
+    if (c->slowlog.threshold) {
+        // keep the head of the query text for the slowlog
+        p->nparams = nparams;
+        p->sqllen  = len;
+        memcpy(p->sql, command, len < SLOWLOG_MAXSQL ? len : SLOWLOG_MAXSQL);
+    }
+    return nbytes;
+}
+
+static inline void stats_unsent(conn_t *c, size_t nbytes)
+{
+    c->pending_len--;
+    c->stats.queries--;
+    c->stats.bytes_sent -= nbytes;
+}
+
+static void slowlog_add(conn_t *c, pending_t *p, uint64_t elapsed)
+{
+    slowlog_t *log     = &c->slowlog;
+    slowlog_entry_t *e = NULL;
+
+    if (log->len == log->cap) {
+        // overwrite the oldest entry
+        log->head = (log->head + 1) % log->cap;
+        log->len--;
+        log->dropped++;
+    }
+    e          = &log->entries[(log->head + log->len) % log->cap];
+    e->at      = time(NULL);
+    e->elapsed = elapsed;
+    e->rows    = p->rows;
+    e->nparams = p->nparams;
+    e->sqllen  = p->sqllen;
+    memcpy(e->sql, p->sql,
+           p->sqllen < SLOWLOG_MAXSQL ? p->sqllen : SLOWLOG_MAXSQL);
+    log->len++;
+}
+
+// account the completion of the oldest pending query
+static void stats_done(conn_t *c)
+{
+    if (c->pending_len) {
+        pending_t *p     = &c->pending[c->pending_head];
+        uint64_t elapsed = libpq_getnsec() - p->sent_at;
+
+        if (c->slowlog.threshold && elapsed >= c->slowlog.threshold &&
+            p->sqllen) {
+            slowlog_add(c, p, elapsed);
+        }
+        c->pending_head = (c->pending_head + 1) % c->pending_cap;
+        c->pending_len--;
+        c->stats.total_time += elapsed;
+        c->stats.total_hist[stats_bucket(elapsed)]++;
+    }
+}
+
+static inline int is_retryable(const char *sqlstate)
+{
+    // serialization_failure or deadlock_detected
+    return sqlstate &&
+           (!strcmp(sqlstate, "40001") || !strcmp(sqlstate, "40P01"));
+}
+
+static void stats_error(conn_t *c, const char *sqlstate)
+{
+    stats_t *s = &c->stats;
+
+    s->errors++;
+    if (c->txn.active && is_retryable(sqlstate)) {
+        memcpy(c->txn.sqlstate, sqlstate, sizeof(c->txn.sqlstate));
+    }
+    if (sqlstate && sqlstate[0] && sqlstate[1]) {
+        // count by the first two characters of SQLSTATE
+        for (int i = 0; i < s->nerrclass; i++) {
+            if (s->errclass[i].code[0] == sqlstate[0] &&
+                s->errclass[i].code[1] == sqlstate[1]) {
+                s->errclass[i].count++;
+                return;
+            }
+        }
+        if (s->nerrclass < STATS_NERRCLASS) {
+            s->errclass[s->nerrclass++] = (errclass_t){
+                .code  = {sqlstate[0], sqlstate[1], 0},
+                .count = 1,
+            };
+        }
+    }
+}
+
+static void stats_result(conn_t *c, const PGresult *res)
+{
+    stats_t *s = &c->stats;
+
+    s->results++;
+    s->bytes_recv += PQresultMemorySize(res);
+    if (c->pending_len) {
+        pending_t *p = &c->pending[c->pending_head];
+
+        if (!p->has_result) {
+            uint64_t elapsed = libpq_getnsec() - p->sent_at;
+
+            p->has_result = 1;
+            s->first_result_time += elapsed;
+            s->first_result_hist[stats_bucket(elapsed)]++;
+        }
+    }
+
+    switch (PQresultStatus(res)) {
+    case PGRES_TUPLES_OK:
+    case PGRES_SINGLE_TUPLE:
+        s->rows += PQntuples(res);
+        if (c->pending_len) {
+            c->pending[c->pending_head].rows += PQntuples(res);
+        }
+        break;
+
+    case PGRES_PIPELINE_SYNC:
+        // synchronization point is not followed by NULL
+        stats_done(c);
+        break;
+
+    case PGRES_BAD_RESPONSE:
+    case PGRES_FATAL_ERROR:
+        stats_error(c, PQresultErrorField(res, PG_DIAG_SQLSTATE));
+        break;
+    }
+}
+
+static inline void push_hist(lua_State *L, const char *name, uint64_t *hist)
+{
+    lua_createtable(L, STATS_NBUCKET, 0);
+    for (int i = 0; i < STATS_NBUCKET; i++) {
+        lauxh_pushint2arr(L, i + 1, hist[i]);
+    }
+    lua_setfield(L, -2, name);
+}
+
+static int stats_lua(lua_State *L)
+{
+    conn_t *c  = checkself(L);
+    stats_t *s = &c->stats;
+
+    lua_createtable(L, 0, 17);
+    lauxh_pushint2tbl(L, "queries", s->queries);
+    lauxh_pushint2tbl(L, "results", s->results);
+    lauxh_pushint2tbl(L, "rows", s->rows);
+    lauxh_pushint2tbl(L, "errors", s->errors);
+    lauxh_pushint2tbl(L, "bytes_sent", s->bytes_sent);
+    lauxh_pushint2tbl(L, "bytes_recv", s->bytes_recv);
+    // elapsed time in seconds
+    lauxh_pushnum2tbl(L, "first_result_time",
+                      (lua_Number)s->first_result_time / 1000000000);
+    lauxh_pushnum2tbl(L, "total_time", (lua_Number)s->total_time / 1000000000);
+    push_hist(L, "first_result_hist", s->first_result_hist);
+    push_hist(L, "total_hist", s->total_hist);
+    lauxh_pushint2tbl(L, "pipeline_depth", c->pending_len);
+    lauxh_pushint2tbl(L, "pipeline_depth_max", s->pipeline_depth_max);
+    lauxh_pushint2tbl(L, "transactions", s->transactions);
+    lauxh_pushint2tbl(L, "transaction_retries", s->transaction_retries);
+    lauxh_pushint2tbl(L, "transaction_failures", s->transaction_failures);
+    lua_createtable(L, 0, s->nerrclass);
+    for (int i = 0; i < s->nerrclass; i++) {
+        lauxh_pushint2tbl(L, s->errclass[i].code, s->errclass[i].count);
+    }
+    lua_setfield(L, -2, "errors_by_class");
+
+    return 1;
+}
+
+static int result_memory_lua(lua_State *L)
+{
+    conn_t *c = luaL_checkudata(L, 1, LIBPQ_CONN_MT);
+
+    lua_pushinteger(L, c->result_bytes);
+    lua_pushinteger(L, c->nresult);
+    return 2;
+}
+
+static int reset_stats_lua(lua_State *L)
+{
+    conn_t *c = checkself(L);
+
+    c->stats = (stats_t){
+        .pipeline_depth_max = c->pending_len,
+    };
+    return 0;
+}
+
+static int slowlog_lua(lua_State *L)
+{
+    conn_t *c      = checkself(L);
+    slowlog_t *log = &c->slowlog;
+
+    // move the recorded entries to the table
+    lua_createtable(L, log->len, 0);
+    for (int i = 1; log->len; i++) {
+        slowlog_entry_t *e = &log->entries[log->head];
+        size_t len = e->sqllen < SLOWLOG_MAXSQL ? e->sqllen : SLOWLOG_MAXSQL;
+
+        lua_createtable(L, 0, 6);
+        lauxh_pushlstr2tbl(L, "sql", e->sql, len);
+        lauxh_pushbool2tbl(L, "truncated", len < e->sqllen);
+        lauxh_pushint2tbl(L, "nparams", e->nparams);
+        lauxh_pushint2tbl(L, "rows", e->rows);
+        // elapsed time in seconds
+        lauxh_pushnum2tbl(L, "elapsed", (lua_Number)e->elapsed / 1000000000);
+        lauxh_pushint2tbl(L, "time", e->at);
+        lua_rawseti(L, -2, i);
+        log->head = (log->head + 1) % log->cap;
+        log->len--;
+    }
+    // number of entries overwritten since the last call
+    lua_pushinteger(L, log->dropped);
+    log->dropped = 0;
+    return 2;
+}
+
+static int set_slowlog_lua(lua_State *L)
+{
+    conn_t *c      = checkself(L);
+    int msec       = lauxh_optpinteger(L, 2, 0);
+    int size       = lauxh_optpinteger(L, 3, 64);
+    slowlog_t *log = &c->slowlog;
+
+    if (msec && size < 1) {
+        lauxh_argerror(L, 3, "size must be greater than 0");
+    }
+
+    if (!msec) {
+        // disable the slowlog
+        free(log->entries);
+        *log = (slowlog_t){0};
+    } else if (size != log->cap) {
+        slowlog_entry_t *entries = malloc(sizeof(slowlog_entry_t) * size);
+
+        if (!entries) {
+            lua_pushboolean(L, 0);
+            lua_errno_new(L, errno, "set_slowlog");
+            return 2;
+        }
+        free(log->entries);
+        *log = (slowlog_t){
+            .entries = entries,
+            .cap     = size,
+        };
+    }
+    log->threshold = (uint64_t)msec * 1000000ULL;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 static int encrypt_password_conn_lua(lua_State *L)
 {
     PGconn *conn          = libpq_check_conn(L);
@@ -148,6 +675,134 @@ static int escape_string_conn_lua(lua_State *L)
     return 1;
 }
 
+/**
+ * appends the escaped value to the buffer as the literal or identifier.
+ * returns -1 on failure with the error message set to the connection, -2 on
+ * memory allocation failure, or -3 on incomplete multibyte character.
+ */
+static int escape_value(PGconn *conn, libpq_buf_t *b, const char *str,
+                        size_t len, int literal, int std_strings)
+{
+    // for the quotes, E prefix and terminating NUL
+    if (libpq_buf_reserve(b, len * 2 + 4) != 0) {
+        return -2;
+    }
+
+    if (literal) {
+        int err   = 0;
+        char *dst = b->data + b->len;
+        size_t n  = 0;
+
+        // the backslashes are escaped only if standard_conforming_strings is
+        // off, then E prefix is needed to avoid the warning
+        if (!std_strings && memchr(str, '\\', len)) {
+            *dst++ = 'E';
+        }
+        *dst++ = '\'';
+        n      = PQescapeStringConn(conn, dst, str, len, &err);
+        if (err) {
+            return -1;
+        }
+        dst += n;
+        *dst++ = '\'';
+        b->len = dst - b->data;
+        return 0;
+    }
+
+    b->data[b->len++] = '"';
+    for (size_t i = 0; i < len && str[i];) {
+        int n = 1;
+
+        if (str[i] & 0x80) {
+            // the multibyte character must be complete
+            n = PQmblen(str + i, PQclientEncoding(conn));
+            if (len - i < (size_t)n) {
+                return -3;
+            }
+        } else if (str[i] == '"') {
+            b->data[b->len++] = '"';
+        }
+        memcpy(b->data + b->len, str + i, n);
+        b->len += n;
+        i += n;
+    }
+    b->data[b->len++] = '"';
+    return 0;
+}
+
+static int escape_values(lua_State *L, int literal, const char *op)
+{
+    conn_t *c       = checkself(L);
+    size_t seplen   = 0;
+    const char *sep = lauxh_optlstring(L, 3, ", ", &seplen);
+    libpq_buf_t *b  = &c->workbuf;
+    const char *std =
+        PQparameterStatus(c->conn, "standard_conforming_strings");
+    int std_strings = std && strcmp(std, "on") == 0;
+
+    lauxh_checktable(L, 2);
+    lua_settop(L, 3);
+
+    // escape the values into the one buffer
+    b->len = 0;
+    for (int i = 1;; i++) {
+        size_t len      = 0;
+        const char *str = NULL;
+        int rc          = 0;
+
+        lua_rawgeti(L, 2, i);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        str = libpq_param2string(L, -1);
+        lua_tolstring(L, -1, &len);
+        if (i > 1) {
+            if (libpq_buf_reserve(b, seplen) != 0) {
+                rc = -2;
+            } else {
+                memcpy(b->data + b->len, sep, seplen);
+                b->len += seplen;
+            }
+        }
+        if (rc == 0) {
+            rc = escape_value(c->conn, b, str, len, literal, std_strings);
+        }
+        lua_pop(L, 1);
+
+        switch (rc) {
+        case -1:
+            lua_pushnil(L);
+            lua_pushstring(L, PQerrorMessage(c->conn));
+            return 2;
+
+        case -2:
+            lua_pushnil(L);
+            lua_errno_new(L, errno, op);
+            return 2;
+
+        case -3:
+            lua_pushnil(L);
+            lua_pushfstring(L, "incomplete multibyte character in values#%d",
+                            i);
+            return 2;
+        }
+    }
+
+    lua_pushlstring(L, b->data, b->len);
+    return 1;
+}
+
+static int escape_literals_lua(lua_State *L)
+{
+    return escape_values(L, 1, "escape_literals");
+}
+
+static int escape_identifiers_lua(lua_State *L)
+{
+    return escape_values(L, 0, "escape_identifiers");
+}
+
 /* Create and manipulate PGresults */
 static int make_empty_result_lua(lua_State *L)
 {
@@ -166,12 +821,6 @@ static int make_empty_result_lua(lua_State *L)
     return 2;
 }
 
-/* Describe prepared statements and portals */
-// extern PGresult *PQdescribePrepared(PGconn *conn, const char *stmt);
-// extern PGresult *PQdescribePortal(PGconn *conn, const char *portal);
-// extern int	PQsendDescribePrepared(PGconn *conn, const char *stmt);
-// extern int	PQsendDescribePortal(PGconn *conn, const char *portal);
-
 static int flush_lua(lua_State *L)
 {
     PGconn *conn = libpq_check_conn(L);
@@ -227,7 +876,8 @@ static int set_nonblocking_lua(lua_State *L)
 
 static int get_copy_data_lua(lua_State *L)
 {
-    PGconn *conn = libpq_check_conn(L);
+    conn_t *c    = checkself(L);
+    PGconn *conn = c->conn;
     int async    = lauxh_optboolean(L, 2, 0);
     char *buffer = NULL;
     int nbytes   = PQgetCopyData(conn, &buffer, async);
@@ -250,12 +900,85 @@ static int get_copy_data_lua(lua_State *L)
         return 3;
 
     default:
+        c->stats.bytes_recv += nbytes;
         lua_pushlstring(L, buffer, nbytes);
         PQfreemem(buffer);
         return 1;
     }
 }
 
+static int get_copy_row_lua(lua_State *L)
+{
+    conn_t *c    = checkself(L);
+    PGconn *conn = c->conn;
+    int async    = lauxh_optboolean(L, 2, 0);
+    char *buffer = NULL;
+    int nbytes   = 0;
+
+    if (!lua_isnoneornil(L, 3)) {
+        lauxh_checktable(L, 3);
+    }
+    lua_settop(L, 3);
+
+    nbytes = PQgetCopyData(conn, &buffer, async);
+    switch (nbytes) {
+    case -2:
+        lua_pushnil(L);
+        lua_pushstring(L, PQerrorMessage(conn));
+        return 2;
+
+    case -1:
+        // completed
+        return 0;
+
+    case 0:
+        // in-progress
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushboolean(L, 1);
+        return 3;
+    }
+
+    c->stats.bytes_recv += nbytes;
+    // the decoded field is not longer than the line
+    if (libpq_buf_reserve(&c->workbuf, nbytes) != 0) {
+        PQfreemem(buffer);
+        lua_pushnil(L);
+        lua_errno_new(L, errno, "get_copy_row");
+        return 2;
+    }
+
+    // decode the fields of the line into the table
+    if (lua_isnil(L, 3)) {
+        lua_newtable(L);
+        lua_replace(L, 3);
+    }
+    {
+        const char *s   = buffer;
+        const char *end = buffer + nbytes;
+        int ncol        = 0;
+
+        if (s < end && end[-1] == '\n') {
+            end--;
+        }
+        do {
+            ssize_t len = libpq_copy_decode(c->workbuf.data, s, end, &s);
+
+            if (len == -1) {
+                lua_pushnil(L);
+            } else {
+                lua_pushlstring(L, c->workbuf.data, len);
+            }
+            lua_rawseti(L, 3, ++ncol);
+            // skip the delimiter
+        } while (s++ < end);
+        PQfreemem(buffer);
+
+        lua_pushinteger(L, ncol);
+        return 2;
+    }
+}
+
 static int put_copy_end_lua(lua_State *L)
 {
     PGconn *conn         = libpq_check_conn(L);
@@ -282,7 +1005,8 @@ static int put_copy_end_lua(lua_State *L)
 
 static int put_copy_data_lua(lua_State *L)
 {
-    PGconn *conn       = libpq_check_conn(L);
+    conn_t *c          = checkself(L);
+    PGconn *conn       = c->conn;
     size_t nbytes      = 0;
     const char *buffer = lauxh_checklstring(L, 2, &nbytes);
 
@@ -301,40 +1025,184 @@ static int put_copy_data_lua(lua_State *L)
 
     default:
         // queued
+        c->stats.bytes_sent += nbytes;
         lua_pushboolean(L, 1);
         return 1;
     }
 }
 
-static int notifies_lua(lua_State *L)
+static int put_copy_rows_lua(lua_State *L)
 {
-    PGconn *conn = libpq_check_conn(L);
+    conn_t *c      = checkself(L);
+    PGconn *conn   = c->conn;
+    int ncol       = lauxh_optpinteger(L, 3, 0);
+    libpq_buf_t *b = &c->workbuf;
+    int nrow       = 0;
 
-    if (PQconsumeInput(conn)) {
-        PGnotify **notify = libpq_notify_new(L);
+    lauxh_checktable(L, 2);
+    lua_settop(L, 2);
 
-        *notify = PQnotifies(conn);
-        if (*notify) {
-            lua_createtable(L, 0, 3);
-            lauxh_pushstr2tbl(L, "relname", (*notify)->relname);
-            lauxh_pushstr2tbl(L, "extra", (*notify)->extra);
-            lauxh_pushint2tbl(L, "be_pid", (*notify)->be_pid);
-            return 1;
+    // encode the rows into the COPY text format
+    b->len = 0;
+    for (;; nrow++) {
+        int n = ncol;
+
+        lua_rawgeti(L, 2, nrow + 1);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        } else if (!lua_istable(L, -1)) {
+            lauxh_argerror(L, 2, "rows#%d must be table", nrow + 1);
+        } else if (!n) {
+            // the number of columns is the length of each row
+            lua_rawgeti(L, -1, 1);
+            while (!lua_isnil(L, -1)) {
+                n++;
+                lua_pop(L, 1);
+                lua_rawgeti(L, -1, n + 1);
+            }
+            lua_pop(L, 1);
         }
-        lua_pushnil(L);
+
+        for (int i = 1; i <= n; i++) {
+            size_t len    = 0;
+            const char *v = NULL;
+            int rc        = 0;
+
+            lua_rawgeti(L, -1, i);
+            switch (lua_type(L, -1)) {
+            case LUA_TNIL:
+                v   = "\\N";
+                len = 2;
+                break;
+            case LUA_TBOOLEAN:
+                v   = lua_toboolean(L, -1) ? "t" : "f";
+                len = 1;
+                break;
+            case LUA_TNUMBER:
+            case LUA_TSTRING:
+                v = lua_tolstring(L, -1, &len);
+                break;
+            default:
+                lauxh_argerror(L, 2, "rows#%d[%d] <%s> is not supported",
+                               nrow + 1, i, luaL_typename(L, -1));
+            }
+
+            if (lua_isnil(L, -1)) {
+                rc = libpq_buf_reserve(b, len);
+                if (rc == 0) {
+                    memcpy(b->data + b->len, v, len);
+                    b->len += len;
+                }
+            } else {
+                rc = libpq_copy_encode(b, v, len);
+            }
+            if (rc == 0) {
+                rc = libpq_buf_reserve(b, 1);
+            }
+            if (rc != 0) {
+                lua_pushboolean(L, 0);
+                lua_errno_new(L, errno, "put_copy_rows");
+                return 2;
+            }
+            b->data[b->len++] = (i < n) ? '\t' : '\n';
+            lua_pop(L, 1);
+        }
+        if (!n) {
+            // the row without columns
+            if (libpq_buf_reserve(b, 1) != 0) {
+                lua_pushboolean(L, 0);
+                lua_errno_new(L, errno, "put_copy_rows");
+                return 2;
+            }
+            b->data[b->len++] = '\n';
+        }
+        lua_pop(L, 1);
+    }
+
+    if (!b->len) {
+        lua_pushboolean(L, 1);
         return 1;
     }
-    // got error
-    lua_pushnil(L);
-    lua_pushstring(L, PQerrorMessage(conn));
-    return 2;
-}
+    switch (PQputCopyData(conn, b->data, b->len)) {
+    case -1:
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, PQerrorMessage(conn));
+        return 2;
 
-static int send_flush_request_lua(lua_State *L)
-{
-    PGconn *conn = libpq_check_conn(L);
+    case 0:
+        // no buffer space available, should try again
+        lua_pushboolean(L, 0);
+        lua_pushnil(L);
+        lua_pushboolean(L, 1);
+        return 3;
 
-    if (PQsendFlushRequest(conn)) {
+    default:
+        // queued
+        c->stats.bytes_sent += b->len;
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+}
+
+/**
+ * moves the received notifications into the queue of the connection, and
+ * invalidates the result cache entries of their channels.
+ */
+static void consume_notifies(conn_t *c)
+{
+    PGnotify *notify = NULL;
+
+    while ((notify = PQnotifies(c->conn))) {
+        if (c->rcache) {
+            libpq_rcache_invalidate(c->rcache, notify->relname);
+        }
+        notify->next = NULL;
+        if (c->notify_tail) {
+            c->notify_tail->next = notify;
+        } else {
+            c->notify_head = notify;
+        }
+        c->notify_tail = notify;
+    }
+}
+
+static int notifies_lua(lua_State *L)
+{
+    conn_t *c    = checkself(L);
+    PGconn *conn = c->conn;
+
+    if (PQconsumeInput(conn)) {
+        PGnotify **notify = libpq_notify_new(L);
+
+        consume_notifies(c);
+        *notify = c->notify_head;
+        if (*notify) {
+            c->notify_head = (*notify)->next;
+            if (!c->notify_head) {
+                c->notify_tail = NULL;
+            }
+            (*notify)->next = NULL;
+            lua_createtable(L, 0, 3);
+            lauxh_pushstr2tbl(L, "relname", (*notify)->relname);
+            lauxh_pushstr2tbl(L, "extra", (*notify)->extra);
+            lauxh_pushint2tbl(L, "be_pid", (*notify)->be_pid);
+            return 1;
+        }
+        lua_pushnil(L);
+        return 1;
+    }
+    // got error
+    lua_pushnil(L);
+    lua_pushstring(L, PQerrorMessage(conn));
+    return 2;
+}
+
+static int send_flush_request_lua(lua_State *L)
+{
+    PGconn *conn = libpq_check_conn(L);
+
+    if (PQsendFlushRequest(conn)) {
         lua_pushboolean(L, 1);
         return 1;
     }
@@ -347,14 +1215,18 @@ static int send_flush_request_lua(lua_State *L)
 
 static int pipeline_sync_lua(lua_State *L)
 {
-    PGconn *conn = libpq_check_conn(L);
+    conn_t *c    = checkself(L);
+    PGconn *conn = c->conn;
 
+    // synchronization point will be responded as PGRES_PIPELINE_SYNC
+    push_pending(L, c);
     if (PQpipelineSync(conn)) {
         lua_pushboolean(L, 1);
         return 1;
     }
 
     // got error
+    c->pending_len--;
     lua_pushboolean(L, 0);
     lua_pushstring(L, PQerrorMessage(conn));
     return 2;
@@ -419,16 +1291,350 @@ static int is_busy_lua(lua_State *L)
     return 2;
 }
 
+static inline uint64_t get_deadline(conn_t *c)
+{
+    return libpq_getnsec() + (uint64_t)c->query_timeout * 1000000ULL;
+}
+
+/**
+ * wait until the socket is ready for the specified events.
+ * returns 1 if ready, 0 if the deadline has been exceeded, or -1 on error.
+ */
+static int wait_fd(int fd, short events, uint64_t deadline)
+{
+    struct pollfd fds = {
+        .fd     = fd,
+        .events = events,
+    };
+
+    while (1) {
+        uint64_t now = libpq_getnsec();
+
+        if (now >= deadline) {
+            return 0;
+        }
+        switch (poll(&fds, 1, (int)((deadline - now + 999999) / 1000000))) {
+        case -1:
+            if (errno != EINTR) {
+                return -1;
+            }
+            // fallthrough
+        case 0:
+            continue;
+        default:
+            return 1;
+        }
+    }
+}
+
+static inline int wait_socket(PGconn *conn, short events, uint64_t deadline)
+{
+    return wait_fd(PQsocket(conn), events, deadline);
+}
+
+/**
+ * wait until PQgetResult can be called without blocking.
+ * returns 1 if ready, 0 if the deadline has been exceeded, or -1 on error.
+ * errno is set to 0 if the error is caused by libpq.
+ */
+static int wait_result(PGconn *conn, uint64_t deadline)
+{
+    int rv = 0;
+
+    // flush the queued data
+    while ((rv = PQflush(conn)) == 1) {
+        if ((rv = wait_socket(conn, POLLIN | POLLOUT, deadline)) != 1) {
+            return rv;
+        } else if (!PQconsumeInput(conn)) {
+            errno = 0;
+            return -1;
+        }
+    }
+    if (rv == -1) {
+        errno = 0;
+        return -1;
+    }
+
+    // wait for the response
+    while (PQisBusy(conn)) {
+        if ((rv = wait_socket(conn, POLLIN, deadline)) != 1) {
+            return rv;
+        } else if (!PQconsumeInput(conn)) {
+            errno = 0;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+static inline int is_copy_status(ExecStatusType status)
+{
+    return status == PGRES_COPY_IN || status == PGRES_COPY_OUT ||
+           status == PGRES_COPY_BOTH;
+}
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+
+/**
+ * sends the cancel request over the new connection without blocking beyond
+ * the deadline.
+ */
+static void request_cancel(conn_t *c, uint64_t deadline)
+{
+    PGcancelConn *cancel            = PQcancelCreate(c->conn);
+    PostgresPollingStatusType state = PGRES_POLLING_WRITING;
+
+    if (!cancel) {
+        return;
+    } else if (PQcancelStart(cancel)) {
+        while (state == PGRES_POLLING_READING ||
+               state == PGRES_POLLING_WRITING) {
+            short events = state == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+
+            if (wait_fd(PQcancelSocket(cancel), events, deadline) != 1) {
+                break;
+            }
+            state = PQcancelPoll(cancel);
+        }
+    }
+    PQcancelFinish(cancel);
+}
+
+#else
+
+/**
+ * sends the cancel request. PQcancel blocks until the request is sent,
+ * because the non-blocking cancel API is not available before libpq 17.
+ */
+static void request_cancel(conn_t *c, uint64_t deadline)
+{
+    PGcancel *cancel = PQgetCancel(c->conn);
+    char errbuf[256] = {0};
+
+    (void)deadline;
+    if (cancel) {
+        PQcancel(cancel, errbuf, sizeof(errbuf));
+        PQfreeCancel(cancel);
+    }
+}
+
+#endif
+
+/**
+ * request the server to cancel the query in progress, and discard the
+ * aborted results. the results are waited for up to the query_timeout again.
+ * if they are still not arrived, they are discarded by drain_cancelled
+ * before the next query is sent.
+ */
+static void cancel_query(conn_t *c)
+{
+    uint64_t deadline = get_deadline(c);
+
+    request_cancel(c, deadline);
+    while (wait_result(c->conn, deadline) == 1) {
+        PGresult *res = PQgetResult(c->conn);
+
+        if (!res) {
+            stats_done(c);
+            return;
+        }
+        stats_result(c, res);
+        if (is_copy_status(PQresultStatus(res))) {
+            PQclear(res);
+            return;
+        }
+        PQclear(res);
+    }
+    // the drain also timed out or failed, so close the pending entry here
+    stats_done(c);
+    c->cancelled = 1;
+}
+
+/**
+ * discards the rest of the results of the query that cancelled by the
+ * timeout, so that the next query can be sent. the results are waited for
+ * up to the query_timeout. if they are still not arrived, the next query
+ * fails with the error that another command is already in progress.
+ */
+static void drain_cancelled(conn_t *c)
+{
+    uint64_t deadline = get_deadline(c);
+    PGresult *res     = NULL;
+
+    while (c->cancelled) {
+        if (c->query_timeout && wait_result(c->conn, deadline) != 1) {
+            return;
+        } else if (!(res = PQgetResult(c->conn)) ||
+                   is_copy_status(PQresultStatus(res))) {
+            c->cancelled = 0;
+        }
+        PQclear(res);
+    }
+}
+
+/**
+ * wait for the results of the query that sent by PQsend* functions, and
+ * returns the last result the same as PQexec. if NULL is returned, *eno is
+ * set to ETIMEDOUT if the query_timeout has been exceeded, or other non-zero
+ * value if the poll syscall failed.
+ */
+static PGresult *wait_last_result(conn_t *c, int *eno)
+{
+    uint64_t deadline = get_deadline(c);
+    PGresult *last    = NULL;
+
+    while (1) {
+        PGresult *res = NULL;
+
+        switch (wait_result(c->conn, deadline)) {
+        case 0:
+            PQclear(last);
+            cancel_query(c);
+            *eno = ETIMEDOUT;
+            return NULL;
+
+        case -1:
+            *eno = errno;
+            PQclear(last);
+            stats_done(c);
+            return NULL;
+        }
+
+        res = PQgetResult(c->conn);
+        if (!res) {
+            stats_done(c);
+            return last;
+        }
+        stats_result(c, res);
+        PQclear(last);
+        last = res;
+        if (is_copy_status(PQresultStatus(res)) ||
+            PQstatus(c->conn) == CONNECTION_BAD) {
+            return last;
+        }
+    }
+}
+
+static inline int push_exec_error(lua_State *L, PGconn *conn, int eno,
+                                  const char *op)
+{
+    lua_pushnil(L);
+    if (eno) {
+        lua_errno_new(L, eno, op);
+    } else {
+        lua_pushstring(L, PQerrorMessage(conn));
+    }
+    return 2;
+}
+
+/**
+ * executes the command that has no parameters, and returns the last result
+ * or NULL on failure the same as wait_last_result.
+ */
+static PGresult *exec_simple(lua_State *L, conn_t *c, const char *command,
+                             int *eno)
+{
+    size_t nbytes = stats_sent(L, c, command, strlen(command), 0, NULL, NULL);
+    PGresult *res = NULL;
+
+    if (!c->query_timeout) {
+        res = PQexec(c->conn, command);
+        if (res) {
+            stats_result(c, res);
+        }
+        stats_done(c);
+    } else if (PQsendQuery(c->conn, command)) {
+        res = wait_last_result(c, eno);
+    } else {
+        stats_unsent(c, nbytes);
+    }
+    if (!res) {
+        stats_error(c, NULL);
+    }
+    return res;
+}
+
+/**
+ * clears the deferred BEGIN once the transaction is started by it. the BEGIN
+ * stays deferred if the server did not run it, for example because the
+ * command sent with it has a syntax error, so that it is sent again with
+ * the next query.
+ */
+static inline void txn_check_begin(conn_t *c)
+{
+    if (c->txn.deferred && PQtransactionStatus(c->conn) != PQTRANS_IDLE) {
+        c->txn.deferred = 0;
+    }
+}
+
+/**
+ * sends the BEGIN that deferred by the transaction helper before the query
+ * that cannot be sent with it. returns 0 on success, otherwise -1 and the
+ * error is set as exec_simple.
+ */
+static int begin_now(lua_State *L, conn_t *c, int *eno)
+{
+    PGresult *res = NULL;
+    int rv        = -1;
+
+    if (!c->txn.deferred) {
+        return 0;
+    }
+    if ((res = exec_simple(L, c, c->txn.begin, eno))) {
+        if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+            rv = 0;
+        }
+        PQclear(res);
+    }
+    txn_check_begin(c);
+    return rv;
+}
+
+/**
+ * sends the deferred BEGIN before the query that sent by PQsend* functions.
+ * returns 0 on success, otherwise pushes false and error and returns 2.
+ */
+static int send_begin(lua_State *L, conn_t *c, const char *op)
+{
+    int eno = 0;
+
+    if (!begin_now(L, c, &eno)) {
+        return 0;
+    }
+    lua_pushboolean(L, 0);
+    if (eno) {
+        lua_errno_new(L, eno, op);
+    } else {
+        lua_pushstring(L, PQerrorMessage(c->conn));
+    }
+    return 2;
+}
+
 static int get_result_lua(lua_State *L)
 {
-    PGconn *conn   = libpq_check_conn(L);
+    conn_t *c      = checkself(L);
+    PGconn *conn   = c->conn;
     PGresult **res = libpq_result_new(L, 1, 0);
     char *errmsg   = NULL;
 
+    if (c->query_timeout) {
+        switch (wait_result(conn, get_deadline(c))) {
+        case 0:
+            cancel_query(c);
+            return push_exec_error(L, conn, ETIMEDOUT, "get_result");
+
+        case -1:
+            return push_exec_error(L, conn, errno, "get_result");
+        }
+    }
+
     *res = PQgetResult(conn);
     if (*res) {
+        stats_result(c, *res);
+        gc_hint(L, c);
         return 1;
     }
+    stats_done(c);
     errmsg = PQerrorMessage(conn);
     // got error
     if (errmsg && *errmsg) {
@@ -446,12 +1652,229 @@ static int set_single_row_mode_lua(lua_State *L)
     return 1;
 }
 
+/**
+ * receives the results of the query that sent in the single row mode, and
+ * passes each row and the final result of the rows to cb. the rest of the
+ * rows are discarded after cb failed, and the last error result is set to
+ * err. returns 0 on success, -1 if libpq failed, otherwise the error number
+ * that returned by cb or the wait.
+ */
+static int recv_rows(conn_t *c, int (*cb)(void *, const PGresult *),
+                     void *ctx, PGresult **err)
+{
+    int eno = 0;
+
+    while (1) {
+        PGresult *res = NULL;
+
+        if (c->query_timeout) {
+            switch (wait_result(c->conn, get_deadline(c))) {
+            case 0:
+                cancel_query(c);
+                return ETIMEDOUT;
+
+            case -1:
+                stats_done(c);
+                return errno ? errno : -1;
+            }
+        }
+
+        if (!(res = PQgetResult(c->conn))) {
+            stats_done(c);
+            return eno;
+        }
+        stats_result(c, res);
+        switch (PQresultStatus(res)) {
+        case PGRES_SINGLE_TUPLE:
+        case PGRES_TUPLES_OK:
+            if (!eno) {
+                eno = cb(ctx, res);
+            }
+            PQclear(res);
+            break;
+
+        case PGRES_FATAL_ERROR:
+            PQclear(*err);
+            *err = res;
+            break;
+
+        default:
+            PQclear(res);
+        }
+        if (PQstatus(c->conn) == CONNECTION_BAD) {
+            return eno;
+        }
+    }
+}
+
+/**
+ * sends the query in the single row mode and receives the rows by cb.
+ * returns the number of the pushed values on failure, otherwise 0.
+ */
+static int exec_rows(lua_State *L, conn_t *c, const char *query, size_t len,
+                     int (*cb)(void *, const PGresult *), void *ctx,
+                     const char *op)
+{
+    PGresult *err = NULL;
+    size_t nbytes = 0;
+    int eno       = 0;
+
+    if (begin_now(L, c, &eno)) {
+        return push_exec_error(L, c->conn, eno, op);
+    }
+    nbytes = stats_sent(L, c, query, len, 0, NULL, NULL);
+    if (!PQsendQuery(c->conn, query)) {
+        stats_unsent(c, nbytes);
+        return push_exec_error(L, c->conn, 0, op);
+    }
+    // the rows are received one by one, so that the whole result is never
+    // buffered in memory
+    PQsetSingleRowMode(c->conn);
+    if ((eno = recv_rows(c, cb, ctx, &err)) == 0 && !err) {
+        return 0;
+    } else if (err) {
+        lua_pushnil(L);
+        lua_pushstring(L, PQresultErrorMessage(err));
+        PQclear(err);
+        return 2;
+    }
+    return push_exec_error(L, c->conn, eno == -1 ? 0 : eno, op);
+}
+
+typedef struct {
+    libpq_ipc_t *w;
+    // the rows that not yet written
+    PGresult *batch;
+    int nrow;
+    int batch_rows;
+    lua_Integer total;
+} arrow_rows_t;
+
+/**
+ * appends the row of the single row result to the batch that created from
+ * the attributes of the first row.
+ */
+static int append_row(arrow_rows_t *a, const PGresult *res)
+{
+    int nfields = PQnfields(res);
+
+    if (!a->batch && !(a->batch = PQcopyResult(res, PG_COPYRES_ATTRS))) {
+        return ENOMEM;
+    }
+    for (int col = 0; col < nfields; col++) {
+        int isnull = PQgetisnull(res, 0, col);
+
+        if (!PQsetvalue(a->batch, a->nrow, col,
+                        isnull ? NULL : PQgetvalue(res, 0, col),
+                        isnull ? -1 : PQgetlength(res, 0, col))) {
+            return ENOMEM;
+        }
+    }
+    a->nrow++;
+    return 0;
+}
+
+static int write_batch(arrow_rows_t *a, const PGresult *res)
+{
+    int eno = libpq_ipc_write(a->w, res);
+
+    a->total += PQntuples(res);
+    a->nrow = 0;
+    PQclear(a->batch);
+    a->batch = NULL;
+    return eno;
+}
+
+static int arrow_rows(void *ctx, const PGresult *res)
+{
+    arrow_rows_t *a = (arrow_rows_t *)ctx;
+    int eno         = 0;
+
+    if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+        // the last batch, or the schema if no row is returned
+        return write_batch(a, a->batch ? a->batch : res);
+    } else if ((eno = append_row(a, res)) || a->nrow < a->batch_rows) {
+        return eno;
+    }
+    return write_batch(a, a->batch);
+}
+
+static int write_arrow_lua(lua_State *L)
+{
+    conn_t *c              = checkself(L);
+    size_t len             = 0;
+    const char *query      = lauxh_checklstring(L, 2, &len);
+    FILE *fp               = lauxh_checkfile(L, 3);
+    lua_Integer batch_rows = lauxh_optinteger(L, 4, 65536);
+    lua_Integer nthreads   = lauxh_optinteger(L, 5, 1);
+    arrow_rows_t a         = {0};
+    int rv                 = 0;
+    int eno                = 0;
+
+    if (batch_rows < 1 || batch_rows > INT_MAX) {
+        return lauxh_argerror(L, 4, "batch_rows must be greater than 0");
+    } else if (nthreads < 1 || nthreads > 256) {
+        return lauxh_argerror(L, 5, "nthreads must be between 1 and 256");
+    } else if (!(a.w = libpq_ipc_new(fp, (int)nthreads))) {
+        return push_exec_error(L, c->conn, errno, "write_arrow");
+    }
+
+    a.batch_rows = (int)batch_rows;
+    rv = exec_rows(L, c, query, len, arrow_rows, &a, "write_arrow");
+    if (!rv && (eno = libpq_ipc_end(a.w))) {
+        rv = push_exec_error(L, c->conn, eno, "write_arrow");
+    }
+    PQclear(a.batch);
+    libpq_ipc_free(a.w);
+    if (rv) {
+        return rv;
+    }
+    lua_pushinteger(L, a.total);
+    return 1;
+}
+
+static int spill_rows(void *ctx, const PGresult *res)
+{
+    return libpq_spill_append((libpq_spill_t *)ctx, res);
+}
+
+static int exec_spill_lua(lua_State *L)
+{
+    conn_t *c             = checkself(L);
+    size_t len            = 0;
+    const char *query     = lauxh_checklstring(L, 2, &len);
+    lua_Integer threshold = lauxh_optinteger(L, 3, 64 * 1024 * 1024);
+    libpq_spill_t *s      = NULL;
+    int idx               = 0;
+    int rv                = 0;
+    int eno               = 0;
+
+    if (threshold < 0) {
+        return lauxh_argerror(L, 3, "threshold must be greater than or "
+                                    "equal to 0");
+    }
+
+    s   = libpq_spill_new(L, (size_t)threshold);
+    idx = lua_gettop(L);
+    if ((rv = exec_rows(L, c, query, len, spill_rows, s, "exec_spill"))) {
+        return rv;
+    } else if ((eno = libpq_spill_finish(s))) {
+        return push_exec_error(L, c->conn, eno, "exec_spill");
+    }
+    lua_pushvalue(L, idx);
+    return 1;
+}
+
 static int send_query_params_lua(lua_State *L)
 {
     int nparams         = lua_gettop(L) - 2;
-    PGconn *conn        = libpq_check_conn(L);
-    const char *command = lauxh_checkstring(L, 2);
+    conn_t *c           = checkself(L);
+    PGconn *conn        = c->conn;
+    size_t len          = 0;
+    const char *command = lauxh_checklstring(L, 2, &len);
     const char **params = NULL;
+    size_t nbytes       = 0;
+    int rv              = 0;
 
     if (nparams) {
         params = lua_newuserdata(L, sizeof(char *) * nparams);
@@ -460,13 +1883,18 @@ static int send_query_params_lua(lua_State *L)
         }
     }
 
+    if ((rv = send_begin(L, c, "send_query_params"))) {
+        return rv;
+    }
+    nbytes = stats_sent(L, c, command, len, nparams, params, NULL);
     if (PQsendQueryParams(conn, command, nparams, NULL, params, NULL, NULL,
-                          0)) {
+                          c->result_format)) {
         lua_pushboolean(L, 1);
         return 1;
     }
 
     // got error
+    stats_unsent(c, nbytes);
     lua_pushboolean(L, 0);
     lua_pushstring(L, PQerrorMessage(conn));
     return 2;
@@ -474,8 +1902,18 @@ static int send_query_params_lua(lua_State *L)
 
 static int send_query_lua(lua_State *L)
 {
-    PGconn *conn      = libpq_check_conn(L);
-    const char *query = lauxh_checkstring(L, 2);
+    conn_t *c         = checkself(L);
+    PGconn *conn      = c->conn;
+    size_t len        = 0;
+    const char *query = lauxh_checklstring(L, 2, &len);
+    size_t nbytes     = 0;
+    int rv            = 0;
+
+    // the result of the deferred BEGIN must not be returned by get_result
+    if ((rv = send_begin(L, c, "send_query"))) {
+        return rv;
+    }
+    nbytes = stats_sent(L, c, query, len, 0, NULL, NULL);
 
     if (PQsendQuery(conn, query)) {
         lua_pushboolean(L, 1);
@@ -483,69 +1921,1068 @@ static int send_query_lua(lua_State *L)
     }
 
     // got error
+    stats_unsent(c, nbytes);
     lua_pushboolean(L, 0);
     lua_pushstring(L, PQerrorMessage(conn));
     return 2;
 }
 
-static int exec_params_lua(lua_State *L)
+typedef struct {
+    const char **values;
+    int *lengths;
+    int *formats;
+} params_t;
+
+/**
+ * converts the nparams parameters from idx for the prepared statement stmt.
+ * the parameters are sent in the binary format if the parameter types of
+ * the statement are cached and the values can be encoded, otherwise in the
+ * text format.
+ */
+static params_t prepared_params(lua_State *L, conn_t *c, const char *stmt,
+                                int idx, int nparams)
 {
-    int nparams         = lua_gettop(L) - 2;
-    PGconn *conn        = libpq_check_conn(L);
-    const char *command = lauxh_checkstring(L, 2);
-    const char **params = NULL;
-    PGresult **res      = NULL;
+    params_t p       = {0};
+    int ntypes       = 0;
+    const Oid *types = NULL;
+    char *bin        = NULL;
+
+    if (!nparams) {
+        return p;
+    } else if (c->ptypes) {
+        types = libpq_ptypes_get(c->ptypes, stmt, &ntypes);
+    }
 
-    if (nparams) {
-        params = lua_newuserdata(L, sizeof(char *) * nparams);
-        for (int i = 0, j = 3; i < nparams; i++, j++) {
-            params[i] = libpq_param2string(L, j);
+    if (!types) {
+        p.values = lua_newuserdata(L, sizeof(char *) * nparams);
+        for (int i = 0, j = idx; i < nparams; i++, j++) {
+            p.values[i] = libpq_param2string(L, j);
         }
+        return p;
     }
 
-    res  = libpq_result_new(L, 1, 0);
-    *res = PQexecParams(conn, command, nparams, NULL, params, NULL, NULL, 0);
-    if (*res) {
-        return 1;
-    }
+    // 8 bytes for each binary value, followed by the arrays
+    bin = lua_newuserdata(L, (8 + sizeof(char *) + sizeof(int) * 2) *
+                                 (size_t)nparams);
+    p.values  = (const char **)(bin + 8 * nparams);
+    p.lengths = (int *)(p.values + nparams);
+    p.formats = p.lengths + nparams;
+    for (int i = 0, j = idx; i < nparams; i++, j++, bin += 8) {
+        int len = -1;
+
+        if (i < ntypes) {
+            len = libpq_ptypes_encode(L, j, types[i], bin);
+        }
+        if (len < 0) {
+            size_t slen = 0;
+
+            p.values[i] = libpq_param2string(L, j);
+            if (p.values[i]) {
+                lua_tolstring(L, j, &slen);
+            }
+            p.lengths[i] = (int)slen;
+            p.formats[i] = 0;
+        } else {
+            p.values[i]  = bin;
+            p.lengths[i] = len;
+            p.formats[i] = 1;
+        }
+    }
+    return p;
+}
+
+/**
+ * checks the parameter types from idx. nil means that the type is inferred
+ * by the server.
+ */
+static Oid *check_param_types(lua_State *L, int idx, int ntypes)
+{
+    Oid *types = NULL;
+
+    if (ntypes) {
+        types = lua_newuserdata(L, sizeof(Oid) * ntypes);
+        for (int i = 0, j = idx; i < ntypes; i++, j++) {
+            lua_Integer oid = lauxh_optinteger(L, j, 0);
+
+            if (oid < 0 || oid > UINT32_MAX) {
+                lauxh_argerror(L, j, "type OID must be in the range of 0 to "
+                                     "4294967295");
+            }
+            types[i] = (Oid)oid;
+        }
+    }
+    return types;
+}
+
+/**
+ * sends the deferred BEGIN and the command in a pipeline, so that both are
+ * done in one round trip. returns the last result of the command, or NULL
+ * on failure.
+ */
+static PGresult *exec_with_begin(lua_State *L, conn_t *c, const char *stmt,
+                                 const char *command, size_t len, int nparams,
+                                 const char **params, const int *lengths,
+                                 const int *formats)
+{
+    PGconn *conn      = c->conn;
+    const char *begin = c->txn.begin;
+    PGresult *last    = NULL;
+    size_t nbytes     = 0;
+    int sent          = 0;
+    int query         = 0;
+
+    drain_cancelled(c);
+    if (!PQenterPipelineMode(conn)) {
+        return NULL;
+    }
+    nbytes = stats_sent(L, c, begin, strlen(begin), 0, NULL, NULL);
+    if (!PQsendQueryParams(conn, begin, 0, NULL, NULL, NULL, NULL, 0)) {
+        stats_unsent(c, nbytes);
+        PQexitPipelineMode(conn);
+        return NULL;
+    }
+
+    if (stmt) {
+        nbytes =
+            stats_sent(L, c, stmt, strlen(stmt), nparams, params, lengths);
+        sent = PQsendQueryPrepared(conn, stmt, nparams, params, lengths,
+                                   formats, c->result_format);
+    } else {
+        nbytes = stats_sent(L, c, command, len, nparams, params, lengths);
+        sent   = PQsendQueryParams(conn, command, nparams, NULL, params,
+                                   lengths, formats, c->result_format);
+    }
+    if (!sent) {
+        stats_unsent(c, nbytes);
+    }
+    push_pending(L, c);
+    if (!PQpipelineSync(conn)) {
+        c->pending_len--;
+    }
+
+    // the results of each query are followed by NULL, and the pipeline is
+    // terminated by PGRES_PIPELINE_SYNC
+    while (query < 2) {
+        PGresult *res = PQgetResult(conn);
+
+        if (!res) {
+            stats_done(c);
+            if (PQstatus(conn) == CONNECTION_BAD) {
+                break;
+            }
+            query++;
+            continue;
+        }
+        stats_result(c, res);
+        if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+            PQclear(res);
+            break;
+        } else if (query == 1) {
+            PQclear(last);
+            last = res;
+        } else {
+            PQclear(res);
+        }
+    }
+    if (query == 2) {
+        PGresult *res = PQgetResult(conn);
+        if (res) {
+            stats_result(c, res);
+            PQclear(res);
+        }
+    }
+    PQexitPipelineMode(conn);
+    txn_check_begin(c);
+
+    if (!sent) {
+        PQclear(last);
+        return NULL;
+    }
+    return last;
+}
+
+/**
+ * executes the command, or the prepared statement stmt if it is not NULL,
+ * with the parameters, and pushes the result object that refers to the
+ * connection at conn_idx. the lengths and formats can be NULL if all
+ * parameters are text. the result is NULL on failure.
+ */
+static PGresult **exec_core(lua_State *L, conn_t *c, int conn_idx,
+                            const char *stmt, const char *command, size_t len,
+                            int nparams, const char **params,
+                            const int *lengths, const int *formats, int *eno)
+{
+    PGconn *conn   = c->conn;
+    PGresult **res = libpq_result_new(L, conn_idx, 0);
+    size_t nbytes  = 0;
+    int sent       = 0;
+
+    if (c->txn.deferred) {
+        if (!c->query_timeout && PQpipelineStatus(conn) == PQ_PIPELINE_OFF) {
+            *res = exec_with_begin(L, c, stmt, command, len, nparams, params,
+                                   lengths, formats);
+            if (*res) {
+                gc_hint(L, c);
+            } else {
+                stats_error(c, NULL);
+            }
+            return res;
+        } else if (begin_now(L, c, eno)) {
+            return res;
+        }
+    }
+
+    if (stmt) {
+        // only the statement name is sent with the parameters
+        nbytes =
+            stats_sent(L, c, stmt, strlen(stmt), nparams, params, lengths);
+    } else {
+        nbytes = stats_sent(L, c, command, len, nparams, params, lengths);
+    }
+    if (!c->query_timeout) {
+        if (stmt) {
+            *res = PQexecPrepared(conn, stmt, nparams, params, lengths,
+                                  formats, c->result_format);
+        } else {
+            *res = PQexecParams(conn, command, nparams, NULL, params, lengths,
+                                formats, c->result_format);
+        }
+        if (*res) {
+            stats_result(c, *res);
+        }
+        stats_done(c);
+    } else {
+        if (stmt) {
+            sent = PQsendQueryPrepared(conn, stmt, nparams, params, lengths,
+                                       formats, c->result_format);
+        } else {
+            sent = PQsendQueryParams(conn, command, nparams, NULL, params,
+                                     lengths, formats, c->result_format);
+        }
+        if (sent) {
+            *res = wait_last_result(c, eno);
+        } else {
+            stats_unsent(c, nbytes);
+        }
+    }
+    if (*res) {
+        gc_hint(L, c);
+    } else {
+        stats_error(c, NULL);
+    }
+    return res;
+}
+
+/**
+ * executes the command at idx with the nparams parameters that follow it,
+ * and pushes the result object. the result is NULL on failure.
+ */
+static PGresult **exec_params(lua_State *L, conn_t *c, int idx, int nparams,
+                              int *eno)
+{
+    size_t len          = 0;
+    const char *command = lauxh_checklstring(L, idx, &len);
+    const char **params = NULL;
 
+    if (nparams) {
+        params = lua_newuserdata(L, sizeof(char *) * nparams);
+        for (int i = 0, j = idx + 1; i < nparams; i++, j++) {
+            params[i] = libpq_param2string(L, j);
+        }
+    }
+    return exec_core(L, c, 1, NULL, command, len, nparams, params, NULL, NULL,
+                     eno);
+}
+
+/**
+ * executes the command, or the prepared statement stmt, on the connection at
+ * the absolute index idx for the other modules. pushes the result object, or
+ * nil and error, and returns the number of pushed values.
+ */
+int libpq_conn_exec(lua_State *L, int idx, const char *stmt,
+                    const char *command, size_t len, int nparams,
+                    const char **params, const char *op)
+{
+    conn_t *c      = checkconn(L, idx);
+    int eno        = 0;
+    PGresult **res = exec_core(L, c, idx, stmt, command, len, nparams, params,
+                               NULL, NULL, &eno);
+
+    if (*res) {
+        return 1;
+    }
+    return push_exec_error(L, c->conn, eno, op);
+}
+
+/**
+ * updates the parameter types of the statement that prepared with the
+ * types. the types are cached only if all of them are specified, because
+ * the server infers the rest of them.
+ */
+static void cache_param_types(conn_t *c, const char *stmt, int nparams,
+                              const Oid *types)
+{
+    int ntypes = (types) ? nparams : 0;
+
+    for (int i = 0; i < ntypes; i++) {
+        if (!types[i]) {
+            ntypes = 0;
+            break;
+        }
+    }
+    if (ntypes) {
+        if (c->ptypes || (c->ptypes = libpq_ptypes_new())) {
+            // the cache is the best effort
+            libpq_ptypes_set(c->ptypes, stmt, nparams, types);
+        }
+    } else if (c->ptypes) {
+        libpq_ptypes_remove(c->ptypes, stmt);
+    }
+}
+
+/**
+ * prepares the command as the statement stmt. returns the last result, or
+ * NULL on failure the same as wait_last_result.
+ */
+static PGresult *prepare_core(lua_State *L, conn_t *c, const char *stmt,
+                              const char *command, size_t len, int nparams,
+                              const Oid *types, int *eno)
+{
+    PGconn *conn  = c->conn;
+    size_t nbytes = stats_sent(L, c, command, len, 0, NULL, NULL);
+    PGresult *res = NULL;
+
+    if (!c->query_timeout) {
+        res = PQprepare(conn, stmt, command, nparams, types);
+        if (res) {
+            stats_result(c, res);
+        }
+        stats_done(c);
+    } else if (PQsendPrepare(conn, stmt, command, nparams, types)) {
+        res = wait_last_result(c, eno);
+    } else {
+        stats_unsent(c, nbytes);
+    }
+
+    if (!res) {
+        stats_error(c, NULL);
+    } else if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+        cache_param_types(c, stmt, nparams, types);
+    }
+    return res;
+}
+
+/**
+ * prepares the command as the statement stmt on the connection at idx for
+ * the other modules. returns 0 on success, otherwise pushes nil and error and
+ * returns 2.
+ */
+int libpq_conn_prepare(lua_State *L, int idx, const char *stmt,
+                       const char *command, size_t len, int nparams,
+                       const char *op)
+{
+    conn_t *c     = checkconn(L, idx);
+    int eno       = 0;
+    PGresult *res = prepare_core(L, c, stmt, command, len, nparams, NULL, &eno);
+
+    if (!res) {
+        return push_exec_error(L, c->conn, eno, op);
+    } else if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        lua_pushnil(L);
+        lua_pushstring(L, PQresultErrorMessage(res));
+        PQclear(res);
+        return 2;
+    }
+    PQclear(res);
+    return 0;
+}
+
+static int prepare_lua(lua_State *L)
+{
+    conn_t *c           = checkself(L);
+    const char *stmt    = lauxh_checkstring(L, 2);
+    size_t len          = 0;
+    const char *command = lauxh_checklstring(L, 3, &len);
+    int nparams         = lua_gettop(L) - 3;
+    Oid *types          = check_param_types(L, 4, nparams);
+    PGresult **res      = libpq_result_new(L, 1, 0);
+    int eno             = 0;
+
+    *res = prepare_core(L, c, stmt, command, len, nparams, types, &eno);
+    if (*res) {
+        gc_hint(L, c);
+        return 1;
+    }
     // got error
-    lua_pushnil(L);
-    lua_pushstring(L, PQerrorMessage(conn));
+    return push_exec_error(L, c->conn, eno, "prepare");
+}
+
+static int send_prepare_lua(lua_State *L)
+{
+    conn_t *c           = checkself(L);
+    const char *stmt    = lauxh_checkstring(L, 2);
+    size_t len          = 0;
+    const char *command = lauxh_checklstring(L, 3, &len);
+    int nparams         = lua_gettop(L) - 3;
+    Oid *types          = check_param_types(L, 4, nparams);
+    size_t nbytes       = stats_sent(L, c, command, len, 0, NULL, NULL);
+
+    // the types are not cached, because the prepare can still be rejected
+    // by the server, for example if the statement already exists
+    if (PQsendPrepare(c->conn, stmt, command, nparams, types)) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // got error
+    stats_unsent(c, nbytes);
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, PQerrorMessage(c->conn));
     return 2;
 }
 
+static int exec_prepared_lua(lua_State *L)
+{
+    conn_t *c        = checkself(L);
+    const char *stmt = lauxh_checkstring(L, 2);
+    int nparams      = lua_gettop(L) - 2;
+    int eno          = 0;
+    params_t p       = prepared_params(L, c, stmt, 3, nparams);
+    PGresult **res   = exec_core(L, c, 1, stmt, NULL, 0, nparams, p.values,
+                                 p.lengths, p.formats, &eno);
+
+    if (*res) {
+        return 1;
+    }
+    // got error
+    return push_exec_error(L, c->conn, eno, "exec_prepared");
+}
+
+static int send_query_prepared_lua(lua_State *L)
+{
+    conn_t *c        = checkself(L);
+    const char *stmt = lauxh_checkstring(L, 2);
+    int nparams      = lua_gettop(L) - 2;
+    params_t p       = prepared_params(L, c, stmt, 3, nparams);
+    size_t nbytes    = 0;
+    int rv           = 0;
+
+    if ((rv = send_begin(L, c, "send_query_prepared"))) {
+        return rv;
+    }
+    nbytes = stats_sent(L, c, stmt, strlen(stmt), nparams, p.values,
+                        p.lengths);
+    if (PQsendQueryPrepared(c->conn, stmt, nparams, p.values, p.lengths,
+                            p.formats, c->result_format)) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // got error
+    stats_unsent(c, nbytes);
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, PQerrorMessage(c->conn));
+    return 2;
+}
+
+/**
+ * describes the prepared statement or the portal. the parameter types of
+ * the described statement are cached for the exec_prepared.
+ */
+static int describe(lua_State *L, int portal, const char *op)
+{
+    conn_t *c        = checkself(L);
+    PGconn *conn     = c->conn;
+    const char *name = lauxh_checkstring(L, 2);
+    PGresult **res   = libpq_result_new(L, 1, 0);
+    size_t nbytes    = stats_sent(L, c, name, strlen(name), 0, NULL, NULL);
+    int eno          = 0;
+    int sent         = 0;
+
+    if (!c->query_timeout) {
+        if (portal) {
+            *res = PQdescribePortal(conn, name);
+        } else {
+            *res = PQdescribePrepared(conn, name);
+        }
+        if (*res) {
+            stats_result(c, *res);
+        }
+        stats_done(c);
+    } else {
+        if (portal) {
+            sent = PQsendDescribePortal(conn, name);
+        } else {
+            sent = PQsendDescribePrepared(conn, name);
+        }
+        if (sent) {
+            *res = wait_last_result(c, &eno);
+        } else {
+            stats_unsent(c, nbytes);
+        }
+    }
+
+    if (!*res) {
+        stats_error(c, NULL);
+        return push_exec_error(L, conn, eno, op);
+    } else if (!portal && PQresultStatus(*res) == PGRES_COMMAND_OK &&
+               (c->ptypes || (c->ptypes = libpq_ptypes_new()))) {
+        int nparams = PQnparams(*res);
+        Oid *types  = lua_newuserdata(L, sizeof(Oid) * (nparams + 1));
+
+        for (int i = 0; i < nparams; i++) {
+            types[i] = PQparamtype(*res, i);
+        }
+        // the cache is the best effort
+        libpq_ptypes_set(c->ptypes, name, nparams, types);
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+static int describe_prepared_lua(lua_State *L)
+{
+    return describe(L, 0, "describe_prepared");
+}
+
+static int describe_portal_lua(lua_State *L)
+{
+    return describe(L, 1, "describe_portal");
+}
+
+static int send_describe(lua_State *L, int portal)
+{
+    conn_t *c        = checkself(L);
+    const char *name = lauxh_checkstring(L, 2);
+    size_t nbytes    = stats_sent(L, c, name, strlen(name), 0, NULL, NULL);
+    int sent         = 0;
+
+    if (portal) {
+        sent = PQsendDescribePortal(c->conn, name);
+    } else {
+        sent = PQsendDescribePrepared(c->conn, name);
+    }
+    if (sent) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // got error
+    stats_unsent(c, nbytes);
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, PQerrorMessage(c->conn));
+    return 2;
+}
+
+static int send_describe_prepared_lua(lua_State *L)
+{
+    return send_describe(L, 0);
+}
+
+static int send_describe_portal_lua(lua_State *L)
+{
+    return send_describe(L, 1);
+}
+
+static int param_types_lua(lua_State *L)
+{
+    conn_t *c        = checkself(L);
+    const char *stmt = lauxh_checkstring(L, 2);
+    int nparams      = 0;
+    const Oid *types = NULL;
+
+    if (c->ptypes && (types = libpq_ptypes_get(c->ptypes, stmt, &nparams))) {
+        lua_createtable(L, nparams, 0);
+        for (int i = 0; i < nparams; i++) {
+            lua_pushinteger(L, types[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static int clear_param_types_lua(lua_State *L)
+{
+    conn_t *c        = checkself(L);
+    const char *stmt = lauxh_optstring(L, 2, NULL);
+
+    if (!c->ptypes) {
+        return 0;
+    } else if (stmt) {
+        libpq_ptypes_remove(c->ptypes, stmt);
+    } else {
+        libpq_ptypes_free(c->ptypes);
+        c->ptypes = NULL;
+    }
+    return 0;
+}
+
+static int exec_params_lua(lua_State *L)
+{
+    conn_t *c      = checkself(L);
+    int eno        = 0;
+    PGresult **res = exec_params(L, c, 2, lua_gettop(L) - 2, &eno);
+
+    if (*res) {
+        return 1;
+    }
+    // got error
+    return push_exec_error(L, c->conn, eno, "exec_params");
+}
+
+static int exec_params_cached_lua(lua_State *L)
+{
+    conn_t *c              = checkself(L);
+    const char *channel    = lauxh_optstring(L, 2, NULL);
+    size_t len             = 0;
+    const char *command    = lauxh_checklstring(L, 3, &len);
+    int nparams            = lua_gettop(L) - 3;
+    size_t keylen          = 0;
+    const char *key        = NULL;
+    const PGresult *cached = NULL;
+    PGresult **res         = NULL;
+    int eno                = 0;
+    luaL_Buffer b;
+
+    if (!c->rcache) {
+        res = exec_params(L, c, 3, nparams, &eno);
+        if (*res) {
+            return 1;
+        }
+        return push_exec_error(L, c->conn, eno, "exec_params_cached");
+    }
+
+    // make the cache key from the command and parameters
+    for (int i = 4; i < 4 + nparams; i++) {
+        libpq_param2string(L, i);
+    }
+    luaL_buffinit(L, &b);
+    luaL_addchar(&b, '0' + c->result_format);
+    luaL_addlstring(&b, command, len + 1);
+    for (int i = 4; i < 4 + nparams; i++) {
+        if (lua_isnil(L, i)) {
+            luaL_addchar(&b, 0);
+        } else {
+            size_t plen     = 0;
+            const char *val = lua_tolstring(L, i, &plen);
+            luaL_addchar(&b, 1);
+            luaL_addlstring(&b, (const char *)&plen, sizeof(plen));
+            luaL_addlstring(&b, val, plen);
+        }
+    }
+    luaL_pushresult(&b);
+    key = lua_tolstring(L, -1, &keylen);
+
+    // invalidate the entries by the received notifications
+    PQconsumeInput(c->conn);
+    consume_notifies(c);
+    if ((cached = libpq_rcache_get(c->rcache, key, keylen))) {
+        res = libpq_result_new(L, 1, 0);
+        if (!(*res = PQcopyResult(cached,
+                                  PG_COPYRES_ATTRS | PG_COPYRES_TUPLES))) {
+            lua_pushnil(L);
+            lua_errno_new(L, ENOMEM, "exec_params_cached");
+            return 2;
+        }
+        // the copy of the cached result is not tracked by the events
+        c->gc_debt += PQresultMemorySize(*res);
+        gc_hint(L, c);
+        return 1;
+    }
+
+    res = exec_params(L, c, 3, nparams, &eno);
+    if (!*res) {
+        return push_exec_error(L, c->conn, eno, "exec_params_cached");
+    } else if (PQresultStatus(*res) == PGRES_TUPLES_OK) {
+        // the cache is the best effort, the result is returned even if it
+        // cannot be cached
+        libpq_rcache_set(c->rcache, key, keylen, channel, *res);
+    }
+    return 1;
+}
+
+static int insert_batcher_lua(lua_State *L)
+{
+    size_t prefix_len     = 0;
+    size_t suffix_len     = 0;
+    const char *prefix    = NULL;
+    lua_Integer ncol      = 0;
+    const char *suffix    = NULL;
+    lua_Integer max_rows  = 0;
+    lua_Integer max_bytes = 0;
+
+    checkself(L);
+    prefix    = lauxh_checklstring(L, 2, &prefix_len);
+    ncol      = lauxh_checkinteger(L, 3);
+    suffix    = lauxh_optlstring(L, 4, "", &suffix_len);
+    max_rows  = lauxh_optinteger(L, 5, 1000);
+    max_bytes = lauxh_optinteger(L, 6, 1024 * 1024);
+    if (ncol < 1 || ncol > 65535) {
+        lauxh_argerror(L, 3, "ncol must be in the range of 1 to 65535");
+    } else if (max_rows < 1) {
+        lauxh_argerror(L, 5, "max_rows must be greater than 0");
+    } else if (max_bytes < 1) {
+        lauxh_argerror(L, 6, "max_bytes must be greater than 0");
+    } else if (max_rows > INT_MAX) {
+        max_rows = INT_MAX;
+    }
+
+    if (libpq_batcher_new(L, prefix, prefix_len, suffix, suffix_len, ncol,
+                          max_rows, max_bytes)) {
+        lua_pushnil(L);
+        lua_errno_new(L, errno, "insert_batcher");
+        return 2;
+    }
+    return 1;
+}
+
+static int set_result_cache_lua(lua_State *L)
+{
+    conn_t *c             = checkself(L);
+    lua_Integer max_bytes = lauxh_checkinteger(L, 2);
+    lua_Integer ttl       = lauxh_optinteger(L, 3, 0);
+
+    if (max_bytes < 0) {
+        lauxh_argerror(L, 2, "max_bytes must be greater than or equal to 0");
+    } else if (ttl < 0) {
+        lauxh_argerror(L, 3, "ttl must be greater than or equal to 0");
+    }
+
+    // discard the current cache
+    if (c->rcache) {
+        libpq_rcache_free(c->rcache);
+        c->rcache = NULL;
+    }
+    if (max_bytes &&
+        !(c->rcache = libpq_rcache_new(max_bytes, (uint64_t)ttl * 1000000))) {
+        lua_pushboolean(L, 0);
+        lua_errno_new(L, errno, "set_result_cache");
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int invalidate_result_cache_lua(lua_State *L)
+{
+    conn_t *c           = checkself(L);
+    const char *channel = lauxh_optstring(L, 2, NULL);
+
+    if (c->rcache) {
+        libpq_rcache_invalidate(c->rcache, channel);
+    }
+    return 0;
+}
+
+static int result_cache_stat_lua(lua_State *L)
+{
+    conn_t *c = checkself(L);
+
+    if (c->rcache) {
+        libpq_rcache_push_stat(L, c->rcache);
+        return 1;
+    }
+    return 0;
+}
+
 static int exec_lua(lua_State *L)
 {
-    PGconn *conn        = libpq_check_conn(L);
+    conn_t *c           = checkself(L);
     const char *command = lauxh_checkstring(L, 2);
-    PGresult **res      = libpq_result_new(L, 1, 0);
+    PGresult **res      = NULL;
+    int eno             = 0;
 
-    *res = PQexec(conn, command);
+    if (c->txn.deferred) {
+        // send the deferred BEGIN with the command in one round trip
+        command = lua_pushfstring(L, "%s; %s", c->txn.begin, command);
+    }
+    res  = libpq_result_new(L, 1, 0);
+    *res = exec_simple(L, c, command, &eno);
+    txn_check_begin(c);
     if (*res) {
+        gc_hint(L, c);
         return 1;
     }
 
     // got error
-    lua_pushnil(L);
-    lua_pushstring(L, PQerrorMessage(conn));
-    return 2;
+    return push_exec_error(L, c->conn, eno, "exec");
+}
+
+static lua_Integer txn_optinteger(lua_State *L, const char *k,
+                                  lua_Integer def)
+{
+    lua_Integer v = def;
+
+    lua_getfield(L, 3, k);
+    if (!lua_isnil(L, -1)) {
+        if (lua_type(L, -1) != LUA_TNUMBER || lua_tointeger(L, -1) < 0) {
+            luaL_error(L, "opts.%s must be integer greater than or equal to 0",
+                       k);
+        }
+        v = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    return v;
+}
+
+static int txn_optboolean(lua_State *L, const char *k)
+{
+    int v = 0;
+
+    lua_getfield(L, 3, k);
+    if (!lua_isnil(L, -1)) {
+        if (lua_type(L, -1) != LUA_TBOOLEAN) {
+            luaL_error(L, "opts.%s must be boolean", k);
+        }
+        v = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+    return v;
+}
+
+static const char *txn_optisolation(lua_State *L)
+{
+    static const char *const levels[][2] = {
+        {"serializable",     "SERIALIZABLE"    },
+        {"repeatable read",  "REPEATABLE READ" },
+        {"read committed",   "READ COMMITTED"  },
+        {"read uncommitted", "READ UNCOMMITTED"},
+    };
+    const char *v = NULL;
+
+    lua_getfield(L, 3, "isolation");
+    if (!lua_isnil(L, -1)) {
+        const char *name = lua_tostring(L, -1);
+
+        for (size_t i = 0; name && i < sizeof(levels) / sizeof(*levels); i++) {
+            if (!strcasecmp(name, levels[i][0])) {
+                v = levels[i][1];
+                break;
+            }
+        }
+        if (!v) {
+            luaL_error(L, "opts.isolation must be one of 'serializable', "
+                          "'repeatable read', 'read committed' or "
+                          "'read uncommitted'");
+        }
+    }
+    lua_pop(L, 1);
+    return v;
+}
+
+/**
+ * commits the transaction. returns 0 on success, otherwise pushes the error
+ * and returns -1.
+ */
+static int txn_commit(lua_State *L, conn_t *c)
+{
+    PGresult *res = NULL;
+    int eno       = 0;
+    int rv        = -1;
+
+    if (c->txn.deferred) {
+        // no query has been run in the transaction
+        c->txn.deferred = 0;
+        return 0;
+    } else if (PQtransactionStatus(c->conn) == PQTRANS_IDLE) {
+        // the queries after the transaction ended were run in autocommit
+        lua_pushliteral(L, "transaction has been ended by the function");
+        return -1;
+    } else if (!(res = exec_simple(L, c, "COMMIT", &eno))) {
+        if (eno) {
+            lua_errno_new(L, eno, "transaction");
+        } else {
+            lua_pushstring(L, PQerrorMessage(c->conn));
+        }
+    } else if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        lua_pushstring(L, PQresultErrorMessage(res));
+    } else if (strcmp(PQcmdStatus(res), "COMMIT")) {
+        // the failed transaction is rolled back by the COMMIT
+        lua_pushliteral(L, "transaction has been rolled back");
+    } else {
+        rv = 0;
+    }
+    PQclear(res);
+    return rv;
+}
+
+static void txn_rollback(lua_State *L, conn_t *c)
+{
+    int eno = 0;
+
+    c->txn.deferred = 0;
+    if (PQtransactionStatus(c->conn) != PQTRANS_IDLE) {
+        PQclear(exec_simple(L, c, "ROLLBACK", &eno));
+    }
+}
+
+/**
+ * sleeps for the exponential backoff of the attempt with the equal jitter,
+ * that is between the half and the whole of the delay.
+ */
+static void txn_backoff(int attempt, lua_Integer base, lua_Integer max)
+{
+    uint64_t delay    = (uint64_t)base * 1000000;
+    struct timespec t = {0};
+
+    for (int i = 0; i < attempt && delay < (uint64_t)max * 1000000; i++) {
+        delay *= 2;
+    }
+    if (delay > (uint64_t)max * 1000000) {
+        delay = (uint64_t)max * 1000000;
+    }
+    delay     = delay / 2 + libpq_getnsec() % (delay / 2 + 1);
+    t.tv_sec  = (time_t)(delay / 1000000000);
+    t.tv_nsec = (long)(delay % 1000000000);
+    while (nanosleep(&t, &t) == -1 && errno == EINTR) {
+    }
+}
+
+static int transaction_lua(lua_State *L)
+{
+    conn_t *c               = checkself(L);
+    const char *isolation   = NULL;
+    int read_only           = 0;
+    int deferrable          = 0;
+    lua_Integer retries     = TXN_RETRIES;
+    lua_Integer backoff     = TXN_BACKOFF;
+    lua_Integer max_backoff = TXN_MAX_BACKOFF;
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    if (!lua_isnoneornil(L, 3)) {
+        lauxh_checktable(L, 3);
+        isolation   = txn_optisolation(L);
+        read_only   = txn_optboolean(L, "read_only");
+        deferrable  = txn_optboolean(L, "deferrable");
+        retries     = txn_optinteger(L, "retries", TXN_RETRIES);
+        backoff     = txn_optinteger(L, "backoff", TXN_BACKOFF);
+        max_backoff = txn_optinteger(L, "max_backoff", TXN_MAX_BACKOFF);
+    }
+
+    if (c->txn.active || PQtransactionStatus(c->conn) != PQTRANS_IDLE) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "transaction is already in progress");
+        return 2;
+    }
+    snprintf(c->txn.begin, sizeof(c->txn.begin), "BEGIN%s%s%s%s",
+             isolation ? " ISOLATION LEVEL " : "", isolation ? isolation : "",
+             read_only ? " READ ONLY" : "", deferrable ? " DEFERRABLE" : "");
+
+    for (int attempt = 0;; attempt++) {
+        int ok = 0;
+
+        // BEGIN is deferred until the first query to send them at once
+        c->txn.active      = 1;
+        c->txn.deferred    = 1;
+        c->txn.sqlstate[0] = 0;
+        lua_settop(L, 2);
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, 1);
+        ok = lua_pcall(L, 1, LUA_MULTRET, 0) == 0;
+        if (!c->conn) {
+            lua_pushboolean(L, 0);
+            lua_pushliteral(L, "connection has been finished");
+            return 2;
+        } else if (ok && !txn_commit(L, c)) {
+            c->txn.active = 0;
+            c->stats.transactions++;
+            // return true and the values returned by the function
+            lua_pushboolean(L, 1);
+            lua_replace(L, 2);
+            return lua_gettop(L) - 1;
+        }
+
+        // the error is at the top of the stack
+        txn_rollback(L, c);
+        c->txn.active = 0;
+        if (!c->txn.sqlstate[0] || attempt >= retries) {
+            c->stats.transaction_failures++;
+            lua_pushboolean(L, 0);
+            lua_insert(L, -2);
+            return 2;
+        }
+        c->stats.transaction_retries++;
+        txn_backoff(attempt, backoff, max_backoff);
+    }
+}
+
+static int query_timeout_lua(lua_State *L)
+{
+    conn_t *c = checkself(L);
+    lua_pushinteger(L, c->query_timeout);
+    return 1;
+}
+
+static int set_query_timeout_lua(lua_State *L)
+{
+    conn_t *c = checkself(L);
+    int msec  = lauxh_optpinteger(L, 2, 0);
+    int prev  = c->query_timeout;
+
+    c->query_timeout = msec;
+    lua_pushinteger(L, prev);
+    return 1;
+}
+
+static int result_format_lua(lua_State *L)
+{
+    conn_t *c = checkself(L);
+    lua_pushinteger(L, c->result_format);
+    return 1;
+}
+
+static int set_result_format_lua(lua_State *L)
+{
+    conn_t *c  = checkself(L);
+    int format = lauxh_optinteger(L, 2, 0);
+    int prev   = c->result_format;
+
+    if (format != 0 && format != 1) {
+        lauxh_argerror(L, 2, "format must be 0 (text) or 1 (binary)");
+    }
+    c->result_format = format;
+    lua_pushinteger(L, prev);
+    return 1;
 }
 
 static int set_trace_flags_lua(lua_State *L)
 {
-    PGconn *conn = libpq_check_conn(L);
-    int flags    = lauxh_optflags(L, 2);
+    conn_t *c = checkself(L);
+    int flags = lauxh_optflags(L, 2);
 
-    PQsetTraceFlags(conn, flags);
+    c->trace_flags = flags;
+    if (c->tracebuf) {
+        // the messages are timestamped by the tracer
+        flags |= PQTRACE_SUPPRESS_TIMESTAMPS;
+    }
+    PQsetTraceFlags(c->conn, flags);
     return 0;
 }
 
+static int trace_records_lua(lua_State *L)
+{
+    conn_t *c = checkself(L);
+    int n     = lauxh_optpinteger(L, 2, 0);
+
+    if (!c->tracebuf) {
+        lua_newtable(L);
+        lua_pushinteger(L, 0);
+        return 2;
+    }
+    libpq_trace_push(L, c->tracebuf, n);
+    return 2;
+}
+
 static int untrace_lua(lua_State *L)
 {
     conn_t *c = checkself(L);
 
     PQuntrace(c->conn);
+    if (c->tracebuf) {
+        libpq_trace_free(c->tracebuf);
+        c->tracebuf = NULL;
+    }
     if (c->trace_ref == LUA_NOREF) {
         lua_pushnil(L);
     } else {
@@ -565,7 +3002,33 @@ static int trace_lua(lua_State *L)
     // set new file
     c->trace_ref = lauxh_refat(L, 2);
     PQtrace(c->conn, debug_port);
+    PQsetTraceFlags(c->conn, c->trace_flags);
+
+    return 1;
+}
+
+static int trace_buffer_lua(lua_State *L)
+{
+    conn_t *c = checkself(L);
+    int size  = lauxh_optpinteger(L, 2, 1024);
+
+    if (size < 1) {
+        lauxh_argerror(L, 2, "size must be greater than 0");
+    }
+    // remove old file
+    untrace_lua(L);
+    lua_settop(L, 1);
 
+    c->tracebuf = libpq_trace_new(size);
+    if (!c->tracebuf) {
+        lua_pushboolean(L, 0);
+        lua_errno_new(L, errno, "trace_buffer");
+        return 2;
+    }
+    PQtrace(c->conn, libpq_trace_file(c->tracebuf));
+    // the messages are timestamped by the tracer
+    PQsetTraceFlags(c->conn, c->trace_flags | PQTRACE_SUPPRESS_TIMESTAMPS);
+    lua_pushboolean(L, 1);
     return 1;
 }
 
@@ -703,6 +3166,242 @@ static int set_notice_processor_lua(lua_State *L)
     return 0;
 }
 
+/**
+ * the query offloaded to the worker thread. the command and the parameters
+ * are copied after the struct, so that the worker can refer to them after
+ * the lua values are collected.
+ */
+typedef struct {
+    libpq_task_t task;
+    conn_t *c;
+    int ref_conn;
+    const char *op;
+    // executes the command by PQexec if set
+    int simple;
+    const char *command;
+    int nparams;
+    const char **params;
+    size_t nbytes;
+    PGresult *res;
+    int eno;
+} offload_query_t;
+
+static void deliver_notice(conn_t *c, const PGresult *res, const char *msg)
+{
+    if (res && c->notice_recv_ref != LUA_NOREF) {
+        notice_recv(c, res);
+    } else if (c->notice_proc_ref != LUA_NOREF) {
+        notice_proc(c, msg);
+    } else {
+        // same as the default notice processor
+        fprintf(stderr, "%s", msg);
+    }
+}
+
+/**
+ * the notice receiver of the offloaded query. the notices that received on
+ * the worker thread are saved and passed to the notice receiver or the
+ * processor after the query is completed, since lua cannot be called there.
+ */
+static void offload_notice(void *arg, const PGresult *res)
+{
+    conn_t *c = (conn_t *)arg;
+
+    if (!libpq_offload_in_worker()) {
+        // the result that created on the worker thread raised the notice
+        deliver_notice(c, res, PQresultErrorMessage(res));
+    } else {
+        // the notice is dropped if failed to allocate memory
+        libpq_notice_save(&c->offload_notices, res);
+    }
+}
+
+static void offload_run(libpq_task_t *t)
+{
+    offload_query_t *q = (offload_query_t *)t;
+    conn_t *c          = q->c;
+    int sent           = 0;
+
+    if (!c->query_timeout) {
+        if (q->simple) {
+            q->res = PQexec(c->conn, q->command);
+        } else {
+            q->res = PQexecParams(c->conn, q->command, q->nparams, NULL,
+                                  q->params, NULL, NULL, c->result_format);
+        }
+        if (q->res) {
+            stats_result(c, q->res);
+        }
+        stats_done(c);
+    } else {
+        if (q->simple) {
+            sent = PQsendQuery(c->conn, q->command);
+        } else {
+            sent = PQsendQueryParams(c->conn, q->command, q->nparams, NULL,
+                                     q->params, NULL, NULL, c->result_format);
+        }
+        if (sent) {
+            q->res = wait_last_result(c, &q->eno);
+        } else {
+            stats_unsent(c, q->nbytes);
+        }
+    }
+    if (!q->res) {
+        stats_error(c, NULL);
+    }
+}
+
+/**
+ * pushes the connection followed by the result object, or nil and error.
+ */
+static int offload_complete(lua_State *L, libpq_task_t *t)
+{
+    offload_query_t *q = (offload_query_t *)t;
+    conn_t *c          = q->c;
+    PGresult **res     = NULL;
+    int conn_idx       = 0;
+    int nret           = 2;
+
+    lauxh_pushref(L, q->ref_conn);
+    conn_idx = lua_gettop(L);
+    res      = libpq_result_new(L, conn_idx, 0);
+    *res     = q->res;
+    lauxh_unref(L, q->ref_conn);
+    c->offload = NULL;
+    if (c->offload_recv) {
+        PQsetNoticeReceiver(c->conn, c->offload_recv,
+                            c->default_recv ? c : NULL);
+        c->offload_recv = NULL;
+    }
+
+    if (*res) {
+        gc_hint(L, c);
+    } else {
+        lua_pop(L, 1);
+        push_exec_error(L, c->conn, q->eno, q->op);
+        nret = 3;
+    }
+    free(q);
+
+    if (c->offload_notices.len) {
+        size_t len         = c->offload_notices.len;
+        const char *notice = NULL;
+        const char *end    = NULL;
+
+        lua_pushlstring(L, c->offload_notices.data, len);
+        notice                 = lua_tostring(L, -1);
+        end                    = notice + len;
+        c->offload_notices.len = 0;
+        for (; c->conn && notice < end; notice += libpq_notice_len(notice)) {
+            if (c->notice_recv_ref != LUA_NOREF) {
+                // call closure with the result object of the notice
+                lauxh_pushref(L, c->notice_recv_ref);
+                libpq_notice_push(L, conn_idx, notice);
+                lua_call(L, 1, 0);
+            } else {
+                deliver_notice(c, NULL, notice);
+            }
+        }
+        lua_pop(L, 1);
+    }
+    return nret;
+}
+
+/**
+ * submits the command at index 3 with the parameters that follow it to the
+ * offload pool at index 1. the connection at index 2 cannot be used until
+ * the query is completed.
+ */
+static int offload_query(lua_State *L, int simple, const char *op)
+{
+    libpq_offload_t *pool = libpq_check_offload(L);
+    conn_t *c             = checkconn(L, 2);
+    size_t len            = 0;
+    const char *command   = lauxh_checklstring(L, 3, &len);
+    int nparams           = simple ? 0 : lua_gettop(L) - 3;
+    const char **params   = NULL;
+    size_t size           = sizeof(offload_query_t) + len + 1;
+    size_t nbytes         = 0;
+    offload_query_t *q    = NULL;
+    char *p               = NULL;
+    int eno               = 0;
+
+    if (nparams) {
+        params = lua_newuserdata(L, sizeof(char *) * nparams);
+        size += sizeof(char *) * nparams;
+        for (int i = 0, j = 4; i < nparams; i++, j++) {
+            size_t plen = 0;
+            if ((params[i] = libpq_param2string(L, j))) {
+                lua_tolstring(L, j, &plen);
+                size += plen + 1;
+            }
+        }
+    }
+
+    // BEGIN cannot be sent with the offloaded query
+    if (begin_now(L, c, &eno)) {
+        lua_pushboolean(L, 0);
+        if (eno) {
+            lua_errno_new(L, eno, op);
+        } else {
+            lua_pushstring(L, PQerrorMessage(c->conn));
+        }
+        return 2;
+    }
+    nbytes = stats_sent(L, c, command, len, nparams, params, NULL);
+    if (!(q = malloc(size))) {
+        stats_unsent(c, nbytes);
+        lua_pushboolean(L, 0);
+        lua_errno_new(L, errno, op);
+        return 2;
+    }
+
+    *q = (offload_query_t){
+        .task     = {.run = offload_run, .complete = offload_complete},
+        .c        = c,
+        .ref_conn = lauxh_refat(L, 2),
+        .op       = op,
+        .simple   = simple,
+        .nparams  = nparams,
+        .params   = (const char **)(q + 1),
+        .nbytes   = nbytes,
+    };
+    p = (char *)(q->params + nparams);
+    memcpy(p, command, len + 1);
+    q->command = p;
+    p += len + 1;
+    for (int i = 0, j = 4; i < nparams; i++, j++) {
+        size_t plen = 0;
+
+        q->params[i] = NULL;
+        if (params[i]) {
+            lua_tolstring(L, j, &plen);
+            memcpy(p, params[i], plen + 1);
+            q->params[i] = p;
+            p += plen + 1;
+        }
+    }
+
+    if (c->default_recv || c->default_proc) {
+        // the notice functions must not be called on the worker thread
+        c->offload_recv = PQsetNoticeReceiver(c->conn, offload_notice, c);
+    }
+    c->offload = &q->task;
+    libpq_offload_submit(pool, &q->task);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int libpq_conn_offload_exec_lua(lua_State *L)
+{
+    return offload_query(L, 1, "exec");
+}
+
+int libpq_conn_offload_exec_params_lua(lua_State *L)
+{
+    return offload_query(L, 0, "exec_params");
+}
+
 static int set_error_context_visibility_lua(lua_State *L)
 {
     PGconn *conn   = libpq_check_conn(L);
@@ -985,16 +3684,387 @@ static int conninfo_lua(lua_State *L)
     return 2;
 }
 
+/**
+ * returns the connection for the large object operations. the deferred
+ * BEGIN of the transaction helper is sent first, because the operations
+ * must be done in the transaction. returns NULL if the BEGIN failed, and
+ * the eno is set as exec_simple.
+ */
+static PGconn *check_lo_conn(lua_State *L, int *eno)
+{
+    conn_t *c = checkself(L);
+
+    if (begin_now(L, c, eno)) {
+        return NULL;
+    }
+    return c->conn;
+}
+
+/**
+ * pushes the error of the large object operation, or the deferred BEGIN,
+ * after the value that pushed before. returns 2.
+ */
+static int push_lo_error(lua_State *L, int eno, const char *op)
+{
+    if (eno) {
+        lua_errno_new(L, eno, op);
+    } else {
+        lua_pushstring(L, PQerrorMessage(checkself(L)->conn));
+    }
+    return 2;
+}
+
+static int lo_creat_lua(lua_State *L)
+{
+    int eno      = 0;
+    PGconn *conn = check_lo_conn(L, &eno);
+    int mode     = lauxh_optinteger(L, 2, INV_READ | INV_WRITE);
+    Oid oid      = InvalidOid;
+
+    if (conn && (oid = lo_creat(conn, mode)) != InvalidOid) {
+        lua_pushinteger(L, oid);
+        return 1;
+    }
+
+    // got error
+    lua_pushnil(L);
+    return push_lo_error(L, eno, "lo_creat");
+}
+
+static int lo_create_lua(lua_State *L)
+{
+    int eno      = 0;
+    PGconn *conn = check_lo_conn(L, &eno);
+    Oid oid      = lauxh_optinteger(L, 2, InvalidOid);
+
+    if (conn && (oid = lo_create(conn, oid)) != InvalidOid) {
+        lua_pushinteger(L, oid);
+        return 1;
+    }
+
+    // got error
+    lua_pushnil(L);
+    return push_lo_error(L, eno, "lo_create");
+}
+
+static int lo_import_lua(lua_State *L)
+{
+    int eno              = 0;
+    PGconn *conn         = check_lo_conn(L, &eno);
+    const char *filename = lauxh_checkstring(L, 2);
+    Oid oid              = lauxh_optinteger(L, 3, InvalidOid);
+
+    if (conn &&
+        (oid = lo_import_with_oid(conn, filename, oid)) != InvalidOid) {
+        lua_pushinteger(L, oid);
+        return 1;
+    }
+
+    // got error
+    lua_pushnil(L);
+    return push_lo_error(L, eno, "lo_import");
+}
+
+static int lo_export_lua(lua_State *L)
+{
+    int eno              = 0;
+    PGconn *conn         = check_lo_conn(L, &eno);
+    Oid oid              = lauxh_checkinteger(L, 2);
+    const char *filename = lauxh_checkstring(L, 3);
+
+    if (conn && lo_export(conn, oid, filename) == 1) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // got error
+    lua_pushboolean(L, 0);
+    return push_lo_error(L, eno, "lo_export");
+}
+
+static int lo_unlink_lua(lua_State *L)
+{
+    int eno      = 0;
+    PGconn *conn = check_lo_conn(L, &eno);
+    Oid oid      = lauxh_checkinteger(L, 2);
+
+    if (conn && lo_unlink(conn, oid) == 1) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // got error
+    lua_pushboolean(L, 0);
+    return push_lo_error(L, eno, "lo_unlink");
+}
+
+static int lo_open_lua(lua_State *L)
+{
+    int eno      = 0;
+    PGconn *conn = check_lo_conn(L, &eno);
+    Oid oid      = lauxh_checkinteger(L, 2);
+    int mode     = lauxh_optinteger(L, 3, INV_READ);
+    int fd       = -1;
+
+    if (conn && (fd = lo_open(conn, oid, mode)) != -1) {
+        lua_pushinteger(L, fd);
+        return 1;
+    }
+
+    // got error
+    lua_pushnil(L);
+    return push_lo_error(L, eno, "lo_open");
+}
+
+static int lo_close_lua(lua_State *L)
+{
+    int eno      = 0;
+    PGconn *conn = check_lo_conn(L, &eno);
+    int fd       = lauxh_checkinteger(L, 2);
+
+    if (conn && lo_close(conn, fd) == 0) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // got error
+    lua_pushboolean(L, 0);
+    return push_lo_error(L, eno, "lo_close");
+}
+
+static int lo_read_lua(lua_State *L)
+{
+    int eno      = 0;
+    PGconn *conn = check_lo_conn(L, &eno);
+    int fd       = lauxh_checkinteger(L, 2);
+    size_t len   = lauxh_optpinteger(L, 3, LO_BUFSIZE);
+    char *buf    = lua_newuserdata(L, len);
+    int n        = -1;
+
+    if (conn && (n = lo_read(conn, fd, buf, len)) != -1) {
+        // returns an empty string at the end of the large object
+        lua_pushlstring(L, buf, n);
+        return 1;
+    }
+
+    // got error
+    lua_pushnil(L);
+    return push_lo_error(L, eno, "lo_read");
+}
+
+static int lo_write_lua(lua_State *L)
+{
+    int eno         = 0;
+    PGconn *conn    = check_lo_conn(L, &eno);
+    int fd          = lauxh_checkinteger(L, 2);
+    size_t len      = 0;
+    const char *buf = lauxh_checklstring(L, 3, &len);
+    int n           = -1;
+
+    if (conn && (n = lo_write(conn, fd, buf, len)) != -1) {
+        lua_pushinteger(L, n);
+        return 1;
+    }
+
+    // got error
+    lua_pushnil(L);
+    return push_lo_error(L, eno, "lo_write");
+}
+
+static int lo_lseek64_lua(lua_State *L)
+{
+    int eno         = 0;
+    PGconn *conn    = check_lo_conn(L, &eno);
+    int fd          = lauxh_checkinteger(L, 2);
+    pg_int64 offset = lauxh_checkinteger(L, 3);
+    int whence      = lauxh_optinteger(L, 4, SEEK_SET);
+    pg_int64 pos    = -1;
+
+    if (conn && (pos = lo_lseek64(conn, fd, offset, whence)) != -1) {
+        lua_pushinteger(L, pos);
+        return 1;
+    }
+
+    // got error
+    lua_pushnil(L);
+    return push_lo_error(L, eno, "lo_lseek64");
+}
+
+static int lo_tell64_lua(lua_State *L)
+{
+    int eno      = 0;
+    PGconn *conn = check_lo_conn(L, &eno);
+    int fd       = lauxh_checkinteger(L, 2);
+    pg_int64 pos = -1;
+
+    if (conn && (pos = lo_tell64(conn, fd)) != -1) {
+        lua_pushinteger(L, pos);
+        return 1;
+    }
+
+    // got error
+    lua_pushnil(L);
+    return push_lo_error(L, eno, "lo_tell64");
+}
+
+static int lo_truncate64_lua(lua_State *L)
+{
+    int eno      = 0;
+    PGconn *conn = check_lo_conn(L, &eno);
+    int fd       = lauxh_checkinteger(L, 2);
+    pg_int64 len = lauxh_checkinteger(L, 3);
+
+    if (conn && lo_truncate64(conn, fd, len) == 0) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // got error
+    lua_pushboolean(L, 0);
+    return push_lo_error(L, eno, "lo_truncate64");
+}
+
+/**
+ * copies the data between the large object and the file descriptor in the
+ * chunks of LO_BUFSIZE bytes without creating the lua strings.
+ * if the len is negative, copies until the end of the source.
+ * returns the number of bytes copied, or -1 on failure with the eno set to
+ * the errno of the file operation or 0 for the large object operation.
+ */
+static pg_int64 lo_copy(PGconn *conn, int lofd, int fd, pg_int64 len,
+                        int to_file, int *eno)
+{
+    char *buf      = malloc(LO_BUFSIZE);
+    pg_int64 total = 0;
+
+    *eno = 0;
+    if (!buf) {
+        *eno = errno;
+        return -1;
+    }
+
+    while (len < 0 || total < len) {
+        size_t size = LO_BUFSIZE;
+        ssize_t n   = 0;
+
+        if (len >= 0 && len - total < (pg_int64)size) {
+            size = len - total;
+        }
+
+        if (to_file) {
+            *eno = 0;
+            n    = lo_read(conn, lofd, buf, size);
+        } else if ((n = read(fd, buf, size)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *eno = errno;
+        }
+        if (n == -1) {
+            free(buf);
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = 0;
+
+            if (!to_file) {
+                *eno = 0;
+                w    = lo_write(conn, lofd, buf + off, n - off);
+            } else if ((w = write(fd, buf + off, n - off)) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                *eno = errno;
+            }
+            if (w == -1) {
+                free(buf);
+                return -1;
+            }
+            off += w;
+        }
+        total += n;
+    }
+
+    free(buf);
+    *eno = 0;
+    return total;
+}
+
+static int lo_copy_lua(lua_State *L, int to_file, const char *op)
+{
+    int eno      = 0;
+    PGconn *conn = check_lo_conn(L, &eno);
+    int lofd     = lauxh_checkinteger(L, 2);
+    FILE *fp     = lauxh_checkfile(L, 3);
+    pg_int64 len = lauxh_optinteger(L, 4, -1);
+
+    // flush the buffered data before using the file descriptor directly
+    fflush(fp);
+    if (conn &&
+        (len = lo_copy(conn, lofd, fileno(fp), len, to_file, &eno)) != -1) {
+        lua_pushinteger(L, len);
+        return 1;
+    }
+
+    // got error
+    lua_pushnil(L);
+    return push_lo_error(L, eno, op);
+}
+
+static int lo_copy_from_file_lua(lua_State *L)
+{
+    return lo_copy_lua(L, 0, "lo_copy_from_file");
+}
+
+static int lo_copy_to_file_lua(lua_State *L)
+{
+    return lo_copy_lua(L, 1, "lo_copy_to_file");
+}
+
 static inline int finish(lua_State *L)
 {
     conn_t *c = luaL_checkudata(L, 1, LIBPQ_CONN_MT);
 
     if (c->conn) {
+        if (c->offload) {
+            // the query is completed by the offload pool later
+            libpq_offload_wait(c->offload);
+        }
         PQfinish(c->conn);
         c->conn = NULL;
-        lauxh_unref(L, c->notice_recv_ref);
-        lauxh_unref(L, c->notice_proc_ref);
-        lauxh_unref(L, c->trace_ref);
+        if (c->tracebuf) {
+            libpq_trace_free(c->tracebuf);
+            c->tracebuf = NULL;
+        }
+        free(c->pending);
+        c->pending      = NULL;
+        c->pending_head = 0;
+        c->pending_len  = 0;
+        c->pending_cap  = 0;
+        free(c->slowlog.entries);
+        c->slowlog = (slowlog_t){0};
+        if (c->rcache) {
+            libpq_rcache_free(c->rcache);
+            c->rcache = NULL;
+        }
+        if (c->ptypes) {
+            libpq_ptypes_free(c->ptypes);
+            c->ptypes = NULL;
+        }
+        while (c->notify_head) {
+            PGnotify *notify = c->notify_head;
+            c->notify_head   = notify->next;
+            PQfreemem(notify);
+        }
+        c->notify_tail = NULL;
+        libpq_buf_free(&c->workbuf);
+        libpq_buf_free(&c->offload_notices);
+        c->notice_recv_ref = lauxh_unref(L, c->notice_recv_ref);
+        c->notice_proc_ref = lauxh_unref(L, c->notice_proc_ref);
+        c->trace_ref       = lauxh_unref(L, c->trace_ref);
     }
 
     return 0;
@@ -1035,8 +4105,14 @@ static int connect_lua(lua_State *L)
     }
 
     if (c->conn) {
-        lauxh_setmetatable(L, LIBPQ_CONN_MT);
-        return 1;
+        // track the memory of the results
+        if (PQregisterEventProc(c->conn, event_proc, "lua-libpq", c)) {
+            lauxh_setmetatable(L, LIBPQ_CONN_MT);
+            return 1;
+        }
+        PQfinish(c->conn);
+        c->conn = NULL;
+        errno   = ENOMEM;
     }
 
     // got error
@@ -1095,6 +4171,11 @@ void libpq_conn_init(lua_State *L)
     };
     struct luaL_Reg method[] = {
         {"finish",                       finish_lua                      },
+        {"stats",                        stats_lua                       },
+        {"reset_stats",                  reset_stats_lua                 },
+        {"result_memory",                result_memory_lua               },
+        {"set_slowlog",                  set_slowlog_lua                 },
+        {"slowlog",                      slowlog_lua                     },
         {"conninfo",                     conninfo_lua                    },
         {"connect_poll",                 connect_poll_lua                },
         {"get_cancel",                   get_cancel_lua                  },
@@ -1130,13 +4211,37 @@ void libpq_conn_init(lua_State *L)
         {"call_notice_receiver",         call_notice_receiver_lua        },
         {"trace",                        trace_lua                       },
         {"untrace",                      untrace_lua                     },
+        {"trace_buffer",                 trace_buffer_lua                },
+        {"trace_records",                trace_records_lua               },
         {"set_trace_flags",              set_trace_flags_lua             },
+        {"result_format",                result_format_lua               },
+        {"set_result_format",            set_result_format_lua           },
+        {"query_timeout",                query_timeout_lua               },
+        {"set_query_timeout",            set_query_timeout_lua           },
         {"exec",                         exec_lua                        },
+        {"transaction",                  transaction_lua                 },
         {"exec_params",                  exec_params_lua                 },
+        {"exec_params_cached",           exec_params_cached_lua          },
+        {"prepare",                      prepare_lua                     },
+        {"exec_prepared",                exec_prepared_lua               },
+        {"describe_prepared",            describe_prepared_lua           },
+        {"describe_portal",              describe_portal_lua             },
+        {"param_types",                  param_types_lua                 },
+        {"clear_param_types",            clear_param_types_lua           },
+        {"insert_batcher",               insert_batcher_lua              },
+        {"set_result_cache",             set_result_cache_lua            },
+        {"invalidate_result_cache",      invalidate_result_cache_lua     },
+        {"result_cache_stat",            result_cache_stat_lua           },
         {"send_query",                   send_query_lua                  },
         {"send_query_params",            send_query_params_lua           },
+        {"send_prepare",                 send_prepare_lua                },
+        {"send_query_prepared",          send_query_prepared_lua         },
+        {"send_describe_prepared",       send_describe_prepared_lua      },
+        {"send_describe_portal",         send_describe_portal_lua        },
         {"set_single_row_mode",          set_single_row_mode_lua         },
         {"get_result",                   get_result_lua                  },
+        {"write_arrow",                  write_arrow_lua                 },
+        {"exec_spill",                   exec_spill_lua                  },
         {"is_busy",                      is_busy_lua                     },
         {"consume_input",                consume_input_lua               },
         {"enter_pipeline_mode",          enter_pipeline_mode_lua         },
@@ -1147,6 +4252,8 @@ void libpq_conn_init(lua_State *L)
         {"put_copy_data",                put_copy_data_lua               },
         {"put_copy_end",                 put_copy_end_lua                },
         {"get_copy_data",                get_copy_data_lua               },
+        {"put_copy_rows",                put_copy_rows_lua               },
+        {"get_copy_row",                 get_copy_row_lua                },
         {"set_nonblocking",              set_nonblocking_lua             },
         {"is_nonblocking",               is_nonblocking_lua              },
         {"flush",                        flush_lua                       },
@@ -1154,8 +4261,24 @@ void libpq_conn_init(lua_State *L)
         {"escape_string_conn",           escape_string_conn_lua          },
         {"escape_literal",               escape_literal_lua              },
         {"escape_identifier",            escape_identifier_lua           },
+        {"escape_literals",              escape_literals_lua             },
+        {"escape_identifiers",           escape_identifiers_lua          },
         {"escape_bytea_conn",            escape_bytea_conn_lua           },
         {"encrypt_password_conn",        encrypt_password_conn_lua       },
+        {"lo_creat",                     lo_creat_lua                    },
+        {"lo_create",                    lo_create_lua                   },
+        {"lo_import",                    lo_import_lua                   },
+        {"lo_export",                    lo_export_lua                   },
+        {"lo_unlink",                    lo_unlink_lua                   },
+        {"lo_open",                      lo_open_lua                     },
+        {"lo_close",                     lo_close_lua                    },
+        {"lo_read",                      lo_read_lua                     },
+        {"lo_write",                     lo_write_lua                    },
+        {"lo_lseek64",                   lo_lseek64_lua                  },
+        {"lo_tell64",                    lo_tell64_lua                   },
+        {"lo_truncate64",                lo_truncate64_lua               },
+        {"lo_copy_from_file",            lo_copy_from_file_lua           },
+        {"lo_copy_to_file",              lo_copy_to_file_lua             },
         {NULL,                           NULL                            }
     };
 
@@ -0,0 +1,261 @@
+/**
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+# include <immintrin.h>
+#endif
+// lua
+#include "lua_libpq.h"
+
+/**
+ * encoder and decoder of the COPY text format.
+ * the fields are separated by the tab and the special characters are
+ * escaped by the backslash. the runs of the ordinary characters are found by
+ * the vectorized scan and copied at once.
+ */
+
+int libpq_buf_reserve(libpq_buf_t *b, size_t n)
+{
+    if (b->cap - b->len < n) {
+        size_t cap = b->cap ? b->cap : 1024;
+        char *data = NULL;
+
+        while (cap - b->len < n) {
+            cap *= 2;
+        }
+        if (!(data = realloc(b->data, cap))) {
+            return -1;
+        }
+        b->data = data;
+        b->cap  = cap;
+    }
+    return 0;
+}
+
+void libpq_buf_free(libpq_buf_t *b)
+{
+    free(b->data);
+    *b = (libpq_buf_t){0};
+}
+
+/**
+ * returns the pointer to the first character that is one of the needles,
+ * or the end if not found.
+ */
+static inline const char *scan(const char *s, const char *end, char n0,
+                               char n1, char n2, char n3)
+{
+#if defined(__AVX2__)
+    {
+        const __m256i v0 = _mm256_set1_epi8(n0);
+        const __m256i v1 = _mm256_set1_epi8(n1);
+        const __m256i v2 = _mm256_set1_epi8(n2);
+        const __m256i v3 = _mm256_set1_epi8(n3);
+
+        while (end - s >= 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)s);
+            __m256i m = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, v0),
+                                _mm256_cmpeq_epi8(v, v1)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, v2),
+                                _mm256_cmpeq_epi8(v, v3)));
+            unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+
+            if (mask) {
+                return s + __builtin_ctz(mask);
+            }
+            s += 32;
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    {
+        const __m128i v0 = _mm_set1_epi8(n0);
+        const __m128i v1 = _mm_set1_epi8(n1);
+        const __m128i v2 = _mm_set1_epi8(n2);
+        const __m128i v3 = _mm_set1_epi8(n3);
+
+        while (end - s >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)s);
+            __m128i m =
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, v0),
+                                          _mm_cmpeq_epi8(v, v1)),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, v2),
+                                          _mm_cmpeq_epi8(v, v3)));
+            unsigned mask = (unsigned)_mm_movemask_epi8(m);
+
+            if (mask) {
+                return s + __builtin_ctz(mask);
+            }
+            s += 16;
+        }
+    }
+#endif
+
+    for (; s < end; s++) {
+        if (*s == n0 || *s == n1 || *s == n2 || *s == n3) {
+            break;
+        }
+    }
+    return s;
+}
+
+int libpq_copy_encode(libpq_buf_t *b, const char *s, size_t len)
+{
+    const char *end = s + len;
+
+    // the escaped value is at most twice as long as the value
+    if (libpq_buf_reserve(b, len * 2) != 0) {
+        return -1;
+    }
+    while (s < end) {
+        const char *p = scan(s, end, '\t', '\n', '\r', '\\');
+        char *dst     = b->data + b->len;
+
+        memcpy(dst, s, p - s);
+        b->len += p - s;
+        if (p == end) {
+            break;
+        }
+
+        dst    = b->data + b->len;
+        dst[0] = '\\';
+        switch (*p) {
+        case '\t':
+            dst[1] = 't';
+            break;
+        case '\n':
+            dst[1] = 'n';
+            break;
+        case '\r':
+            dst[1] = 'r';
+            break;
+        default:
+            dst[1] = '\\';
+        }
+        b->len += 2;
+        s = p + 1;
+    }
+    return 0;
+}
+
+static inline int isodigit(int c)
+{
+    return c >= '0' && c <= '7';
+}
+
+static inline int hexval(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+ssize_t libpq_copy_decode(char *dst, const char *s, const char *end,
+                          const char **next)
+{
+    char *d = dst;
+
+    // the field that is exactly \N is the NULL
+    if (end - s >= 2 && s[0] == '\\' && s[1] == 'N' &&
+        (end - s == 2 || s[2] == '\t')) {
+        *next = s + 2;
+        return -1;
+    }
+
+    while (s < end) {
+        const char *p = scan(s, end, '\t', '\\', '\t', '\\');
+
+        memcpy(d, s, p - s);
+        d += p - s;
+        s = p;
+        if (s == end || *s == '\t') {
+            break;
+        } else if (++s == end) {
+            // the trailing backslash is kept as is
+            *d++ = '\\';
+            break;
+        }
+
+        switch (*s) {
+        case 'b':
+            *d++ = '\b';
+            s++;
+            break;
+        case 'f':
+            *d++ = '\f';
+            s++;
+            break;
+        case 'n':
+            *d++ = '\n';
+            s++;
+            break;
+        case 'r':
+            *d++ = '\r';
+            s++;
+            break;
+        case 't':
+            *d++ = '\t';
+            s++;
+            break;
+        case 'v':
+            *d++ = '\v';
+            s++;
+            break;
+        case 'x':
+            // \xh or \xhh
+            if (s + 1 < end && hexval(s[1]) != -1) {
+                int v = hexval(s[1]);
+                s += 2;
+                if (s < end && hexval(*s) != -1) {
+                    v = (v << 4) | hexval(*s++);
+                }
+                *d++ = (char)v;
+            } else {
+                *d++ = *s++;
+            }
+            break;
+        default:
+            // \o, \oo or \ooo
+            if (isodigit(*s)) {
+                int v = *s++ - '0';
+                for (int i = 0; i < 2 && s < end && isodigit(*s); i++) {
+                    v = (v << 3) | (*s++ - '0');
+                }
+                *d++ = (char)v;
+            } else {
+                // the other characters are taken literally
+                *d++ = *s++;
+            }
+        }
+    }
+
+    *next = s;
+    return d - dst;
+}
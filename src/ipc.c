@@ -0,0 +1,504 @@
+/**
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <stdlib.h>
+// lua
+#include "lua_libpq.h"
+
+/**
+ * the writer of the arrow IPC streaming format. see
+ * https://arrow.apache.org/docs/format/Columnar.html#ipc-streaming-format
+ *
+ * the stream is a schema message followed by the record batch messages and
+ * the end-of-stream marker. each message is the flatbuffers metadata and
+ * the body that contains the buffers of the columns decoded by columns.c.
+ * the flatbuffers are built by hand, so that no dependency is needed.
+ *
+ * the column types of the schema are decided by the first batch. the rest
+ * of the batches are decoded as the same types, and fail with EINVAL if any
+ * value cannot be decoded.
+ */
+
+// the number of fields of the largest table that written by this file
+#define FB_MAXFIELDS 8
+
+// MessageHeader union of Message.fbs
+#define MESSAGE_SCHEMA       1
+#define MESSAGE_RECORD_BATCH 3
+// MetadataVersion.V5 of Schema.fbs
+#define METADATA_V5          4
+// Type union of Schema.fbs
+#define TYPE_INT             2
+#define TYPE_FLOATING_POINT  3
+#define TYPE_BOOL            6
+#define TYPE_TIMESTAMP       10
+#define TYPE_LARGE_UTF8      20
+// Precision.DOUBLE and TimeUnit.MICROSECOND of Schema.fbs
+#define PRECISION_DOUBLE     2
+#define TIMEUNIT_MICROSECOND 2
+
+#define PAD8(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct {
+    libpq_buf_t buf;
+    int err;
+} fb_t;
+
+typedef struct {
+    // the size of the scalar or 4 for the offset, or 0 if the field is absent
+    int size;
+    // the field is the offset to the object that written later
+    int ref;
+    uint64_t value;
+    // the position of the field that set by fb_table
+    size_t pos;
+} fb_field_t;
+
+struct libpq_ipc_s {
+    FILE *fp;
+    int nthreads;
+    int ncol;
+    // the column types of the schema, or NULL until the schema is written
+    libpq_coltype_t *types;
+    fb_t fb;
+};
+
+static inline void store_le(char *buf, uint64_t v, int len)
+{
+    for (int i = 0; i < len; i++) {
+        buf[i] = (char)(v & 0xff);
+        v >>= 8;
+    }
+}
+
+static inline void fb_store(fb_t *fb, size_t pos, uint64_t v, int len)
+{
+    if (!fb->err) {
+        store_le(fb->buf.data + pos, v, len);
+    }
+}
+
+/**
+ * appends len zero bytes and returns the position of them. the positions
+ * are meaningless after the allocation failed, and fb_store ignores them.
+ */
+static size_t fb_zero(fb_t *fb, size_t len)
+{
+    size_t pos = fb->buf.len;
+
+    if (fb->err || libpq_buf_reserve(&fb->buf, len)) {
+        fb->err = 1;
+        return 0;
+    }
+    memset(fb->buf.data + pos, 0, len);
+    fb->buf.len += len;
+    return pos;
+}
+
+// pads the buffer until the position after extra bytes is aligned
+static inline void fb_align(fb_t *fb, size_t align, size_t extra)
+{
+    fb_zero(fb, (align - (fb->buf.len + extra) % align) % align);
+}
+
+// sets the offset field at pos to refer to the object at target
+static inline void fb_ref(fb_t *fb, size_t pos, size_t target)
+{
+    fb_store(fb, pos, target - pos, 4);
+}
+
+/**
+ * writes the vtable and the table of the fields, and returns the position
+ * of the table. the position of each field is set to pos, and the offset
+ * fields must be set by fb_ref after the referred objects are written.
+ */
+static size_t fb_table(fb_t *fb, fb_field_t *f, int n)
+{
+    uint16_t slot[FB_MAXFIELDS] = {0};
+    size_t size                 = 4;
+    size_t align                = 4;
+    size_t vt                   = 0;
+    size_t tbl                  = 0;
+
+    // place the larger fields first to avoid the padding
+    for (int w = 8; w; w >>= 1) {
+        for (int i = 0; i < n; i++) {
+            if (f[i].size == w) {
+                size    = (size + w - 1) & ~(size_t)(w - 1);
+                slot[i] = (uint16_t)size;
+                size += w;
+                if ((size_t)w > align) {
+                    align = w;
+                }
+            }
+        }
+    }
+
+    fb_align(fb, 2, 0);
+    vt = fb_zero(fb, 4 + 2 * (size_t)n);
+    fb_store(fb, vt, 4 + 2 * (uint64_t)n, 2);
+    fb_store(fb, vt + 2, size, 2);
+    for (int i = 0; i < n; i++) {
+        fb_store(fb, vt + 4 + 2 * (size_t)i, slot[i], 2);
+    }
+
+    fb_align(fb, align, 0);
+    tbl = fb_zero(fb, size);
+    // the vtable is placed before the table
+    fb_store(fb, tbl, tbl - vt, 4);
+    for (int i = 0; i < n; i++) {
+        if (f[i].size) {
+            f[i].pos = tbl + slot[i];
+            if (!f[i].ref) {
+                fb_store(fb, f[i].pos, f[i].value, f[i].size);
+            }
+        }
+    }
+    return tbl;
+}
+
+/**
+ * writes the vector of n zero-filled elements and returns the position of
+ * the length. the elements start at the position + 4.
+ */
+static size_t fb_vector(fb_t *fb, size_t n, size_t elmsize, size_t align)
+{
+    size_t pos = 0;
+
+    fb_align(fb, align > 4 ? align : 4, 4);
+    pos = fb_zero(fb, 4 + n * elmsize);
+    fb_store(fb, pos, n, 4);
+    return pos;
+}
+
+static size_t fb_string(fb_t *fb, const char *str)
+{
+    size_t len = strlen(str);
+    size_t pos = 0;
+
+    fb_align(fb, 4, 0);
+    // the string is terminated by NUL
+    pos = fb_zero(fb, 4 + len + 1);
+    fb_store(fb, pos, len, 4);
+    if (!fb->err) {
+        memcpy(fb->buf.data + pos + 4, str, len);
+    }
+    return pos;
+}
+
+/**
+ * starts the metadata of the message, and returns the position of the
+ * header field.
+ */
+static size_t begin_message(fb_t *fb, int type, size_t body_len)
+{
+    fb_field_t f[4] = {
+        {.size = 2, .value = METADATA_V5},
+        {.size = 1, .value = (uint64_t)type},
+        {.size = 4, .ref = 1},
+        {.size = 8, .value = body_len},
+    };
+    size_t root = 0;
+
+    fb->buf.len = 0;
+    fb->err     = 0;
+    root        = fb_zero(fb, 4);
+    fb_ref(fb, root, fb_table(fb, f, 4));
+    return f[2].pos;
+}
+
+static int write_padded(FILE *fp, const void *data, size_t len)
+{
+    static const char zero[8] = {0};
+    size_t pad                = PAD8(len) - len;
+
+    errno = 0;
+    if ((len && fwrite(data, 1, len, fp) != len) ||
+        (pad && fwrite(zero, 1, pad, fp) != pad)) {
+        return errno ? errno : EIO;
+    }
+    return 0;
+}
+
+/**
+ * writes the encapsulated message of the metadata built in fb, which is
+ * the continuation marker and the length followed by the padded metadata.
+ */
+static int write_metadata(libpq_ipc_t *w)
+{
+    fb_t *fb       = &w->fb;
+    char prefix[8] = {0};
+    int eno        = 0;
+
+    fb_align(fb, 8, 0);
+    if (fb->err) {
+        return ENOMEM;
+    }
+    store_le(prefix, 0xffffffff, 4);
+    store_le(prefix + 4, fb->buf.len, 4);
+    if ((eno = write_padded(w->fp, prefix, sizeof(prefix)))) {
+        return eno;
+    }
+    return write_padded(w->fp, fb->buf.data, fb->buf.len);
+}
+
+static inline int nbuffers(const libpq_column_t *c)
+{
+    // the validity and the values, and the data of the variable length
+    return c->type == LIBPQ_COL_TEXT ? 3 : 2;
+}
+
+static size_t build_type(fb_t *fb, const libpq_column_t *c, int *id)
+{
+    switch (c->type) {
+    case LIBPQ_COL_BOOL:
+        *id = TYPE_BOOL;
+        return fb_table(fb, NULL, 0);
+
+    case LIBPQ_COL_INT64: {
+        // bitWidth and is_signed
+        fb_field_t f[2] = {
+            {.size = 4, .value = 64},
+            {.size = 1, .value = 1},
+        };
+        *id = TYPE_INT;
+        return fb_table(fb, f, 2);
+    }
+
+    case LIBPQ_COL_DOUBLE: {
+        fb_field_t f[1] = {
+            {.size = 2, .value = PRECISION_DOUBLE},
+        };
+        *id = TYPE_FLOATING_POINT;
+        return fb_table(fb, f, 1);
+    }
+
+    case LIBPQ_COL_TIMESTAMP: {
+        // unit and timezone
+        fb_field_t f[2] = {
+            {.size = 2, .value = TIMEUNIT_MICROSECOND},
+            {.size = c->oid == TIMESTAMPTZOID ? 4 : 0, .ref = 1},
+        };
+        size_t tbl = fb_table(fb, f, 2);
+
+        if (f[1].size) {
+            fb_ref(fb, f[1].pos, fb_string(fb, "UTC"));
+        }
+        *id = TYPE_TIMESTAMP;
+        return tbl;
+    }
+
+    default:
+        *id = TYPE_LARGE_UTF8;
+        return fb_table(fb, NULL, 0);
+    }
+}
+
+static int write_schema(libpq_ipc_t *w, const libpq_columns_t *cols)
+{
+    fb_t *fb = &w->fb;
+    // endianness and fields
+    fb_field_t schema[2] = {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        {.size = 2, .value = 1},
+#else
+        {0},
+#endif
+        {.size = 4, .ref = 1},
+    };
+    size_t hdr = begin_message(fb, MESSAGE_SCHEMA, 0);
+    size_t vec = 0;
+
+    fb_ref(fb, hdr, fb_table(fb, schema, 2));
+    vec = fb_vector(fb, (size_t)cols->ncol, 4, 4);
+    fb_ref(fb, schema[1].pos, vec);
+    for (int i = 0; i < cols->ncol; i++) {
+        const libpq_column_t *c = &cols->cols[i];
+        // name, nullable, type_type, type, dictionary and children
+        fb_field_t field[6] = {
+            {.size = 4, .ref = 1},
+            {.size = 1, .value = 1},
+            {.size = 1},
+            {.size = 4, .ref = 1},
+            {0},
+            {.size = 4, .ref = 1},
+        };
+        int id = 0;
+
+        fb_ref(fb, vec + 4 + 4 * (size_t)i, fb_table(fb, field, 6));
+        fb_ref(fb, field[0].pos, fb_string(fb, c->name));
+        fb_ref(fb, field[3].pos, build_type(fb, c, &id));
+        fb_store(fb, field[2].pos, (uint64_t)id, 1);
+        // the readers require the children even if empty
+        fb_ref(fb, field[5].pos, fb_vector(fb, 0, 4, 4));
+    }
+
+    if (!(w->types = malloc(sizeof(libpq_coltype_t) *
+                            (cols->ncol ? cols->ncol : 1)))) {
+        return ENOMEM;
+    }
+    w->ncol = cols->ncol;
+    for (int i = 0; i < cols->ncol; i++) {
+        w->types[i] = cols->cols[i].type;
+    }
+    return write_metadata(w);
+}
+
+static int write_batch(libpq_ipc_t *w, const libpq_columns_t *cols)
+{
+    fb_t *fb = &w->fb;
+    // length, nodes and buffers
+    fb_field_t batch[3] = {
+        {.size = 8, .value = (uint64_t)cols->nrow},
+        {.size = 4, .ref = 1},
+        {.size = 4, .ref = 1},
+    };
+    size_t body_len = 0;
+    size_t hdr      = 0;
+    size_t nodes    = 0;
+    size_t bufs     = 0;
+    int nbuf        = 0;
+    int eno         = 0;
+
+    for (int i = 0; i < cols->ncol; i++) {
+        for (int j = 0; j < nbuffers(&cols->cols[i]); j++, nbuf++) {
+            size_t len = 0;
+            libpq_columns_buffer(cols, &cols->cols[i], j, &len);
+            body_len += PAD8(len);
+        }
+    }
+
+    hdr = begin_message(fb, MESSAGE_RECORD_BATCH, body_len);
+    fb_ref(fb, hdr, fb_table(fb, batch, 3));
+    // the FieldNode and Buffer structs are 16 bytes of two longs
+    nodes = fb_vector(fb, (size_t)cols->ncol, 16, 8);
+    bufs  = fb_vector(fb, (size_t)nbuf, 16, 8);
+    fb_ref(fb, batch[1].pos, nodes);
+    fb_ref(fb, batch[2].pos, bufs);
+    body_len = 0;
+    for (int i = 0, b = 0; i < cols->ncol; i++) {
+        const libpq_column_t *c = &cols->cols[i];
+        size_t node             = nodes + 4 + 16 * (size_t)i;
+
+        fb_store(fb, node, (uint64_t)cols->nrow, 8);
+        fb_store(fb, node + 8, (uint64_t)c->null_count, 8);
+        for (int j = 0; j < nbuffers(c); j++, b++) {
+            size_t buf = bufs + 4 + 16 * (size_t)b;
+            size_t len = 0;
+
+            libpq_columns_buffer(cols, c, j, &len);
+            fb_store(fb, buf, body_len, 8);
+            fb_store(fb, buf + 8, len, 8);
+            body_len += PAD8(len);
+        }
+    }
+    if ((eno = write_metadata(w))) {
+        return eno;
+    }
+
+    // the body is written from the decoded buffers without copy
+    for (int i = 0; i < cols->ncol; i++) {
+        for (int j = 0; j < nbuffers(&cols->cols[i]); j++) {
+            size_t len      = 0;
+            const void *buf = libpq_columns_buffer(cols, &cols->cols[i], j,
+                                                   &len);
+            if ((eno = write_padded(w->fp, buf, len))) {
+                return eno;
+            }
+        }
+    }
+    return 0;
+}
+
+libpq_ipc_t *libpq_ipc_new(FILE *fp, int nthreads)
+{
+    libpq_ipc_t *w = calloc(1, sizeof(libpq_ipc_t));
+
+    if (w) {
+        w->fp       = fp;
+        w->nthreads = nthreads;
+    }
+    return w;
+}
+
+void libpq_ipc_free(libpq_ipc_t *w)
+{
+    libpq_buf_free(&w->fb.buf);
+    free(w->types);
+    free(w);
+}
+
+/**
+ * writes the rows of res as a record batch. the schema is written before
+ * the first batch, and the result that has no row only writes the schema.
+ * returns 0 on success, otherwise the error number.
+ */
+int libpq_ipc_write(libpq_ipc_t *w, const PGresult *res)
+{
+    libpq_columns_t cols = {
+        .nrow = PQntuples(res),
+        .ncol = PQnfields(res),
+    };
+    int eno = 0;
+
+    if (w->types && cols.ncol != w->ncol) {
+        return EINVAL;
+    } else if (!(cols.cols = calloc(cols.ncol ? cols.ncol : 1,
+                                    sizeof(libpq_column_t)))) {
+        return ENOMEM;
+    }
+
+    eno = libpq_columns_decode(&cols, res, w->nthreads, 1, w->types);
+    if (!eno && !w->types) {
+        eno = write_schema(w, &cols);
+    }
+    if (!eno && cols.nrow) {
+        eno = write_batch(w, &cols);
+    }
+    libpq_columns_free(&cols);
+    return eno;
+}
+
+/**
+ * writes the end-of-stream marker and flushes the stream. returns EINVAL if
+ * the schema has not been written.
+ */
+int libpq_ipc_end(libpq_ipc_t *w)
+{
+    char eos[8] = {0};
+    int eno     = 0;
+
+    if (!w->types) {
+        return EINVAL;
+    }
+    store_le(eos, 0xffffffff, 4);
+    if ((eno = write_padded(w->fp, eos, sizeof(eos)))) {
+        return eno;
+    }
+    errno = 0;
+    if (fflush(w->fp)) {
+        return errno ? errno : EIO;
+    }
+    return 0;
+}
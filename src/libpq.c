@@ -20,6 +20,8 @@
  *  DEALINGS IN THE SOFTWARE.
  */
 
+#include <libpq/libpq-fs.h>
+#include <stdio.h>
 // lua
 #include "lua_libpq.h"
 
@@ -125,21 +127,12 @@ static int lib_version_lua(lua_State *L)
 
 static int unescape_bytea_lua(lua_State *L)
 {
-    const char *strtext = lauxh_checkstring(L, 1);
     size_t len          = 0;
-    unsigned char *to   = PQunescapeBytea((const unsigned char *)strtext, &len);
+    const char *strtext = lauxh_checklstring(L, 1, &len);
 
-    if (to) {
-        lua_settop(L, 0);
-        lua_pushlstring(L, (const char *)to, len);
-        PQfreemem((void *)to);
-        return 1;
-    }
-
-    // got error
-    lua_pushnil(L);
-    lua_errno_new(L, errno, "unescape_bytea");
-    return 2;
+    // decode into the lua string directly
+    libpq_push_bytea(L, strtext, len);
+    return 1;
 }
 
 static int is_threadsafe_lua(lua_State *L)
@@ -172,6 +165,11 @@ LUALIB_API int luaopen_libpq(lua_State *L)
     libpq_result_init(L);
     libpq_notify_init(L);
     libpq_util_init(L);
+    libpq_batcher_init(L);
+    libpq_offload_init(L);
+    libpq_columns_init(L);
+    libpq_spill_init(L);
+    libpq_arena_init(L);
 
     //
     // Option flags for PQcopyResult
@@ -182,6 +180,16 @@ LUALIB_API int luaopen_libpq(lua_State *L)
     lauxh_pushint2tbl(L, "PG_COPYRES_EVENTS", PG_COPYRES_EVENTS);
     lauxh_pushint2tbl(L, "PG_COPYRES_NOTICEHOOKS", PG_COPYRES_NOTICEHOOKS);
 
+    //
+    // Mode flags for lo_open and lo_creat
+    //
+    lauxh_pushint2tbl(L, "INV_READ", INV_READ);
+    lauxh_pushint2tbl(L, "INV_WRITE", INV_WRITE);
+    // Whence for lo_lseek64
+    lauxh_pushint2tbl(L, "SEEK_SET", SEEK_SET);
+    lauxh_pushint2tbl(L, "SEEK_CUR", SEEK_CUR);
+    lauxh_pushint2tbl(L, "SEEK_END", SEEK_END);
+
     // ConnStatusType
     lauxh_pushint2tbl(L, "CONNECTION_OK", CONNECTION_OK);
     lauxh_pushint2tbl(L, "CONNECTION_BAD", CONNECTION_BAD);
@@ -25,6 +25,8 @@
 
 #include <inttypes.h>
 #include <string.h>
+#include <sys/types.h>
+#include <time.h>
 // libpq
 #include <libpq-fe.h>
 #include <postgres_ext.h>
@@ -32,10 +34,27 @@
 #include <lauxhlib.h>
 #include <lua_errno.h>
 
+// built-in type OIDs that converted from/to the lua values
+#define BOOLOID        16
+#define INT8OID        20
+#define INT2OID        21
+#define INT4OID        23
+#define OIDOID         26
+#define FLOAT4OID      700
+#define FLOAT8OID      701
+#define TIMESTAMPOID   1114
+#define TIMESTAMPTZOID 1184
+
 #define LIBPQ_CONN_MT "libpq.conn"
 
 void libpq_conn_init(lua_State *L);
 PGconn *libpq_check_conn(lua_State *L);
+int libpq_conn_exec(lua_State *L, int idx, const char *stmt,
+                    const char *command, size_t len, int nparams,
+                    const char **params, const char *op);
+int libpq_conn_prepare(lua_State *L, int idx, const char *stmt,
+                       const char *command, size_t len, int nparams,
+                       const char *op);
 
 #define LIBPQ_CANCEL_MT "libpq.cancel"
 void libpq_cancel_init(lua_State *L);
@@ -45,6 +64,7 @@ PGcancel **libpq_cancel_new(lua_State *L);
 void libpq_result_init(lua_State *L);
 PGresult **libpq_result_new(lua_State *L, int conn_idx, int noclear);
 PGresult *libpq_check_result(lua_State *L);
+void libpq_result_push_fields(lua_State *L);
 
 #define LIBPQ_NOTIFY_MT "libpq.notify"
 void libpq_notify_init(lua_State *L);
@@ -52,6 +72,136 @@ PGnotify **libpq_notify_new(lua_State *L);
 
 void libpq_util_init(lua_State *L);
 
+#define LIBPQ_BATCHER_MT "libpq.batcher"
+void libpq_batcher_init(lua_State *L);
+int libpq_batcher_new(lua_State *L, const char *prefix, size_t prefix_len,
+                      const char *suffix, size_t suffix_len, int ncol,
+                      int max_rows, size_t max_bytes);
+
+#define LIBPQ_OFFLOAD_MT "libpq.offload"
+typedef struct libpq_offload_s libpq_offload_t;
+typedef struct libpq_task_s libpq_task_t;
+struct libpq_task_s {
+    libpq_task_t *next;
+    libpq_offload_t *pool;
+    int state;
+    // runs on the worker thread
+    void (*run)(libpq_task_t *t);
+    // pushes the results and frees the task on the main thread
+    int (*complete)(lua_State *L, libpq_task_t *t);
+};
+void libpq_offload_init(lua_State *L);
+libpq_offload_t *libpq_check_offload(lua_State *L);
+void libpq_offload_submit(libpq_offload_t *p, libpq_task_t *t);
+void libpq_offload_wait(libpq_task_t *t);
+int libpq_offload_in_worker(void);
+int libpq_conn_offload_exec_lua(lua_State *L);
+int libpq_conn_offload_exec_params_lua(lua_State *L);
+
+#define LIBPQ_COLUMNS_MT "libpq.columns"
+typedef enum {
+    LIBPQ_COL_TEXT = 0,
+    LIBPQ_COL_BOOL,
+    LIBPQ_COL_INT64,
+    LIBPQ_COL_DOUBLE,
+    // microseconds since 1970-01-01 00:00:00 UTC
+    LIBPQ_COL_TIMESTAMP,
+} libpq_coltype_t;
+typedef struct {
+    char *name;
+    libpq_coltype_t type;
+    Oid oid;
+    int failed;
+    int64_t null_count;
+    // bitmap of the non-null values, or NULL if no null value
+    uint8_t *validity;
+    // bitmap for bool, int64_t or double array for the others, or int64_t
+    // offsets of the nrow + 1 values in data for text
+    void *values;
+    char *data;
+} libpq_column_t;
+typedef struct libpq_arrow_s libpq_arrow_t;
+typedef struct {
+    int nrow;
+    int ncol;
+    libpq_column_t *cols;
+    // arrow C data interface structures that created by export_arrow
+    libpq_arrow_t *arrow;
+} libpq_columns_t;
+void libpq_columns_init(lua_State *L);
+libpq_columns_t *libpq_columns_new(lua_State *L, const PGresult *res,
+                                   int nthreads, int with_text);
+int libpq_columns_decode(libpq_columns_t *cols, const PGresult *res,
+                         int nthreads, int with_text,
+                         const libpq_coltype_t *types);
+void libpq_columns_free(libpq_columns_t *cols);
+const void *libpq_columns_buffer(const libpq_columns_t *cols,
+                                 const libpq_column_t *c, int idx, size_t *len);
+
+#define LIBPQ_SPILL_MT "libpq.spill"
+typedef struct libpq_spill_s libpq_spill_t;
+void libpq_spill_init(lua_State *L);
+libpq_spill_t *libpq_spill_new(lua_State *L, size_t threshold);
+int libpq_spill_append(libpq_spill_t *s, const PGresult *res);
+int libpq_spill_finish(libpq_spill_t *s);
+
+#define LIBPQ_ARENA_MT      "libpq.arena"
+#define LIBPQ_ARENA_ROWS_MT "libpq.arena.rows"
+#define LIBPQ_ARENA_ROW_MT  "libpq.arena.row"
+typedef struct libpq_arena_s libpq_arena_t;
+void libpq_arena_init(lua_State *L);
+libpq_arena_t *libpq_check_arena(lua_State *L, int idx);
+int libpq_arena_push_rows(lua_State *L, libpq_arena_t *a, const PGresult *res,
+                          const libpq_columns_t *cols);
+
+typedef struct libpq_ipc_s libpq_ipc_t;
+libpq_ipc_t *libpq_ipc_new(FILE *fp, int nthreads);
+int libpq_ipc_write(libpq_ipc_t *w, const PGresult *res);
+int libpq_ipc_end(libpq_ipc_t *w);
+void libpq_ipc_free(libpq_ipc_t *w);
+
+typedef struct libpq_trace_s libpq_trace_t;
+libpq_trace_t *libpq_trace_new(int cap);
+FILE *libpq_trace_file(libpq_trace_t *t);
+void libpq_trace_free(libpq_trace_t *t);
+void libpq_trace_push(lua_State *L, libpq_trace_t *t, int n);
+
+void libpq_push_bytea(lua_State *L, const char *str, size_t len);
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} libpq_buf_t;
+int libpq_buf_reserve(libpq_buf_t *b, size_t n);
+void libpq_buf_free(libpq_buf_t *b);
+int libpq_copy_encode(libpq_buf_t *b, const char *s, size_t len);
+ssize_t libpq_copy_decode(char *dst, const char *s, const char *end,
+                          const char **next);
+size_t libpq_notice_save(libpq_buf_t *b, const PGresult *res);
+size_t libpq_notice_len(const char *notice);
+void libpq_notice_push(lua_State *L, int conn_idx, const char *notice);
+
+typedef struct libpq_rcache_s libpq_rcache_t;
+libpq_rcache_t *libpq_rcache_new(size_t max_bytes, uint64_t ttl);
+void libpq_rcache_free(libpq_rcache_t *c);
+const PGresult *libpq_rcache_get(libpq_rcache_t *c, const char *key,
+                                 size_t len);
+int libpq_rcache_set(libpq_rcache_t *c, const char *key, size_t len,
+                     const char *channel, const PGresult *res);
+void libpq_rcache_invalidate(libpq_rcache_t *c, const char *channel);
+void libpq_rcache_push_stat(lua_State *L, libpq_rcache_t *c);
+
+typedef struct libpq_ptypes_s libpq_ptypes_t;
+libpq_ptypes_t *libpq_ptypes_new(void);
+void libpq_ptypes_free(libpq_ptypes_t *t);
+const Oid *libpq_ptypes_get(libpq_ptypes_t *t, const char *name,
+                            int *nparams);
+int libpq_ptypes_set(libpq_ptypes_t *t, const char *name, int nparams,
+                     const Oid *types);
+void libpq_ptypes_remove(libpq_ptypes_t *t, const char *name);
+int libpq_ptypes_encode(lua_State *L, int idx, Oid type, char *buf);
+
 static inline void libpq_register_mt(lua_State *L, const char *tname,
                                      struct luaL_Reg mmethod[],
                                      struct luaL_Reg method[])
@@ -120,6 +270,13 @@ static inline const char *libpq_param2string(lua_State *L, int idx)
     return lua_tostring(L, idx);
 }
 
+static inline uint64_t libpq_getnsec(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
 static inline uintmax_t libpq_str2uint(char *str)
 {
     errno = 0;
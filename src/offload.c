@@ -0,0 +1,406 @@
+/**
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#if defined(__linux__)
+# include <sys/eventfd.h>
+#endif
+// lua
+#include "lua_libpq.h"
+
+/**
+ * the offload pool runs the blocking tasks on the worker threads. the
+ * completed tasks are queued until the main thread takes them, and the
+ * completion fd is readable while the queue is not empty, so that the event
+ * loop can wait for it with the other descriptors.
+ *
+ * the workers never touch the lua_State. the task is prepared and completed
+ * on the main thread.
+ */
+
+#define OFFLOAD_MAXTHREADS 64
+
+typedef enum {
+    TASK_QUEUED = 0,
+    TASK_RUNNING,
+    TASK_DONE,
+} task_state_t;
+
+typedef struct {
+    libpq_task_t *head;
+    libpq_task_t *tail;
+} task_queue_t;
+
+struct libpq_offload_s {
+    pthread_mutex_t mutex;
+    // signaled when a task is queued or the pool is closing
+    pthread_cond_t queued;
+    // signaled when a task is completed
+    pthread_cond_t done;
+    task_queue_t tasks;
+    task_queue_t completed;
+    // number of the tasks that not yet taken by the main thread
+    int npending;
+    int closing;
+    int nthreads;
+    pthread_t *threads;
+    // the completion fd. fds[0] is read and fds[1] is written, and both are
+    // the same eventfd on linux.
+    int fds[2];
+};
+
+typedef struct {
+    libpq_offload_t *pool;
+} offload_t;
+
+// set on the worker threads
+static __thread int in_worker = 0;
+
+int libpq_offload_in_worker(void)
+{
+    return in_worker;
+}
+
+static inline void enqueue(task_queue_t *q, libpq_task_t *t)
+{
+    t->next = NULL;
+    if (q->tail) {
+        q->tail->next = t;
+    } else {
+        q->head = t;
+    }
+    q->tail = t;
+}
+
+static inline libpq_task_t *dequeue(task_queue_t *q)
+{
+    libpq_task_t *t = q->head;
+
+    if (t) {
+        q->head = t->next;
+        if (!q->head) {
+            q->tail = NULL;
+        }
+        t->next = NULL;
+    }
+    return t;
+}
+
+static inline void notify_fd(libpq_offload_t *p)
+{
+    uint64_t v = 1;
+    // the fd is already readable if the write would block
+    while (write(p->fds[1], &v, sizeof(v)) == -1 && errno == EINTR) {
+    }
+}
+
+static inline void drain_fd(libpq_offload_t *p)
+{
+    uint64_t buf[8];
+
+    while (read(p->fds[0], buf, sizeof(buf)) > 0 || errno == EINTR) {
+    }
+}
+
+static void *worker(void *arg)
+{
+    libpq_offload_t *p = (libpq_offload_t *)arg;
+
+    in_worker = 1;
+    pthread_mutex_lock(&p->mutex);
+    while (1) {
+        libpq_task_t *t = dequeue(&p->tasks);
+
+        if (!t) {
+            // the queued tasks are run before exit
+            if (p->closing) {
+                break;
+            }
+            pthread_cond_wait(&p->queued, &p->mutex);
+            continue;
+        }
+        t->state = TASK_RUNNING;
+        pthread_mutex_unlock(&p->mutex);
+        t->run(t);
+        pthread_mutex_lock(&p->mutex);
+        t->state = TASK_DONE;
+        if (!p->completed.head) {
+            notify_fd(p);
+        }
+        enqueue(&p->completed, t);
+        pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
+}
+
+static int open_fds(int fds[2])
+{
+#if defined(__linux__)
+    fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return fds[0] == -1 ? -1 : 0;
+#else
+    if (pipe(fds)) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK) ||
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC)) {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+    }
+    return 0;
+#endif
+}
+
+static inline void close_fds(int fds[2])
+{
+    close(fds[0]);
+    if (fds[1] != fds[0]) {
+        close(fds[1]);
+    }
+}
+
+/**
+ * stops the workers after the queued tasks are run.
+ */
+static void stop_workers(libpq_offload_t *p)
+{
+    pthread_mutex_lock(&p->mutex);
+    p->closing = 1;
+    pthread_cond_broadcast(&p->queued);
+    pthread_mutex_unlock(&p->mutex);
+    for (int i = 0; i < p->nthreads; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+    p->nthreads = 0;
+}
+
+static libpq_offload_t *pool_new(int nthreads)
+{
+    libpq_offload_t *p = calloc(1, sizeof(libpq_offload_t));
+
+    if (!p) {
+        return NULL;
+    } else if (!(p->threads = malloc(sizeof(pthread_t) * nthreads))) {
+        free(p);
+        return NULL;
+    } else if (open_fds(p->fds)) {
+        free(p->threads);
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->queued, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (; p->nthreads < nthreads; p->nthreads++) {
+        int rv = pthread_create(&p->threads[p->nthreads], NULL, worker, p);
+        if (rv) {
+            stop_workers(p);
+            pthread_cond_destroy(&p->done);
+            pthread_cond_destroy(&p->queued);
+            pthread_mutex_destroy(&p->mutex);
+            close_fds(p->fds);
+            free(p->threads);
+            free(p);
+            errno = rv;
+            return NULL;
+        }
+    }
+    return p;
+}
+
+void libpq_offload_submit(libpq_offload_t *p, libpq_task_t *t)
+{
+    t->pool  = p;
+    t->state = TASK_QUEUED;
+    pthread_mutex_lock(&p->mutex);
+    enqueue(&p->tasks, t);
+    p->npending++;
+    pthread_cond_signal(&p->queued);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+void libpq_offload_wait(libpq_task_t *t)
+{
+    libpq_offload_t *p = t->pool;
+
+    pthread_mutex_lock(&p->mutex);
+    while (t->state != TASK_DONE) {
+        pthread_cond_wait(&p->done, &p->mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+}
+
+/**
+ * takes the oldest completed task. returns NULL if no task is completed.
+ */
+static libpq_task_t *take_completed(libpq_offload_t *p)
+{
+    libpq_task_t *t = NULL;
+
+    pthread_mutex_lock(&p->mutex);
+    if ((t = dequeue(&p->completed))) {
+        p->npending--;
+    }
+    if (!p->completed.head) {
+        drain_fd(p);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return t;
+}
+
+/**
+ * runs the rest of the tasks and completes them without the results.
+ */
+static void pool_close(lua_State *L, offload_t *o)
+{
+    libpq_offload_t *p = o->pool;
+    libpq_task_t *t    = NULL;
+
+    o->pool = NULL;
+    stop_workers(p);
+    while ((t = take_completed(p))) {
+        int top = lua_gettop(L);
+        t->complete(L, t);
+        lua_settop(L, top);
+    }
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->queued);
+    pthread_mutex_destroy(&p->mutex);
+    close_fds(p->fds);
+    free(p->threads);
+    free(p);
+}
+
+static inline offload_t *checkself(lua_State *L)
+{
+    offload_t *o = luaL_checkudata(L, 1, LIBPQ_OFFLOAD_MT);
+    if (!o->pool) {
+        luaL_error(L, "attempt to use a freed object");
+    }
+    return o;
+}
+
+libpq_offload_t *libpq_check_offload(lua_State *L)
+{
+    return checkself(L)->pool;
+}
+
+static int get_result_lua(lua_State *L)
+{
+    offload_t *o    = checkself(L);
+    libpq_task_t *t = take_completed(o->pool);
+
+    if (!t) {
+        return 0;
+    }
+    lua_settop(L, 0);
+    return t->complete(L, t);
+}
+
+static int pending_lua(lua_State *L)
+{
+    offload_t *o = checkself(L);
+    int npending = 0;
+
+    pthread_mutex_lock(&o->pool->mutex);
+    npending = o->pool->npending;
+    pthread_mutex_unlock(&o->pool->mutex);
+    lua_pushinteger(L, npending);
+    return 1;
+}
+
+static int fd_lua(lua_State *L)
+{
+    offload_t *o = checkself(L);
+    lua_pushinteger(L, o->pool->fds[0]);
+    return 1;
+}
+
+static int close_lua(lua_State *L)
+{
+    offload_t *o = luaL_checkudata(L, 1, LIBPQ_OFFLOAD_MT);
+
+    if (o->pool) {
+        pool_close(L, o);
+    }
+    return 0;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    return libpq_tostring(L, LIBPQ_OFFLOAD_MT);
+}
+
+static int offload_pool_lua(lua_State *L)
+{
+    int nthreads = lauxh_optinteger(L, 1, 4);
+    offload_t *o = NULL;
+
+    if (nthreads < 1 || nthreads > OFFLOAD_MAXTHREADS) {
+        return lauxh_argerror(L, 1, "nthreads must be in the range of 1 to %d",
+                              OFFLOAD_MAXTHREADS);
+    } else if (!PQisthreadsafe()) {
+        lua_pushnil(L);
+        lua_errno_new(L, ENOTSUP, "offload_pool");
+        return 2;
+    }
+
+    o       = lua_newuserdata(L, sizeof(offload_t));
+    o->pool = NULL;
+    lauxh_setmetatable(L, LIBPQ_OFFLOAD_MT);
+    if (!(o->pool = pool_new(nthreads))) {
+        lua_pushnil(L);
+        lua_errno_new(L, errno, "offload_pool");
+        return 2;
+    }
+    return 1;
+}
+
+void libpq_offload_init(lua_State *L)
+{
+    struct luaL_Reg mmethod[] = {
+        {"__gc",       close_lua   },
+        {"__tostring", tostring_lua},
+        {NULL,         NULL        }
+    };
+    struct luaL_Reg method[] = {
+        {"close",       close_lua                         },
+        {"fd",          fd_lua                            },
+        {"pending",     pending_lua                       },
+        {"get_result",  get_result_lua                    },
+        {"exec",        libpq_conn_offload_exec_lua       },
+        {"exec_params", libpq_conn_offload_exec_params_lua},
+        {NULL,          NULL                              }
+    };
+
+    libpq_register_mt(L, LIBPQ_OFFLOAD_MT, mmethod, method);
+    lauxh_pushfn2tbl(L, "offload_pool", offload_pool_lua);
+}
@@ -0,0 +1,241 @@
+/**
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+// lua
+#include "lua_libpq.h"
+
+/**
+ * the parameter type cache keeps the parameter types of the prepared
+ * statements that reported by the server, so that the parameters can be
+ * sent in the binary format of the declared types without describing the
+ * statement again.
+ */
+
+#define PTYPES_NBUCKET 64
+
+typedef struct entry_s entry_t;
+struct entry_s {
+    entry_t *next;
+    uint32_t hash;
+    int nparams;
+    Oid *types;
+    char name[];
+};
+
+struct libpq_ptypes_s {
+    entry_t *buckets[PTYPES_NBUCKET];
+};
+
+static inline uint32_t hash_name(const char *name)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+static entry_t **find_entry(libpq_ptypes_t *t, const char *name,
+                            uint32_t hash)
+{
+    entry_t **ptr = &t->buckets[hash % PTYPES_NBUCKET];
+
+    while (*ptr && ((*ptr)->hash != hash || strcmp((*ptr)->name, name))) {
+        ptr = &(*ptr)->next;
+    }
+    return ptr;
+}
+
+libpq_ptypes_t *libpq_ptypes_new(void)
+{
+    return calloc(1, sizeof(libpq_ptypes_t));
+}
+
+void libpq_ptypes_free(libpq_ptypes_t *t)
+{
+    for (int i = 0; i < PTYPES_NBUCKET; i++) {
+        entry_t *e = t->buckets[i];
+        while (e) {
+            entry_t *next = e->next;
+            free(e->types);
+            free(e);
+            e = next;
+        }
+    }
+    free(t);
+}
+
+const Oid *libpq_ptypes_get(libpq_ptypes_t *t, const char *name,
+                            int *nparams)
+{
+    entry_t *e = *find_entry(t, name, hash_name(name));
+
+    if (e) {
+        *nparams = e->nparams;
+        return e->types;
+    }
+    return NULL;
+}
+
+int libpq_ptypes_set(libpq_ptypes_t *t, const char *name, int nparams,
+                     const Oid *types)
+{
+    uint32_t hash = hash_name(name);
+    entry_t **ptr = find_entry(t, name, hash);
+    Oid *copy     = malloc(sizeof(Oid) * (nparams ? nparams : 1));
+    size_t len    = strlen(name);
+
+    if (!copy) {
+        return -1;
+    }
+    if (nparams) {
+        memcpy(copy, types, sizeof(Oid) * nparams);
+    }
+
+    if (!*ptr) {
+        if (!(*ptr = malloc(sizeof(entry_t) + len + 1))) {
+            free(copy);
+            return -1;
+        }
+        (*ptr)->next  = NULL;
+        (*ptr)->hash  = hash;
+        (*ptr)->types = NULL;
+        memcpy((*ptr)->name, name, len + 1);
+    }
+    free((*ptr)->types);
+    (*ptr)->nparams = nparams;
+    (*ptr)->types   = copy;
+    return 0;
+}
+
+void libpq_ptypes_remove(libpq_ptypes_t *t, const char *name)
+{
+    entry_t **ptr = find_entry(t, name, hash_name(name));
+    entry_t *e    = *ptr;
+
+    if (e) {
+        *ptr = e->next;
+        free(e->types);
+        free(e);
+    }
+}
+
+static inline void store_be(char *buf, uint64_t v, int len)
+{
+    for (int i = len - 1; i >= 0; i--) {
+        buf[i] = (char)(v & 0xff);
+        v >>= 8;
+    }
+}
+
+static int toint64(lua_State *L, int idx, int64_t *v)
+{
+    lua_Number n = 0;
+
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, idx)) {
+        *v = lua_tointeger(L, idx);
+        return 1;
+    }
+#endif
+    // the integral numbers that can be represented exactly
+    n = lua_tonumber(L, idx);
+    if (n >= -9007199254740992.0 && n <= 9007199254740992.0 &&
+        n == (lua_Number)(int64_t)n) {
+        *v = (int64_t)n;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * encodes the value at idx into buf in the binary format of the type, and
+ * returns the length of the encoded value. buf must have at least 8 bytes.
+ * returns -1 if the value should be sent in the text format.
+ */
+int libpq_ptypes_encode(lua_State *L, int idx, Oid type, char *buf)
+{
+    int64_t v = 0;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TBOOLEAN:
+        if (type == BOOLOID) {
+            *buf = (char)lua_toboolean(L, idx);
+            return 1;
+        }
+        return -1;
+
+    case LUA_TNUMBER:
+        switch (type) {
+        case INT2OID:
+            if (toint64(L, idx, &v) && v >= INT16_MIN && v <= INT16_MAX) {
+                store_be(buf, (uint64_t)v, 2);
+                return 2;
+            }
+            return -1;
+
+        case INT4OID:
+            if (toint64(L, idx, &v) && v >= INT32_MIN && v <= INT32_MAX) {
+                store_be(buf, (uint64_t)v, 4);
+                return 4;
+            }
+            return -1;
+
+        case OIDOID:
+            if (toint64(L, idx, &v) && v >= 0 && v <= UINT32_MAX) {
+                store_be(buf, (uint64_t)v, 4);
+                return 4;
+            }
+            return -1;
+
+        case INT8OID:
+            if (toint64(L, idx, &v)) {
+                store_be(buf, (uint64_t)v, 8);
+                return 8;
+            }
+            return -1;
+
+        case FLOAT4OID: {
+            float f    = (float)lua_tonumber(L, idx);
+            uint32_t u = 0;
+            memcpy(&u, &f, sizeof(u));
+            store_be(buf, u, 4);
+            return 4;
+        }
+
+        case FLOAT8OID: {
+            double d   = (double)lua_tonumber(L, idx);
+            uint64_t u = 0;
+            memcpy(&u, &d, sizeof(u));
+            store_be(buf, u, 8);
+            return 8;
+        }
+        }
+        return -1;
+
+    default:
+        return -1;
+    }
+}
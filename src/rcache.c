@@ -0,0 +1,273 @@
+/**
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+// lua
+#include "lua_libpq.h"
+
+/**
+ * the result cache keeps the copies of the results in a hash table keyed by
+ * the query and parameters. the entries are evicted in least recently used
+ * order when the total size of the results exceeds the max_bytes, and
+ * expired after the ttl. each entry can be tagged with a notification
+ * channel name to invalidate the entries by the notification.
+ */
+
+typedef struct entry_s entry_t;
+struct entry_s {
+    // hash chain
+    entry_t *next;
+    // lru list
+    entry_t *lru_prev;
+    entry_t *lru_next;
+    uint32_t hash;
+    uint64_t expires_at;
+    size_t size;
+    char *channel;
+    PGresult *res;
+    size_t keylen;
+    char key[];
+};
+
+struct libpq_rcache_s {
+    size_t max_bytes;
+    uint64_t ttl;
+    size_t bytes;
+    // stats
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    // lru list from the most recently used
+    entry_t *lru_head;
+    entry_t *lru_tail;
+    entry_t **buckets;
+    size_t nbucket;
+    size_t nentry;
+};
+
+static inline uint32_t hash_key(const char *key, size_t len)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void lru_unlink(libpq_rcache_t *c, entry_t *e)
+{
+    if (e->lru_prev) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        c->lru_head = e->lru_next;
+    }
+    if (e->lru_next) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        c->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+}
+
+static void lru_push(libpq_rcache_t *c, entry_t *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = c->lru_head;
+    if (c->lru_head) {
+        c->lru_head->lru_prev = e;
+    } else {
+        c->lru_tail = e;
+    }
+    c->lru_head = e;
+}
+
+static void remove_entry(libpq_rcache_t *c, entry_t *e)
+{
+    entry_t **ptr = &c->buckets[e->hash & (c->nbucket - 1)];
+
+    while (*ptr != e) {
+        ptr = &(*ptr)->next;
+    }
+    *ptr = e->next;
+    lru_unlink(c, e);
+    c->bytes -= e->size;
+    c->nentry--;
+    PQclear(e->res);
+    free(e->channel);
+    free(e);
+}
+
+static int grow_buckets(libpq_rcache_t *c)
+{
+    size_t nbucket    = c->nbucket * 2;
+    entry_t **buckets = calloc(nbucket, sizeof(entry_t *));
+
+    if (!buckets) {
+        return -1;
+    }
+    for (size_t i = 0; i < c->nbucket; i++) {
+        entry_t *e = c->buckets[i];
+        while (e) {
+            entry_t *next = e->next;
+            size_t idx    = e->hash & (nbucket - 1);
+            e->next       = buckets[idx];
+            buckets[idx]  = e;
+            e             = next;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->nbucket = nbucket;
+    return 0;
+}
+
+libpq_rcache_t *libpq_rcache_new(size_t max_bytes, uint64_t ttl)
+{
+    libpq_rcache_t *c = calloc(1, sizeof(libpq_rcache_t));
+
+    if (!c) {
+        return NULL;
+    } else if (!(c->buckets = calloc(64, sizeof(entry_t *)))) {
+        free(c);
+        return NULL;
+    }
+    c->nbucket   = 64;
+    c->max_bytes = max_bytes;
+    c->ttl       = ttl;
+    return c;
+}
+
+void libpq_rcache_free(libpq_rcache_t *c)
+{
+    while (c->lru_head) {
+        remove_entry(c, c->lru_head);
+    }
+    free(c->buckets);
+    free(c);
+}
+
+const PGresult *libpq_rcache_get(libpq_rcache_t *c, const char *key,
+                                 size_t len)
+{
+    uint32_t hash = hash_key(key, len);
+    entry_t *e    = c->buckets[hash & (c->nbucket - 1)];
+
+    for (; e; e = e->next) {
+        if (e->hash == hash && e->keylen == len &&
+            memcmp(e->key, key, len) == 0) {
+            if (e->expires_at && e->expires_at <= libpq_getnsec()) {
+                remove_entry(c, e);
+                break;
+            }
+            c->hits++;
+            lru_unlink(c, e);
+            lru_push(c, e);
+            return e->res;
+        }
+    }
+    c->misses++;
+    return NULL;
+}
+
+int libpq_rcache_set(libpq_rcache_t *c, const char *key, size_t len,
+                     const char *channel, const PGresult *res)
+{
+    uint32_t hash = hash_key(key, len);
+    entry_t *e    = NULL;
+    size_t size   = PQresultMemorySize(res) + len;
+
+    // the result that is larger than the cache is not cached
+    if (size > c->max_bytes) {
+        return 0;
+    }
+
+    // remove the old entry
+    for (e = c->buckets[hash & (c->nbucket - 1)]; e; e = e->next) {
+        if (e->hash == hash && e->keylen == len &&
+            memcmp(e->key, key, len) == 0) {
+            remove_entry(c, e);
+            break;
+        }
+    }
+
+    // evict the least recently used entries
+    while (c->bytes + size > c->max_bytes) {
+        remove_entry(c, c->lru_tail);
+        c->evictions++;
+    }
+    if (c->nentry >= c->nbucket && grow_buckets(c) != 0) {
+        return -1;
+    } else if (!(e = calloc(1, sizeof(entry_t) + len))) {
+        return -1;
+    } else if (channel && !(e->channel = strdup(channel))) {
+        free(e);
+        return -1;
+    } else if (!(e->res = PQcopyResult(res, PG_COPYRES_ATTRS |
+                                                 PG_COPYRES_TUPLES))) {
+        free(e->channel);
+        free(e);
+        return -1;
+    }
+    e->hash       = hash;
+    e->expires_at = c->ttl ? libpq_getnsec() + c->ttl : 0;
+    e->size       = size;
+    e->keylen     = len;
+    memcpy(e->key, key, len);
+    e->next                             = c->buckets[hash & (c->nbucket - 1)];
+    c->buckets[hash & (c->nbucket - 1)] = e;
+    lru_push(c, e);
+    c->bytes += size;
+    c->nentry++;
+    return 1;
+}
+
+void libpq_rcache_invalidate(libpq_rcache_t *c, const char *channel)
+{
+    entry_t *e = c->lru_head;
+
+    while (e) {
+        entry_t *next = e->lru_next;
+        if (!channel || (e->channel && strcmp(e->channel, channel) == 0)) {
+            remove_entry(c, e);
+            c->invalidations++;
+        }
+        e = next;
+    }
+}
+
+void libpq_rcache_push_stat(lua_State *L, libpq_rcache_t *c)
+{
+    lua_createtable(L, 0, 8);
+    lauxh_pushint2tbl(L, "max_bytes", c->max_bytes);
+    lauxh_pushint2tbl(L, "ttl", c->ttl / 1000000);
+    lauxh_pushint2tbl(L, "bytes", c->bytes);
+    lauxh_pushint2tbl(L, "entries", c->nentry);
+    lauxh_pushint2tbl(L, "hits", c->hits);
+    lauxh_pushint2tbl(L, "misses", c->misses);
+    lauxh_pushint2tbl(L, "evictions", c->evictions);
+    lauxh_pushint2tbl(L, "invalidations", c->invalidations);
+}
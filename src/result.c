@@ -20,6 +20,10 @@
  *  DEALINGS IN THE SOFTWARE.
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 // lua
 #include "lua_libpq.h"
 
@@ -27,15 +31,375 @@ typedef struct {
     int ref_conn;
     int noclear;
     PGresult *res;
+    // hash table of the column names that built by the first name lookup.
+    // each slot holds the column index + 1, or 0 if empty.
+    int *fnumbers;
+    int nfnumbers;
+    // reference to the field descriptor table
+    int ref_fields;
+    // copy of the notice that saved by libpq_notice_save
+    char *notice;
 } result_t;
 
-PGresult *libpq_check_result(lua_State *L)
+// weak-valued table of the field descriptor tables keyed by the layout of
+// the fields, so that the results of the same query share the table
+#define FIELDS_CACHE "libpq.result.fields"
+
+static inline result_t *checkresult(lua_State *L)
 {
     result_t *r = luaL_checkudata(L, 1, LIBPQ_RESULT_MT);
     if (!r->res) {
         luaL_error(L, "attempt to use a freed object");
     }
-    return r->res;
+    return r;
+}
+
+PGresult *libpq_check_result(lua_State *L)
+{
+    return checkresult(L)->res;
+}
+
+static inline uint32_t hash_fname(const char *name)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+static void free_fnumbers(result_t *r)
+{
+    free(r->fnumbers);
+    r->fnumbers  = NULL;
+    r->nfnumbers = 0;
+}
+
+static int build_fnumbers(result_t *r)
+{
+    int nfields = PQnfields(r->res);
+    int nslot   = 8;
+
+    // keep the load factor below 0.5
+    while (nslot < nfields * 2) {
+        nslot <<= 1;
+    }
+    if (!(r->fnumbers = calloc(nslot, sizeof(int)))) {
+        return -1;
+    }
+    r->nfnumbers = nslot;
+
+    for (int col = 0; col < nfields; col++) {
+        const char *name = PQfname(r->res, col);
+        uint32_t i       = hash_fname(name) & (nslot - 1);
+
+        while (r->fnumbers[i]) {
+            // the first column wins if the names are duplicated
+            if (strcmp(PQfname(r->res, r->fnumbers[i] - 1), name) == 0) {
+                break;
+            }
+            i = (i + 1) & (nslot - 1);
+        }
+        if (!r->fnumbers[i]) {
+            r->fnumbers[i] = col + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * returns the column index of the specified name, or -1 if not found.
+ * it is the same as PQfnumber but looks up the names in the hash table.
+ */
+static int get_fnumber(result_t *r, const char *name)
+{
+    const unsigned char *p = (const unsigned char *)name;
+    uint32_t mask          = 0;
+    uint32_t i             = 0;
+
+    // the names that contain the double quotes or upper case letters are
+    // case-folded by PQfnumber
+    for (; *p; p++) {
+        if (*p == '"' || isupper(*p)) {
+            return PQfnumber(r->res, name);
+        }
+    }
+
+    if (!r->fnumbers && (!PQnfields(r->res) || build_fnumbers(r) != 0)) {
+        return PQfnumber(r->res, name);
+    }
+    mask = (uint32_t)r->nfnumbers - 1;
+    for (i = hash_fname(name) & mask; r->fnumbers[i]; i = (i + 1) & mask) {
+        int col = r->fnumbers[i] - 1;
+        if (strcmp(PQfname(r->res, col), name) == 0) {
+            return col;
+        }
+    }
+    return -1;
+}
+
+static int readonly_newindex(lua_State *L)
+{
+    return luaL_error(L, "attempt to modify the field descriptor");
+}
+
+static int readonly_len(lua_State *L)
+{
+    lua_getmetatable(L, 1);
+    lua_getfield(L, -1, "__index");
+#if LUA_VERSION_NUM >= 502
+    lua_pushinteger(L, (lua_Integer)lua_rawlen(L, -1));
+#else
+    lua_pushinteger(L, (lua_Integer)lua_objlen(L, -1));
+#endif
+    return 1;
+}
+
+static int readonly_next(lua_State *L)
+{
+    lua_settop(L, 2);
+    if (lua_next(L, 1)) {
+        return 2;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+static int readonly_pairs(lua_State *L)
+{
+    lua_pushcfunction(L, readonly_next);
+    lua_getmetatable(L, 1);
+    lua_getfield(L, -1, "__index");
+    lua_replace(L, -2);
+    lua_pushnil(L);
+    return 3;
+}
+
+/**
+ * replaces the table at the top of the stack with the read-only proxy that
+ * looks up the keys in the table.
+ */
+static void push_readonly(lua_State *L)
+{
+    lua_newtable(L);
+    lua_createtable(L, 0, 5);
+    lua_pushvalue(L, -3);
+    lua_setfield(L, -2, "__index");
+    lauxh_pushfn2tbl(L, "__newindex", readonly_newindex);
+    lauxh_pushfn2tbl(L, "__len", readonly_len);
+    lauxh_pushfn2tbl(L, "__pairs", readonly_pairs);
+    lauxh_pushbool2tbl(L, "__metatable", 0);
+    lua_setmetatable(L, -2);
+    lua_replace(L, -2);
+}
+
+static void push_fields(lua_State *L, const PGresult *res)
+{
+    int nfields = PQnfields(res);
+
+    lua_createtable(L, nfields, nfields);
+    for (int col = 0; col < nfields; col++) {
+        char *fname = PQfname(res, col);
+        lua_createtable(L, 0, 8);
+        lauxh_pushint2tbl(L, "col", col + 1);
+        lauxh_pushstr2tbl(L, "name", fname);
+        lauxh_pushint2tbl(L, "table", PQftable(res, col));
+        lauxh_pushint2tbl(L, "tablecol", PQftablecol(res, col));
+        lauxh_pushint2tbl(L, "format", PQfformat(res, col));
+        lauxh_pushint2tbl(L, "type", PQftype(res, col));
+        lauxh_pushint2tbl(L, "size", PQfsize(res, col));
+        lauxh_pushint2tbl(L, "mod", PQfmod(res, col));
+        push_readonly(L);
+        // index by column name
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, fname);
+        // index by column number
+        lua_rawseti(L, -2, col + 1);
+    }
+    push_readonly(L);
+}
+
+/**
+ * pushes the field descriptor table of the result at index 1.
+ * the table is shared with the other results that have the same fields, so
+ * it and its entries are the read-only proxies.
+ */
+void libpq_result_push_fields(lua_State *L)
+{
+    result_t *r = checkresult(L);
+    int nfields = PQnfields(r->res);
+    luaL_Buffer b;
+
+    if (r->ref_fields != LUA_NOREF) {
+        lauxh_pushref(L, r->ref_fields);
+        return;
+    }
+
+    // make the cache key from the attributes of the fields
+    luaL_buffinit(L, &b);
+    for (int col = 0; col < nfields; col++) {
+        int attr[6] = {
+            (int)PQftable(r->res, col), PQftablecol(r->res, col),
+            PQfformat(r->res, col),     (int)PQftype(r->res, col),
+            PQfsize(r->res, col),       PQfmod(r->res, col),
+        };
+        luaL_addlstring(&b, (const char *)attr, sizeof(attr));
+        luaL_addstring(&b, PQfname(r->res, col));
+        luaL_addchar(&b, 0);
+    }
+    luaL_pushresult(&b);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, FIELDS_CACHE);
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        push_fields(L, r->res);
+        lua_pushvalue(L, -3);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    // keep the table while the result is alive
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    r->ref_fields = lauxh_ref(L);
+}
+
+/**
+ * returns the column index of the argument that is either the column number
+ * or the column name. throws an error if the column name is not found.
+ */
+static int checkcol(lua_State *L, result_t *r, int idx)
+{
+    if (lua_type(L, idx) == LUA_TSTRING) {
+        const char *name = lua_tostring(L, idx);
+        int col          = get_fnumber(r, name);
+
+        if (col == -1) {
+            lauxh_argerror(L, idx, "unknown column name %s", name);
+        }
+        return col;
+    }
+    return lauxh_checkpinteger(L, idx) - 1;
+}
+
+/**
+ * returns the number of the consecutive non-nil elements from index 1
+ */
+static int arrlen(lua_State *L, int idx)
+{
+    int n = 0;
+
+    lua_rawgeti(L, idx, 1);
+    while (!lua_isnil(L, -1)) {
+        n++;
+        lua_pop(L, 1);
+        lua_rawgeti(L, idx, n + 1);
+    }
+    lua_pop(L, 1);
+    return n;
+}
+
+static int set_value_lua(lua_State *L)
+{
+    PGresult *res = libpq_check_result(L);
+    int row       = lauxh_checkpinteger(L, 2) - 1;
+    int col       = lauxh_checkpinteger(L, 3) - 1;
+    size_t len    = 0;
+    char *value   = (char *)lauxh_optlstring(L, 4, NULL, &len);
+
+    // the value is copied into the result, and the row can be appended by
+    // specifying the ntuples + 1
+    errno = 0;
+    if (PQsetvalue(res, row, col, value, value ? (int)len : -1)) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // got error
+    lua_pushboolean(L, 0);
+    lua_errno_new(L, errno ? errno : EINVAL, "set_value");
+    return 2;
+}
+
+static int set_attrs_lua(lua_State *L)
+{
+    result_t *r        = checkresult(L);
+    PGresult *res      = r->res;
+    int nattrs         = 0;
+    PGresAttDesc *desc = NULL;
+
+    lauxh_checktable(L, 2);
+    lua_settop(L, 2);
+    nattrs = arrlen(L, 2);
+    desc = lua_newuserdata(L, sizeof(PGresAttDesc) * (nattrs ? nattrs : 1));
+    for (int i = 0; i < nattrs; i++) {
+        lua_rawgeti(L, 2, i + 1);
+        if (!lua_istable(L, -1)) {
+            lauxh_argerror(L, 2, "attrs#%d must be table", i + 1);
+        }
+        // same field names as the fields of get_result_stat
+        lua_getfield(L, -1, "name");
+        lua_getfield(L, -2, "table");
+        lua_getfield(L, -3, "tablecol");
+        lua_getfield(L, -4, "format");
+        lua_getfield(L, -5, "type");
+        lua_getfield(L, -6, "size");
+        lua_getfield(L, -7, "mod");
+        if (lua_type(L, -7) != LUA_TSTRING) {
+            lauxh_argerror(L, 2, "attrs#%d.name must be string", i + 1);
+        }
+        desc[i] = (PGresAttDesc){
+            .name      = (char *)lua_tostring(L, -7),
+            .tableid   = (Oid)lua_tointeger(L, -6),
+            .columnid  = (int)lua_tointeger(L, -5),
+            .format    = (int)lua_tointeger(L, -4),
+            .typid     = (Oid)lua_tointeger(L, -3),
+            .typlen    = lua_isnil(L, -2) ? -1 : (int)lua_tointeger(L, -2),
+            .atttypmod = lua_isnil(L, -1) ? -1 : (int)lua_tointeger(L, -1),
+        };
+        // the names are kept in the attrs table until the attrs are copied
+        lua_pop(L, 8);
+    }
+
+    errno = 0;
+    if (PQsetResultAttrs(res, nattrs, desc)) {
+        free_fnumbers(r);
+        r->ref_fields = lauxh_unref(L, r->ref_fields);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // got error
+    lua_pushboolean(L, 0);
+    lua_errno_new(L, errno ? errno : EINVAL, "set_attrs");
+    return 2;
+}
+
+static int to_columns_buffer_lua(lua_State *L)
+{
+    const PGresult *res  = libpq_check_result(L);
+    lua_Integer nthreads = lauxh_optinteger(L, 2, 1);
+
+    if (nthreads < 1 || nthreads > 256) {
+        return lauxh_argerror(L, 2, "nthreads must be between 1 and 256");
+    } else if (!libpq_columns_new(L, res, (int)nthreads, 1)) {
+        lua_pushnil(L);
+        lua_errno_new(L, errno, "to_columns_buffer");
+        return 2;
+    }
+    return 1;
+}
+
+static int memory_size_lua(lua_State *L)
+{
+    const PGresult *res = libpq_check_result(L);
+
+    lua_pushinteger(L, PQresultMemorySize(res));
+    return 1;
 }
 
 static int param_type_lua(lua_State *L)
@@ -57,9 +421,10 @@ static int nparams_lua(lua_State *L)
 
 static int get_is_null_lua(lua_State *L)
 {
-    const PGresult *res = libpq_check_result(L);
+    result_t *r         = checkresult(L);
+    const PGresult *res = r->res;
     int row             = lauxh_checkpinteger(L, 2) - 1;
-    int col             = lauxh_checkpinteger(L, 3) - 1;
+    int col             = checkcol(L, r, 3);
 
     lua_pushboolean(L, PQgetisnull(res, row, col));
     return 1;
@@ -67,24 +432,134 @@ static int get_is_null_lua(lua_State *L)
 
 static int get_length_lua(lua_State *L)
 {
-    const PGresult *res = libpq_check_result(L);
+    result_t *r         = checkresult(L);
+    const PGresult *res = r->res;
     int row             = lauxh_checkpinteger(L, 2) - 1;
-    int col             = lauxh_checkpinteger(L, 3) - 1;
+    int col             = checkcol(L, r, 3);
 
     lua_pushinteger(L, PQgetlength(res, row, col));
     return 1;
 }
 
+static int get_values_lua(lua_State *L)
+{
+    result_t *r         = checkresult(L);
+    const PGresult *res = r->res;
+    int ntuples         = PQntuples(res);
+    int nfields         = PQnfields(res);
+    int row_from        = lauxh_checkpinteger(L, 2) - 1;
+    int row_to          = lauxh_optpinteger(L, 3, ntuples);
+    int ncols           = nfields;
+    int *cols           = NULL;
+    int n               = 0;
+
+    if (row_from > ntuples) {
+        return lauxh_argerror(L, 2, "row_from must be between 1 and %d",
+                              ntuples + 1);
+    } else if (row_to > ntuples) {
+        row_to = ntuples;
+    }
+    if (!lua_isnoneornil(L, 4)) {
+        lauxh_checktable(L, 4);
+    }
+    if (!lua_isnoneornil(L, 5)) {
+        lauxh_checktable(L, 5);
+    }
+    lua_settop(L, 5);
+
+    // resolve the column numbers
+    if (!lua_isnil(L, 4)) {
+        ncols = arrlen(L, 4);
+    }
+    cols = lua_newuserdata(L, sizeof(int) * (ncols ? ncols : 1));
+    for (int i = 0; i < ncols; i++) {
+        if (lua_isnil(L, 4)) {
+            cols[i] = i;
+            continue;
+        }
+        lua_rawgeti(L, 4, i + 1);
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            cols[i] = get_fnumber(r, lua_tostring(L, -1));
+            if (cols[i] == -1) {
+                lauxh_argerror(L, 4, "cols#%d unknown column name %s", i + 1,
+                               lua_tostring(L, -1));
+            }
+        } else if (lua_type(L, -1) != LUA_TNUMBER ||
+                   lua_tointeger(L, -1) < 1 ||
+                   lua_tointeger(L, -1) > nfields) {
+            lauxh_argerror(L, 4, "cols#%d must be integer between 1 and %d",
+                           i + 1, nfields);
+        } else {
+            cols[i] = (int)lua_tointeger(L, -1) - 1;
+        }
+        lua_pop(L, 1);
+    }
+
+    // fill the rows into the specified table
+    if (lua_isnil(L, 5)) {
+        lua_createtable(L, row_to > row_from ? row_to - row_from : 0, 0);
+        lua_replace(L, 5);
+    }
+    for (int row = row_from; row < row_to; row++) {
+        n++;
+        // reuse the row table if exists
+        lua_rawgeti(L, 5, n);
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_createtable(L, ncols, 0);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, 5, n);
+        }
+        for (int i = 0; i < ncols; i++) {
+            if (PQgetisnull(res, row, cols[i])) {
+                lua_pushnil(L);
+            } else {
+                lua_pushlstring(L, PQgetvalue(res, row, cols[i]),
+                                PQgetlength(res, row, cols[i]));
+            }
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_pushvalue(L, 5);
+    lua_pushinteger(L, n);
+    return 2;
+}
+
 static int get_value_lua(lua_State *L)
 {
-    const PGresult *res = libpq_check_result(L);
+    result_t *r         = checkresult(L);
+    const PGresult *res = r->res;
     int row             = lauxh_checkpinteger(L, 2) - 1;
-    int col             = lauxh_checkpinteger(L, 3) - 1;
+    int col             = checkcol(L, r, 3);
 
     if (PQgetisnull(res, row, col)) {
         lua_pushnil(L);
     } else {
-        lua_pushstring(L, PQgetvalue(res, row, col));
+        // the value of the binary format may contain the null bytes
+        lua_pushlstring(L, PQgetvalue(res, row, col),
+                        PQgetlength(res, row, col));
+    }
+    return 1;
+}
+
+static int get_bytea_lua(lua_State *L)
+{
+    result_t *r         = checkresult(L);
+    const PGresult *res = r->res;
+    int row             = lauxh_checkpinteger(L, 2) - 1;
+    int col             = checkcol(L, r, 3);
+
+    if (PQgetisnull(res, row, col)) {
+        lua_pushnil(L);
+    } else if (PQfformat(res, col) == 1) {
+        // the binary format is the raw bytes
+        lua_pushlstring(L, PQgetvalue(res, row, col),
+                        PQgetlength(res, row, col));
+    } else {
+        libpq_push_bytea(L, PQgetvalue(res, row, col),
+                         PQgetlength(res, row, col));
     }
     return 1;
 }
@@ -176,12 +651,12 @@ static int ftable_lua(lua_State *L)
 
 static int fnumber_lua(lua_State *L)
 {
-    const PGresult *res  = libpq_check_result(L);
+    result_t *r          = checkresult(L);
     const char *col_name = lauxh_checkstring(L, 2);
     // get the column number of the specified column name
-    int col              = PQfnumber(res, col_name);
+    int col              = get_fnumber(r, col_name);
 
-    lua_pushinteger(L, (col != 1) ? col + 1 : -1);
+    lua_pushinteger(L, (col != -1) ? col + 1 : -1);
     return 1;
 }
 
@@ -218,22 +693,134 @@ static int ntuples_lua(lua_State *L)
     return 1;
 }
 
+/**
+ * the notice that received on the worker thread of the offload pool is
+ * saved as follows, because libpq clears the notice result after the
+ * receiver returns, and PQcopyResult does not copy the error fields;
+ *  <message>\0[<fieldcode><value>\0]...\0
+ */
+static const int NOTICE_FIELDS[] = {
+    PG_DIAG_SEVERITY,           PG_DIAG_SEVERITY_NONLOCALIZED,
+    PG_DIAG_SQLSTATE,           PG_DIAG_MESSAGE_PRIMARY,
+    PG_DIAG_MESSAGE_DETAIL,     PG_DIAG_MESSAGE_HINT,
+    PG_DIAG_STATEMENT_POSITION, PG_DIAG_INTERNAL_POSITION,
+    PG_DIAG_INTERNAL_QUERY,     PG_DIAG_CONTEXT,
+    PG_DIAG_SCHEMA_NAME,        PG_DIAG_TABLE_NAME,
+    PG_DIAG_COLUMN_NAME,        PG_DIAG_DATATYPE_NAME,
+    PG_DIAG_CONSTRAINT_NAME,    PG_DIAG_SOURCE_FILE,
+    PG_DIAG_SOURCE_LINE,        PG_DIAG_SOURCE_FUNCTION,
+};
+
+/**
+ * appends the notice res to the buffer. returns the number of bytes
+ * appended, or 0 if failed to allocate memory.
+ */
+size_t libpq_notice_save(libpq_buf_t *b, const PGresult *res)
+{
+    const char *msg = PQresultErrorMessage(res);
+    size_t len      = strlen(msg) + 2;
+    size_t head     = b->len;
+    char *p         = NULL;
+
+    for (size_t i = 0; i < sizeof(NOTICE_FIELDS) / sizeof(int); i++) {
+        const char *v = PQresultErrorField(res, NOTICE_FIELDS[i]);
+        if (v) {
+            len += strlen(v) + 2;
+        }
+    }
+    if (libpq_buf_reserve(b, len)) {
+        return 0;
+    }
+
+    p = b->data + head;
+    memcpy(p, msg, strlen(msg) + 1);
+    p += strlen(msg) + 1;
+    for (size_t i = 0; i < sizeof(NOTICE_FIELDS) / sizeof(int); i++) {
+        const char *v = PQresultErrorField(res, NOTICE_FIELDS[i]);
+        if (v) {
+            *p++ = (char)NOTICE_FIELDS[i];
+            memcpy(p, v, strlen(v) + 1);
+            p += strlen(v) + 1;
+        }
+    }
+    *p     = 0;
+    b->len = head + len;
+    return len;
+}
+
+/**
+ * returns the number of bytes of the saved notice.
+ */
+size_t libpq_notice_len(const char *notice)
+{
+    const char *p = notice + strlen(notice) + 1;
+
+    while (*p) {
+        p += strlen(p) + 1;
+    }
+    return (size_t)(p - notice) + 1;
+}
+
+/**
+ * pushes the result object of the saved notice that refers to the
+ * connection at conn_idx. the status of the result is PGRES_NONFATAL_ERROR
+ * the same as the notice result that created by libpq.
+ */
+void libpq_notice_push(lua_State *L, int conn_idx, const char *notice)
+{
+    size_t len     = libpq_notice_len(notice);
+    PGresult **res = libpq_result_new(L, conn_idx, 0);
+    result_t *r    = lua_touserdata(L, -1);
+
+    if (!(r->notice = malloc(len)) ||
+        !(*res = PQmakeEmptyPGresult(NULL, PGRES_NONFATAL_ERROR))) {
+        luaL_error(L, "failed to allocate memory: %s", strerror(errno));
+    }
+    memcpy(r->notice, notice, len);
+}
+
+/**
+ * returns the field of the saved notice, or NULL if not found.
+ */
+static const char *notice_field(const char *notice, int fieldcode)
+{
+    const char *p = notice + strlen(notice) + 1;
+
+    for (; *p; p += strlen(p) + 1) {
+        if (*p == fieldcode) {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
 static int error_field_lua(lua_State *L)
 {
-    const PGresult *res = libpq_check_result(L);
-    int fieldcode       = lauxh_checkinteger(L, 2);
+    result_t *r   = checkresult(L);
+    int fieldcode = lauxh_checkinteger(L, 2);
 
-    lua_pushstring(L, PQresultErrorField(res, fieldcode));
+    if (r->notice) {
+        lua_pushstring(L, notice_field(r->notice, fieldcode));
+    } else {
+        lua_pushstring(L, PQresultErrorField(r->res, fieldcode));
+    }
     return 1;
 }
 
 static int verbose_error_message_lua(lua_State *L)
 {
-    const PGresult *res = libpq_check_result(L);
-    int verbosity       = lauxh_optinteger(L, 2, PQERRORS_DEFAULT);
-    int show_context    = lauxh_optinteger(L, 3, PQSHOW_CONTEXT_ERRORS);
-    char *msg = PQresultVerboseErrorMessage(res, verbosity, show_context);
+    result_t *r      = checkresult(L);
+    int verbosity    = lauxh_optinteger(L, 2, PQERRORS_DEFAULT);
+    int show_context = lauxh_optinteger(L, 3, PQSHOW_CONTEXT_ERRORS);
+    char *msg        = NULL;
+
+    if (r->notice) {
+        // the fields are not formatted by libpq
+        lua_pushstring(L, r->notice);
+        return 1;
+    }
 
+    msg = PQresultVerboseErrorMessage(r->res, verbosity, show_context);
     if (msg) {
         lua_pushstring(L, msg);
         PQfreemem(msg);
@@ -248,8 +835,8 @@ static int verbose_error_message_lua(lua_State *L)
 
 static int error_message_lua(lua_State *L)
 {
-    const PGresult *res = libpq_check_result(L);
-    char *err           = PQresultErrorMessage(res);
+    result_t *r     = checkresult(L);
+    const char *err = r->notice ? r->notice : PQresultErrorMessage(r->res);
 
     if (err && *err) {
         lua_pushstring(L, err);
@@ -279,7 +866,11 @@ static inline int clear(lua_State *L)
 {
     result_t *r = luaL_checkudata(L, 1, LIBPQ_RESULT_MT);
 
-    r->ref_conn = lauxh_unref(L, r->ref_conn);
+    r->ref_conn   = lauxh_unref(L, r->ref_conn);
+    r->ref_fields = lauxh_unref(L, r->ref_fields);
+    free_fnumbers(r);
+    free(r->notice);
+    r->notice = NULL;
     if (!r->noclear && r->res) {
         PQclear(r->res);
         r->res = NULL;
@@ -305,10 +896,14 @@ static int tostring_lua(lua_State *L)
 
 PGresult **libpq_result_new(lua_State *L, int conn_idx, int noclear)
 {
-    result_t *r = lua_newuserdata(L, sizeof(result_t));
-    r->ref_conn = lauxh_refat(L, conn_idx);
-    r->noclear  = noclear;
-    r->res      = NULL;
+    result_t *r   = lua_newuserdata(L, sizeof(result_t));
+    r->ref_conn   = lauxh_refat(L, conn_idx);
+    r->noclear    = noclear;
+    r->res        = NULL;
+    r->fnumbers   = NULL;
+    r->nfnumbers  = 0;
+    r->ref_fields = LUA_NOREF;
+    r->notice     = NULL;
     lauxh_setmetatable(L, LIBPQ_RESULT_MT);
     return &r->res;
 }
@@ -342,12 +937,29 @@ void libpq_result_init(lua_State *L)
         {"oid_value",             oid_value_lua            },
         {"cmd_tuples",            cmd_tuples_lua           },
         {"get_value",             get_value_lua            },
+        {"get_bytea",             get_bytea_lua            },
+        {"get_values",            get_values_lua           },
         {"get_length",            get_length_lua           },
         {"get_is_null",           get_is_null_lua          },
         {"nparams",               nparams_lua              },
         {"param_type",            param_type_lua           },
+        {"set_attrs",             set_attrs_lua            },
+        {"set_value",             set_value_lua            },
+        {"memory_size",           memory_size_lua          },
+        {"to_columns_buffer",     to_columns_buffer_lua    },
         {NULL,                    NULL                     }
     };
 
     libpq_register_mt(L, LIBPQ_RESULT_MT, mmethod, method);
+
+    // create the field descriptor cache
+    lua_getfield(L, LUA_REGISTRYINDEX, FIELDS_CACHE);
+    if (lua_isnil(L, -1)) {
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lauxh_pushstr2tbl(L, "__mode", "v");
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, FIELDS_CACHE);
+    }
+    lua_pop(L, 1);
 }
@@ -0,0 +1,454 @@
+/**
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+// lua
+#include "lua_libpq.h"
+
+/**
+ * the spilled result keeps the rows that received in the single row mode
+ * in the compact row format. the rows are kept in memory until the size
+ * exceeds the threshold, and then moved to the unlinked temporary file that
+ * mapped into memory after all rows are received.
+ *
+ * each value is encoded as the varint of the length + 1 followed by the
+ * bytes, and 0 for the null. the offsets of every SPILL_STRIDE rows are
+ * indexed, and the other rows are found by skipping the rows from the
+ * indexed one or the last accessed one.
+ */
+
+#define SPILL_STRIDE 64
+// the size of the buffered rows that written to the file at once
+#define SPILL_CHUNK  (1024 * 1024)
+
+struct libpq_spill_s {
+    // the attributes of the columns without rows
+    PGresult *attrs;
+    int ncol;
+    int nrow;
+    size_t threshold;
+    // the rows that not yet written to the file, or all rows if not spilled
+    libpq_buf_t buf;
+    // the uint64_t offsets of every SPILL_STRIDE rows
+    libpq_buf_t index;
+    // the temporary file, or -1 if not spilled
+    int fd;
+    // the total size of the rows
+    uint64_t size;
+    // the rows that mapped from the file after finished
+    char *map;
+    // the last accessed row and the offset of it
+    int cur_row;
+    uint64_t cur_off;
+    int freed;
+};
+
+static inline char *put_varint(char *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char)v;
+    return p;
+}
+
+static inline const char *get_varint(const char *p, uint64_t *v)
+{
+    uint64_t n = 0;
+
+    for (int shift = 0;; shift += 7) {
+        unsigned char b = (unsigned char)*p++;
+        n |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            break;
+        }
+    }
+    *v = n;
+    return p;
+}
+
+static int open_tmpfile(void)
+{
+    const char *dir = getenv("TMPDIR");
+    char path[4096] = {0};
+    int fd          = -1;
+
+    if (!dir || !*dir) {
+        dir = "/tmp";
+    }
+    if (snprintf(path, sizeof(path), "%s/libpq-spill-XXXXXX", dir) >=
+        (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    } else if ((fd = mkstemp(path)) != -1) {
+        // the file is removed when closed
+        unlink(path);
+    }
+    return fd;
+}
+
+static int write_buf(libpq_spill_t *s)
+{
+    for (size_t off = 0; off < s->buf.len;) {
+        ssize_t n = write(s->fd, s->buf.data + off, s->buf.len - off);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        off += (size_t)n;
+    }
+    s->buf.len = 0;
+    // release the buffer that grown up to the threshold
+    if (s->buf.cap > SPILL_CHUNK * 2) {
+        libpq_buf_free(&s->buf);
+    }
+    return 0;
+}
+
+/**
+ * appends the rows of res. the attributes of the columns are taken from the
+ * first result. returns 0 on success, otherwise the error number.
+ */
+int libpq_spill_append(libpq_spill_t *s, const PGresult *res)
+{
+    int ntuples = PQntuples(res);
+
+    if (!s->attrs) {
+        if (!(s->attrs = PQcopyResult(res, PG_COPYRES_ATTRS))) {
+            return ENOMEM;
+        }
+        s->ncol = PQnfields(res);
+    } else if (PQnfields(res) != s->ncol) {
+        return EINVAL;
+    }
+
+    for (int row = 0; row < ntuples; row++) {
+        // the varint of the 32-bit length is up to 5 bytes
+        size_t need = (size_t)s->ncol * 5;
+        char *p     = NULL;
+
+        for (int col = 0; col < s->ncol; col++) {
+            need += (size_t)PQgetlength(res, row, col);
+        }
+        if (s->nrow % SPILL_STRIDE == 0) {
+            uint64_t off = s->size;
+
+            if (libpq_buf_reserve(&s->index, sizeof(off))) {
+                return ENOMEM;
+            }
+            memcpy(s->index.data + s->index.len, &off, sizeof(off));
+            s->index.len += sizeof(off);
+        }
+        if (libpq_buf_reserve(&s->buf, need)) {
+            return ENOMEM;
+        }
+
+        p = s->buf.data + s->buf.len;
+        for (int col = 0; col < s->ncol; col++) {
+            if (PQgetisnull(res, row, col)) {
+                *p++ = 0;
+            } else {
+                size_t len = (size_t)PQgetlength(res, row, col);
+                p          = put_varint(p, len + 1);
+                memcpy(p, PQgetvalue(res, row, col), len);
+                p += len;
+            }
+        }
+        s->size += (uint64_t)(p - (s->buf.data + s->buf.len));
+        s->buf.len = (size_t)(p - s->buf.data);
+        s->nrow++;
+
+        if (s->fd == -1 && s->buf.len > s->threshold &&
+            (s->fd = open_tmpfile()) == -1) {
+            return errno;
+        } else if (s->fd != -1 && s->buf.len >= SPILL_CHUNK) {
+            int eno = write_buf(s);
+            if (eno) {
+                return eno;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * maps the spilled rows into memory after all rows are appended. returns 0
+ * on success, otherwise the error number.
+ */
+int libpq_spill_finish(libpq_spill_t *s)
+{
+    int eno = 0;
+
+    if (!s->attrs &&
+        !(s->attrs = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK))) {
+        return ENOMEM;
+    } else if (s->fd == -1) {
+        return 0;
+    } else if ((eno = write_buf(s))) {
+        return eno;
+    }
+    libpq_buf_free(&s->buf);
+    if (s->size) {
+        void *map = mmap(NULL, (size_t)s->size, PROT_READ, MAP_PRIVATE, s->fd,
+                         0);
+        if (map == MAP_FAILED) {
+            return errno;
+        }
+        s->map = map;
+    }
+    close(s->fd);
+    s->fd = -1;
+    return 0;
+}
+
+static void spill_free(libpq_spill_t *s)
+{
+    if (!s->freed) {
+        s->freed = 1;
+        PQclear(s->attrs);
+        s->attrs = NULL;
+        libpq_buf_free(&s->buf);
+        libpq_buf_free(&s->index);
+        if (s->fd != -1) {
+            close(s->fd);
+            s->fd = -1;
+        }
+        if (s->map) {
+            munmap(s->map, (size_t)s->size);
+            s->map = NULL;
+        }
+    }
+}
+
+libpq_spill_t *libpq_spill_new(lua_State *L, size_t threshold)
+{
+    libpq_spill_t *s = lua_newuserdata(L, sizeof(libpq_spill_t));
+
+    *s = (libpq_spill_t){
+        .threshold = threshold,
+        .fd        = -1,
+    };
+    lauxh_setmetatable(L, LIBPQ_SPILL_MT);
+    return s;
+}
+
+/**
+ * returns the pointer to the value of the row and col, and sets the length
+ * to len, or -1 if the value is null.
+ */
+static const char *get_value(libpq_spill_t *s, int row, int col, int *len)
+{
+    const char *data = s->map ? s->map : s->buf.data;
+    const char *p    = NULL;
+    int from         = row - row % SPILL_STRIDE;
+    uint64_t v       = 0;
+
+    // skip the rows from the last accessed row if it is closer
+    if (s->cur_row >= from && s->cur_row <= row) {
+        from = s->cur_row;
+        p    = data + s->cur_off;
+    } else {
+        uint64_t off = 0;
+        memcpy(&off, s->index.data + sizeof(off) * (row / SPILL_STRIDE),
+               sizeof(off));
+        p = data + off;
+    }
+    for (; from < row; from++) {
+        for (int i = 0; i < s->ncol; i++) {
+            p = get_varint(p, &v);
+            p += v ? v - 1 : 0;
+        }
+    }
+    s->cur_row = row;
+    s->cur_off = (uint64_t)(p - data);
+
+    for (int i = 0; i < col; i++) {
+        p = get_varint(p, &v);
+        p += v ? v - 1 : 0;
+    }
+    p    = get_varint(p, &v);
+    *len = (int)v - 1;
+    return p;
+}
+
+static inline libpq_spill_t *checkself(lua_State *L)
+{
+    libpq_spill_t *s = luaL_checkudata(L, 1, LIBPQ_SPILL_MT);
+    if (s->freed) {
+        luaL_error(L, "attempt to use a freed object");
+    }
+    return s;
+}
+
+/**
+ * returns the 0-based row and column at idx and idx + 1, or 0 if out of
+ * range. the column can be specified by the name.
+ */
+static int checkcell(lua_State *L, libpq_spill_t *s, int idx, int *row,
+                     int *col)
+{
+    *row = lauxh_checkpinteger(L, idx) - 1;
+    if (lua_type(L, idx + 1) == LUA_TSTRING) {
+        *col = PQfnumber(s->attrs, lua_tostring(L, idx + 1));
+    } else {
+        *col = lauxh_checkpinteger(L, idx + 1) - 1;
+    }
+    return *row >= 0 && *row < s->nrow && *col >= 0 && *col < s->ncol;
+}
+
+static int get_value_lua(lua_State *L)
+{
+    libpq_spill_t *s  = checkself(L);
+    int row           = 0;
+    int col           = 0;
+    int len           = -1;
+    const char *value = NULL;
+
+    if (checkcell(L, s, 2, &row, &col)) {
+        value = get_value(s, row, col, &len);
+    }
+    if (len == -1) {
+        lua_pushnil(L);
+    } else {
+        lua_pushlstring(L, value, (size_t)len);
+    }
+    return 1;
+}
+
+static int get_is_null_lua(lua_State *L)
+{
+    libpq_spill_t *s = checkself(L);
+    int row          = 0;
+    int col          = 0;
+    int len          = -1;
+
+    if (checkcell(L, s, 2, &row, &col)) {
+        get_value(s, row, col, &len);
+    }
+    lua_pushboolean(L, len == -1);
+    return 1;
+}
+
+static int get_length_lua(lua_State *L)
+{
+    libpq_spill_t *s = checkself(L);
+    int row          = 0;
+    int col          = 0;
+    int len          = -1;
+
+    if (checkcell(L, s, 2, &row, &col)) {
+        get_value(s, row, col, &len);
+    }
+    lua_pushinteger(L, len == -1 ? 0 : len);
+    return 1;
+}
+
+static int is_spilled_lua(lua_State *L)
+{
+    libpq_spill_t *s = checkself(L);
+    lua_pushboolean(L, s->map != NULL);
+    return 1;
+}
+
+static int fnumber_lua(lua_State *L)
+{
+    libpq_spill_t *s = checkself(L);
+    int col          = PQfnumber(s->attrs, lauxh_checkstring(L, 2));
+
+    lua_pushinteger(L, (col != -1) ? col + 1 : -1);
+    return 1;
+}
+
+static int ftype_lua(lua_State *L)
+{
+    libpq_spill_t *s = checkself(L);
+    int col          = lauxh_checkpinteger(L, 2) - 1;
+
+    lua_pushinteger(L, PQftype(s->attrs, col));
+    return 1;
+}
+
+static int fname_lua(lua_State *L)
+{
+    libpq_spill_t *s = checkself(L);
+    int col          = lauxh_checkpinteger(L, 2) - 1;
+
+    lua_pushstring(L, PQfname(s->attrs, col));
+    return 1;
+}
+
+static int nfields_lua(lua_State *L)
+{
+    libpq_spill_t *s = checkself(L);
+    lua_pushinteger(L, s->ncol);
+    return 1;
+}
+
+static int ntuples_lua(lua_State *L)
+{
+    libpq_spill_t *s = checkself(L);
+    lua_pushinteger(L, s->nrow);
+    return 1;
+}
+
+static int clear_lua(lua_State *L)
+{
+    spill_free(luaL_checkudata(L, 1, LIBPQ_SPILL_MT));
+    return 0;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    return libpq_tostring(L, LIBPQ_SPILL_MT);
+}
+
+void libpq_spill_init(lua_State *L)
+{
+    struct luaL_Reg mmethod[] = {
+        {"__gc",       clear_lua   },
+        {"__tostring", tostring_lua},
+        {NULL,         NULL        }
+    };
+    struct luaL_Reg method[] = {
+        {"clear",       clear_lua      },
+        {"ntuples",     ntuples_lua    },
+        {"nfields",     nfields_lua    },
+        {"fname",       fname_lua      },
+        {"ftype",       ftype_lua      },
+        {"fnumber",     fnumber_lua    },
+        {"is_spilled",  is_spilled_lua },
+        {"get_value",   get_value_lua  },
+        {"get_is_null", get_is_null_lua},
+        {"get_length",  get_length_lua },
+        {NULL,          NULL           }
+    };
+
+    libpq_register_mt(L, LIBPQ_SPILL_MT, mmethod, method);
+}
@@ -0,0 +1,221 @@
+/**
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ *  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+// lua
+#include "lua_libpq.h"
+
+/**
+ * the protocol tracer parses the lines that written by PQtrace through a
+ * custom stream, and keeps only the direction, length and type of the
+ * messages in a ring buffer.
+ *
+ * each line is formatted as follows;
+ *  [<timestamp>\t]<F|B>\t<length>\t<type>[\t<contents>...]\n
+ */
+
+#define TRACE_MAXTYPE 24
+
+typedef struct {
+    uint64_t at;
+    int length;
+    char direction;
+    char type[TRACE_MAXTYPE];
+} trace_record_t;
+
+struct libpq_trace_s {
+    FILE *fp;
+    // parser state
+    int field;
+    size_t toklen;
+    char tok[TRACE_MAXTYPE];
+    trace_record_t cur;
+    // ring buffer
+    uint64_t total;
+    trace_record_t *records;
+    int head;
+    int len;
+    int cap;
+};
+
+static inline uint64_t getusec(void)
+{
+    struct timeval tv = {0};
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+static void push_record(libpq_trace_t *t)
+{
+    if (t->len == t->cap) {
+        // overwrite the oldest record
+        t->head = (t->head + 1) % t->cap;
+        t->len--;
+    }
+    t->cur.at                               = getusec();
+    t->records[(t->head + t->len) % t->cap] = t->cur;
+    t->len++;
+    t->total++;
+}
+
+static void end_field(libpq_trace_t *t)
+{
+    t->tok[t->toklen] = 0;
+    switch (t->field) {
+    case 0:
+        // skip the timestamp field
+        if (t->toklen != 1 || (*t->tok != 'F' && *t->tok != 'B')) {
+            t->toklen = 0;
+            return;
+        }
+        t->cur.direction = *t->tok;
+        break;
+
+    case 1:
+        t->cur.length = atoi(t->tok);
+        break;
+
+    case 2:
+        memcpy(t->cur.type, t->tok, t->toklen + 1);
+        break;
+    }
+    t->field++;
+    t->toklen = 0;
+}
+
+static void parse(libpq_trace_t *t, const char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        switch (buf[i]) {
+        case '\n':
+            if (t->field < 3) {
+                end_field(t);
+            }
+            if (t->field >= 3) {
+                push_record(t);
+            }
+            t->field  = 0;
+            t->toklen = 0;
+            t->cur    = (trace_record_t){0};
+            break;
+
+        case '\t':
+            if (t->field < 3) {
+                end_field(t);
+            }
+            break;
+
+        default:
+            if (t->field < 3 && t->toklen < TRACE_MAXTYPE - 1) {
+                t->tok[t->toklen++] = buf[i];
+            }
+        }
+    }
+}
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) ||      \
+    defined(__OpenBSD__) || defined(__DragonFly__)
+
+static int write_bsd(void *cookie, const char *buf, int len)
+{
+    parse((libpq_trace_t *)cookie, buf, (size_t)len);
+    return len;
+}
+
+static inline FILE *open_stream(libpq_trace_t *t)
+{
+    return funopen(t, NULL, write_bsd, NULL, NULL);
+}
+
+#else
+
+static ssize_t write_gnu(void *cookie, const char *buf, size_t len)
+{
+    parse((libpq_trace_t *)cookie, buf, len);
+    return (ssize_t)len;
+}
+
+static inline FILE *open_stream(libpq_trace_t *t)
+{
+    return fopencookie(t, "w",
+                       (cookie_io_functions_t){
+                           .write = write_gnu,
+                       });
+}
+
+#endif
+
+libpq_trace_t *libpq_trace_new(int cap)
+{
+    libpq_trace_t *t = calloc(1, sizeof(libpq_trace_t));
+
+    if (!t) {
+        return NULL;
+    } else if (!(t->records = malloc(sizeof(trace_record_t) * cap))) {
+        free(t);
+        return NULL;
+    } else if (!(t->fp = open_stream(t))) {
+        free(t->records);
+        free(t);
+        return NULL;
+    }
+    t->cap = cap;
+    // flush each line to record the time of the message
+    setvbuf(t->fp, NULL, _IOLBF, BUFSIZ);
+    return t;
+}
+
+FILE *libpq_trace_file(libpq_trace_t *t)
+{
+    return t->fp;
+}
+
+void libpq_trace_free(libpq_trace_t *t)
+{
+    fclose(t->fp);
+    free(t->records);
+    free(t);
+}
+
+void libpq_trace_push(lua_State *L, libpq_trace_t *t, int n)
+{
+    int skip = (n > 0 && n < t->len) ? t->len - n : 0;
+
+    // push the last n records in order from oldest to newest
+    lua_createtable(L, t->len - skip, 0);
+    for (int i = skip; i < t->len; i++) {
+        trace_record_t *r = &t->records[(t->head + i) % t->cap];
+        char direction[2] = {r->direction, 0};
+
+        lua_createtable(L, 0, 4);
+        lauxh_pushnum2tbl(L, "time", (lua_Number)r->at / 1000000);
+        lauxh_pushstr2tbl(L, "direction", direction);
+        lauxh_pushint2tbl(L, "length", r->length);
+        lauxh_pushstr2tbl(L, "type", r->type);
+        lua_rawseti(L, -2, i - skip + 1);
+    }
+    // total number of the traced messages
+    lua_pushinteger(L, t->total);
+}
@@ -20,6 +20,7 @@
  *  DEALINGS IN THE SOFTWARE.
  */
 
+#include <errno.h>
 // lua
 #include "lua_libpq.h"
 
@@ -64,23 +65,320 @@ static int iterate_result_rows_lua(lua_State *L)
     return 3;
 }
 
+/**
+ * the string interning of the low-cardinality text columns. the distinct
+ * values of the column are pushed once and kept in the dictionary table,
+ * and the repeated values are pushed from the table without creating the
+ * lua strings again. the columns are chosen by the distinct count of the
+ * first INTERN_SAMPLE rows.
+ */
+#define INTERN_SAMPLE   256
+// the column is interned if each value is repeated this many times on
+// average in the sample
+#define INTERN_REPEAT   4
+#define INTERN_MAXVALUE 128
+#define INTERN_NBUCKET  256
+
+typedef struct {
+    const char *str;
+    size_t len;
+    uint32_t hash;
+    // index of the string in the dictionary table, or 0 if empty
+    int idx;
+} intern_slot_t;
+
+typedef struct {
+    int nvalue;
+    intern_slot_t slots[INTERN_NBUCKET];
+} intern_t;
+
+static inline uint32_t hash_bytes(const char *str, size_t len)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)str[i]) * 16777619u;
+    }
+    return h;
+}
+
+static intern_slot_t *intern_find(intern_t *in, const char *str, size_t len,
+                                  uint32_t hash)
+{
+    uint32_t mask = INTERN_NBUCKET - 1;
+    uint32_t i    = hash & mask;
+
+    for (; in->slots[i].idx; i = (i + 1) & mask) {
+        intern_slot_t *slot = &in->slots[i];
+        if (slot->hash == hash && slot->len == len &&
+            memcmp(slot->str, str, len) == 0) {
+            return slot;
+        }
+    }
+    // the empty slot
+    return &in->slots[i];
+}
+
+/**
+ * returns the interning table of the column if the values of the sample
+ * rows are repeated enough, otherwise NULL.
+ */
+static intern_t *intern_new(const PGresult *res, int col)
+{
+    int nsample   = PQntuples(res);
+    int ndistinct = 0;
+    intern_t *in  = NULL;
+
+    // the small results are not worth it, and the values in the binary
+    // format are pushed with the different length
+    if (nsample < INTERN_SAMPLE || PQfformat(res, col) != 0 ||
+        !(in = calloc(1, sizeof(intern_t)))) {
+        return NULL;
+    }
+    nsample = INTERN_SAMPLE;
+    for (int row = 0; row < nsample; row++) {
+        const char *str     = PQgetvalue(res, row, col);
+        size_t len          = (size_t)PQgetlength(res, row, col);
+        uint32_t hash       = 0;
+        intern_slot_t *slot = NULL;
+
+        if (PQgetisnull(res, row, col)) {
+            continue;
+        }
+        hash = hash_bytes(str, len);
+        slot = intern_find(in, str, len, hash);
+        if (!slot->idx) {
+            if (++ndistinct * INTERN_REPEAT > nsample) {
+                free(in);
+                return NULL;
+            }
+            *slot = (intern_slot_t){str, len, hash, -1};
+        }
+    }
+    memset(in->slots, 0, sizeof(in->slots));
+    return in;
+}
+
+/**
+ * returns the interning tables of the text columns, or NULL if no column is
+ * interned. the decoded columns that are not the text are skipped.
+ */
+static intern_t **intern_columns(const PGresult *res,
+                                 const libpq_columns_t *cols)
+{
+    int ncol        = PQnfields(res);
+    intern_t **list = calloc(ncol ? ncol : 1, sizeof(intern_t *));
+    int n           = 0;
+
+    if (!list) {
+        return NULL;
+    }
+    for (int col = 0; col < ncol; col++) {
+        if ((!cols || cols->cols[col].type == LIBPQ_COL_TEXT) &&
+            (list[col] = intern_new(res, col))) {
+            n++;
+        }
+    }
+    if (!n) {
+        free(list);
+        return NULL;
+    }
+    return list;
+}
+
+static void intern_free(intern_t **list, int ncol)
+{
+    if (list) {
+        for (int col = 0; col < ncol; col++) {
+            free(list[col]);
+        }
+        free(list);
+    }
+}
+
+/**
+ * pushes the string from the dictionary table at dict if it has been
+ * pushed, otherwise pushes the new string and adds it to the dictionary.
+ */
+static void push_interned(lua_State *L, intern_t *in, int dict, int *ndict,
+                          const char *str, size_t len)
+{
+    uint32_t hash       = hash_bytes(str, len);
+    intern_slot_t *slot = intern_find(in, str, len, hash);
+
+    if (slot->idx) {
+        lua_rawgeti(L, dict, slot->idx);
+        return;
+    }
+    lua_pushlstring(L, str, len);
+    // the rest of the distinct values are not interned
+    if (in->nvalue < INTERN_MAXVALUE) {
+        in->nvalue++;
+        *slot = (intern_slot_t){str, len, hash, ++*ndict};
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, dict, *ndict);
+    }
+}
+
+/**
+ * pushes the rows of the values that decoded into the lua types. the values
+ * of the columns that cannot be decoded are pushed as strings.
+ */
+static int push_decoded_rows(lua_State *L, const PGresult *res, int nthreads,
+                             int intern)
+{
+    libpq_columns_t *cols = libpq_columns_new(L, res, nthreads, 0);
+    intern_t **interns    = NULL;
+    int ndict             = 0;
+
+    if (!cols) {
+        lua_pushnil(L);
+        lua_errno_new(L, errno, "get_result_rows");
+        return 2;
+    } else if (intern && (interns = intern_columns(res, cols))) {
+        // the dictionary table of the interned strings
+        lua_newtable(L);
+    }
+
+    lua_createtable(L, cols->nrow, 0);
+    for (int row = 0; row < cols->nrow; row++) {
+        lua_createtable(L, cols->ncol, 0);
+        for (int col = 0; col < cols->ncol; col++) {
+            libpq_column_t *c = &cols->cols[col];
+
+            if (PQgetisnull(res, row, col)) {
+                continue;
+            }
+            switch (c->type) {
+            case LIBPQ_COL_BOOL:
+                lua_pushboolean(L, (((uint8_t *)c->values)[row >> 3] >>
+                                    (row & 7)) &
+                                       1);
+                break;
+            case LIBPQ_COL_INT64:
+                lua_pushinteger(L, ((int64_t *)c->values)[row]);
+                break;
+            case LIBPQ_COL_DOUBLE:
+                lua_pushnumber(L, ((double *)c->values)[row]);
+                break;
+            case LIBPQ_COL_TIMESTAMP:
+                // seconds since the epoch
+                lua_pushnumber(L,
+                               (lua_Number)((int64_t *)c->values)[row] / 1e6);
+                break;
+            default:
+                if (interns && interns[col]) {
+                    push_interned(L, interns[col], 3, &ndict,
+                                  PQgetvalue(res, row, col),
+                                  (size_t)PQgetlength(res, row, col));
+                } else {
+                    lua_pushlstring(L, PQgetvalue(res, row, col),
+                                    PQgetlength(res, row, col));
+                }
+            }
+            lua_rawseti(L, -2, col + 1);
+        }
+        lua_rawseti(L, -2, row + 1);
+    }
+    intern_free(interns, cols->ncol);
+    return 1;
+}
+
+/**
+ * copies the rows into the arena, and pushes the proxy of the rows instead
+ * of the tables.
+ */
+static int push_arena_rows(lua_State *L, const PGresult *res,
+                           libpq_arena_t *arena, int decode, int nthreads)
+{
+    libpq_columns_t cols = {
+        .nrow = PQntuples(res),
+        .ncol = PQnfields(res),
+    };
+    int eno = 0;
+
+    if (decode) {
+        if (!(cols.cols = calloc(cols.ncol ? cols.ncol : 1,
+                                 sizeof(libpq_column_t)))) {
+            eno = ENOMEM;
+        } else {
+            eno = libpq_columns_decode(&cols, res, nthreads, 0, NULL);
+        }
+    }
+    if (!eno && libpq_arena_push_rows(L, arena, res, decode ? &cols : NULL)) {
+        eno = errno;
+    }
+    libpq_columns_free(&cols);
+    if (eno) {
+        lua_pushnil(L);
+        lua_errno_new(L, eno, "get_result_rows");
+        return 2;
+    }
+    return 1;
+}
+
 static int get_result_rows_lua(lua_State *L)
 {
-    const PGresult *res = libpq_check_result(L);
-    int nrow            = PQntuples(res);
-    int ncol            = PQnfields(res);
+    const PGresult *res  = libpq_check_result(L);
+    int nrow             = PQntuples(res);
+    int ncol             = PQnfields(res);
+    int decode           = 0;
+    int intern           = 0;
+    lua_Integer nthreads = 1;
+    libpq_arena_t *arena = NULL;
+    intern_t **interns   = NULL;
+    int ndict            = 0;
 
+    if (!lua_isnoneornil(L, 2)) {
+        lauxh_checktable(L, 2);
+        lua_getfield(L, 2, "decode");
+        decode = lua_toboolean(L, -1);
+        lua_getfield(L, 2, "intern");
+        intern = lua_toboolean(L, -1);
+        lua_getfield(L, 2, "nthreads");
+        if (!lua_isnil(L, -1)) {
+            if (lua_type(L, -1) != LUA_TNUMBER ||
+                (nthreads = lua_tointeger(L, -1)) < 1 || nthreads > 256) {
+                return lauxh_argerror(L, 2, "nthreads must be integer "
+                                            "between 1 and 256");
+            }
+        }
+        lua_getfield(L, 2, "arena");
+        if (!lua_isnil(L, -1)) {
+            // the arena is kept at the index 2 while the rows are copied
+            lua_replace(L, 2);
+            arena = libpq_check_arena(L, 2);
+            lua_settop(L, 2);
+            return push_arena_rows(L, res, arena, decode, (int)nthreads);
+        }
+    }
     lua_settop(L, 1);
+    if (decode) {
+        return push_decoded_rows(L, res, (int)nthreads, intern);
+    } else if (intern && (interns = intern_columns(res, NULL))) {
+        // the dictionary table of the interned strings
+        lua_newtable(L);
+    }
+
     lua_createtable(L, nrow, 0);
     for (int row = 0; row < nrow; row++) {
         lua_createtable(L, ncol, 0);
         for (int col = 0; col < ncol; col++) {
-            if (!PQgetisnull(res, row, col)) {
+            if (PQgetisnull(res, row, col)) {
+                continue;
+            } else if (interns && interns[col]) {
+                push_interned(L, interns[col], 2, &ndict,
+                              PQgetvalue(res, row, col),
+                              (size_t)PQgetlength(res, row, col));
+                lua_rawseti(L, -2, col + 1);
+            } else {
                 lauxh_pushstr2arr(L, col + 1, PQgetvalue(res, row, col));
             }
         }
         lua_rawseti(L, -2, row + 1);
     }
+    intern_free(interns, ncol);
 
     return 1;
 }
@@ -106,24 +404,8 @@ static int get_result_stat_lua(lua_State *L)
             int nfields = PQnfields(res);
             lauxh_pushint2tbl(L, "nfields", nfields);
             lauxh_pushint2tbl(L, "binary_tuples", PQbinaryTuples(res));
-            lua_createtable(L, nfields, 0);
-            for (int col = 0; col < nfields; col++) {
-                char *fname = PQfname(res, col);
-                lua_createtable(L, 0, 8);
-                lauxh_pushint2tbl(L, "col", col + 1);
-                lauxh_pushstr2tbl(L, "name", fname);
-                lauxh_pushint2tbl(L, "table", PQftable(res, col));
-                lauxh_pushint2tbl(L, "tablecol", PQftablecol(res, col));
-                lauxh_pushint2tbl(L, "format", PQfformat(res, col));
-                lauxh_pushint2tbl(L, "type", PQftype(res, col));
-                lauxh_pushint2tbl(L, "size", PQfsize(res, col));
-                lauxh_pushint2tbl(L, "mod", PQfmod(res, col));
-                // index by column name
-                lua_pushvalue(L, -1);
-                lua_setfield(L, -3, fname);
-                // index by column number
-                lua_rawseti(L, -2, col + 1);
-            }
+            // the field descriptors are cached in the result
+            libpq_result_push_fields(L);
             lua_setfield(L, -2, "fields");
         }
     } // fallthrough
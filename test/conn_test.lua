@@ -1,4 +1,5 @@
 local testcase = require('testcase')
+local errno = require('errno')
 local libpq = require('libpq')
 
 local CONNINFO_KEYWORDS = {
@@ -416,6 +417,45 @@ function testcase.untrace()
     assert.is_nil(c:untrace())
 end
 
+function testcase.trace_buffer()
+    local c = assert(libpq.connect())
+
+    -- test that return empty list if trace buffer is not enabled
+    local list, total = c:trace_records()
+    assert.equal(list, {})
+    assert.equal(total, 0)
+
+    -- test that record the protocol messages into the buffer
+    assert(c:trace_buffer(4))
+    assert(c:exec('SELECT 1'))
+    list, total = c:trace_records()
+    assert.equal(#list, 4)
+    assert.greater_or_equal(total, 5)
+    assert.contains(list[#list], {
+        direction = 'B',
+        length = 5,
+        type = 'ReadyForQuery',
+    })
+    assert.is_number(list[#list].time)
+
+    -- test that return the last n records
+    list = c:trace_records(1)
+    assert.equal(#list, 1)
+    assert.equal(list[1].type, 'ReadyForQuery')
+
+    -- test that the file trace replaces the trace buffer
+    local f = assert(io.tmpfile())
+    assert.is_nil(c:trace(f))
+    assert.equal(c:trace_records(), {})
+    assert(c:trace_buffer())
+    assert.is_nil(c:untrace())
+    assert.equal(c:trace_records(), {})
+
+    -- test that throws an error if size is less than 1
+    local err = assert.throws(c.trace_buffer, c, 0)
+    assert.match(err, 'size must be greater than 0')
+end
+
 function testcase.set_trace_flags()
     local c = assert(libpq.connect())
     local f = assert(io.tmpfile())
@@ -425,11 +465,258 @@ function testcase.set_trace_flags()
     c:set_trace_flags(libpq.PQTRACE_SUPPRESS_TIMESTAMPS,
                       libpq.PQTRACE_REGRESS_MODE)
 
+    -- test that the flags are kept by the trace buffer
+    c:set_trace_flags(libpq.PQTRACE_REGRESS_MODE)
+    assert(c:trace_buffer())
+    assert(c:exec('SELECT 1'))
+    local list = c:trace_records()
+    assert.equal(list[#list].type, 'ReadyForQuery')
+    c:set_trace_flags()
+    assert(c:exec('SELECT 1'))
+    list = c:trace_records()
+    assert.equal(list[#list].type, 'ReadyForQuery')
+    c:untrace()
+
     -- test that throws an error if argument is not integer
     local err = assert.throws(c.set_trace_flags, c, {})
     assert.match(err, 'integer expected,')
 end
 
+function testcase.stats()
+    local c = assert(libpq.connect())
+
+    -- test that all counters are zero
+    local stats = c:stats()
+    assert.contains(stats, {
+        queries = 0,
+        results = 0,
+        rows = 0,
+        errors = 0,
+        bytes_sent = 0,
+        bytes_recv = 0,
+        first_result_time = 0,
+        total_time = 0,
+        pipeline_depth = 0,
+        pipeline_depth_max = 0,
+        errors_by_class = {},
+    })
+    assert.equal(#stats.first_result_hist, 24)
+    assert.equal(#stats.total_hist, 24)
+
+    -- test that count the queries and rows
+    assert(c:exec('SELECT * FROM generate_series(1, 10)'))
+    assert(c:exec_params('SELECT $1::int + $2::int', 1, 2))
+    stats = c:stats()
+    assert.contains(stats, {
+        queries = 2,
+        results = 2,
+        rows = 11,
+        errors = 0,
+        pipeline_depth = 0,
+        pipeline_depth_max = 1,
+    })
+    assert.greater(stats.bytes_sent, 0)
+    assert.greater(stats.bytes_recv, 0)
+    assert.greater(stats.total_time, 0)
+
+    -- test that count the errors by SQLSTATE class
+    assert(c:exec('SELECT * FROM unknown_table'))
+    stats = c:stats()
+    assert.equal(stats.errors, 1)
+    assert.equal(stats.errors_by_class, {
+        ['42'] = 1,
+    })
+
+    -- test that account the pipeline depth
+    assert(c:enter_pipeline_mode())
+    assert(c:send_query_params('SELECT 1'))
+    assert(c:send_query_params('SELECT 2'))
+    assert(c:send_query_params('SELECT 3'))
+    assert(c:pipeline_sync())
+    assert.equal(c:stats().pipeline_depth, 4)
+    for _ = 1, 3 do
+        assert(c:get_result())
+        assert.is_nil(c:get_result())
+    end
+    local res = assert(c:get_result())
+    assert.equal(res:status(), libpq.PGRES_PIPELINE_SYNC)
+    assert(c:exit_pipeline_mode())
+    stats = c:stats()
+    assert.contains(stats, {
+        queries = 6,
+        pipeline_depth = 0,
+        pipeline_depth_max = 4,
+    })
+
+    -- test that reset the counters
+    c:reset_stats()
+    assert.contains(c:stats(), {
+        queries = 0,
+        rows = 0,
+        errors = 0,
+        pipeline_depth_max = 0,
+        errors_by_class = {},
+    })
+end
+
+function testcase.result_memory()
+    local c = assert(libpq.connect())
+
+    -- test that return 0 if no results are alive
+    assert.equal({
+        c:result_memory(),
+    }, {
+        0,
+        0,
+    })
+
+    -- test that return the memory size of the live results
+    local res1 = assert(c:exec([[
+        SELECT repeat('x', 100) FROM generate_series(1, 1000)
+    ]]))
+    local res2 = assert(c:exec_params('SELECT $1::text', 'foo'))
+    assert.greater(res1:memory_size(), 100 * 1000)
+    assert.equal({
+        c:result_memory(),
+    }, {
+        res1:memory_size() + res2:memory_size(),
+        2,
+    })
+
+    -- test that the memory is released by clear
+    res1:clear()
+    assert.equal({
+        c:result_memory(),
+    }, {
+        res2:memory_size(),
+        1,
+    })
+    res2:clear()
+    assert.equal({
+        c:result_memory(),
+    }, {
+        0,
+        0,
+    })
+end
+
+function testcase.set_slowlog()
+    local c = assert(libpq.connect())
+
+    -- test that return empty list if slowlog is disabled
+    assert(c:exec('SELECT pg_sleep(0.1)'))
+    local list, ndropped = c:slowlog()
+    assert.equal(list, {})
+    assert.equal(ndropped, 0)
+
+    -- test that record the queries that exceed the threshold
+    assert(c:set_slowlog(50, 2))
+    assert(c:exec('SELECT 1'))
+    assert(c:exec_params('SELECT pg_sleep($1), $2', 0.1, 'foo'))
+    list, ndropped = c:slowlog()
+    assert.equal(#list, 1)
+    assert.contains(list[1], {
+        sql = 'SELECT pg_sleep($1), $2',
+        truncated = false,
+        nparams = 2,
+        rows = 1,
+    })
+    assert.greater_or_equal(list[1].elapsed, 0.05)
+    assert.is_int(list[1].time)
+    assert.equal(ndropped, 0)
+
+    -- test that entries are removed after read
+    assert.equal(c:slowlog(), {})
+
+    -- test that record the async queries and truncate the query text
+    local sql = 'SELECT pg_sleep(0.1) /* ' .. string.rep('x', 300) .. ' */'
+    assert(c:send_query(sql))
+    while c:get_result() do
+    end
+    list = c:slowlog()
+    assert.equal(#list, 1)
+    assert.equal(list[1].sql, string.sub(sql, 1, 256))
+    assert.is_true(list[1].truncated)
+
+    -- test that the oldest entries are overwritten
+    for _ = 1, 3 do
+        assert(c:exec('SELECT pg_sleep(0.06)'))
+    end
+    list, ndropped = c:slowlog()
+    assert.equal(#list, 2)
+    assert.equal(ndropped, 1)
+
+    -- test that disable the slowlog
+    assert(c:set_slowlog())
+    assert(c:exec('SELECT pg_sleep(0.1)'))
+    assert.equal(c:slowlog(), {})
+
+    -- test that throws an error if size is less than 1
+    local err = assert.throws(c.set_slowlog, c, 10, 0)
+    assert.match(err, 'size must be greater than 0')
+end
+
+function testcase.set_result_format()
+    local c = assert(libpq.connect())
+
+    -- test that set the result format of exec_params
+    assert.equal(c:result_format(), 0)
+    assert.equal(c:set_result_format(1), 0)
+    assert.equal(c:result_format(), 1)
+    local res = assert(c:exec_params('SELECT $1::int4', 1))
+    assert.equal(res:fformat(1), 1)
+    assert.equal(res:get_value(1, 1), '\0\0\0\1')
+
+    -- test that set the text format by default
+    assert.equal(c:set_result_format(), 1)
+    res = assert(c:exec_params('SELECT $1::int4', 1))
+    assert.equal(res:fformat(1), 0)
+    assert.equal(res:get_value(1, 1), '1')
+
+    -- test that throws an error if format is invalid
+    local err = assert.throws(c.set_result_format, c, 2)
+    assert.match(err, 'format must be 0')
+end
+
+function testcase.set_query_timeout()
+    local c = assert(libpq.connect())
+
+    -- test that set query timeout and return the previous value
+    assert.equal(c:query_timeout(), 0)
+    assert.equal(c:set_query_timeout(100), 0)
+    assert.equal(c:query_timeout(), 100)
+
+    -- test that exec returns ETIMEDOUT error if timed out
+    local res, err = c:exec('SELECT pg_sleep(1)')
+    assert.is_nil(res)
+    assert.equal(err.type, errno.ETIMEDOUT)
+
+    -- test that exec_params returns ETIMEDOUT error if timed out
+    res, err = c:exec_params('SELECT pg_sleep($1)', 1)
+    assert.is_nil(res)
+    assert.equal(err.type, errno.ETIMEDOUT)
+
+    -- test that get_result returns ETIMEDOUT error if timed out
+    assert(c:send_query('SELECT pg_sleep(1)'))
+    res, err = c:get_result()
+    assert.is_nil(res)
+    assert.equal(err.type, errno.ETIMEDOUT)
+
+    -- test that connection can be used after timed out
+    res = assert(c:exec('SELECT 1 + 2'))
+    assert.equal(res:get_value(1, 1), '3')
+    res = assert(c:exec_params('SELECT $1 + $2', 1, 2))
+    assert.equal(res:get_value(1, 1), '3')
+
+    -- test that disable query timeout
+    assert.equal(c:set_query_timeout(), 100)
+    assert.equal(c:query_timeout(), 0)
+
+    -- test that throws an error if argument is not positive integer
+    err = assert.throws(c.set_query_timeout, c, -1)
+    assert.match(err, 'integer expected,')
+end
+
 function testcase.exec()
     local c = assert(libpq.connect())
 
@@ -463,6 +750,463 @@ function testcase.exec_params()
     assert.match(err, '<table> param is not supported')
 end
 
+function testcase.exec_params_cached()
+    local c = assert(libpq.connect())
+    local listener = assert(libpq.connect())
+    local sql = 'SELECT count(*) FROM test_tbl WHERE id > $1'
+
+    -- test that works as exec_params if the cache is disabled
+    local res = assert(c:exec_params_cached(nil, 'SELECT $1::text', 'foo'))
+    assert.equal(res:get_value(1, 1), 'foo')
+    assert.is_nil(c:result_cache_stat())
+
+    -- test that enable the result cache
+    assert(c:set_result_cache(1024 * 1024))
+    assert(c:exec('CREATE TEMP TABLE test_tbl (id integer)'))
+    assert(c:exec('INSERT INTO test_tbl VALUES (1)'))
+    res = assert(c:exec_params_cached('test_tbl', sql, 0))
+    assert.equal(res:get_value(1, 1), '1')
+
+    -- test that return the cached result
+    assert(c:exec('INSERT INTO test_tbl VALUES (2)'))
+    res = assert(c:exec_params_cached('test_tbl', sql, 0))
+    assert.equal(res:status(), libpq.PGRES_TUPLES_OK)
+    assert.equal(res:get_value(1, 1), '1')
+    assert.equal(res:connection(), c)
+    assert.contains(c:result_cache_stat(), {
+        entries = 1,
+        hits = 1,
+        misses = 1,
+    })
+
+    -- test that the parameters are part of the cache key
+    res = assert(c:exec_params_cached('test_tbl', sql, -1))
+    assert.equal(res:get_value(1, 1), '2')
+
+    -- test that the entries are invalidated by the notification
+    assert(c:exec('LISTEN test_tbl'))
+    assert(listener:exec('NOTIFY test_tbl'))
+    assert(c:exec('SELECT pg_sleep(0.1)'))
+    res = assert(c:exec_params_cached('test_tbl', sql, 0))
+    assert.equal(res:get_value(1, 1), '2')
+    assert.contains(c:result_cache_stat(), {
+        entries = 1,
+        invalidations = 2,
+    })
+    -- test that the notification can be received after the invalidation
+    local notify = assert(c:notifies())
+    assert.equal(notify.relname, 'test_tbl')
+    assert.is_nil(c:notifies())
+
+    -- test that invalidate all entries
+    c:invalidate_result_cache()
+    assert.contains(c:result_cache_stat(), {
+        entries = 0,
+        bytes = 0,
+    })
+
+    -- test that the entries are expired after the ttl
+    assert(c:set_result_cache(1024 * 1024, 50))
+    res = assert(c:exec_params_cached(nil, sql, 0))
+    assert(c:exec('INSERT INTO test_tbl VALUES (3)'))
+    assert(c:exec('SELECT pg_sleep(0.1)'))
+    res = assert(c:exec_params_cached(nil, sql, 0))
+    assert.equal(res:get_value(1, 1), '3')
+
+    -- test that the result that is not PGRES_TUPLES_OK is not cached
+    res = assert(c:exec_params_cached(nil, 'SELECT * FROM unknown_tbl'))
+    assert.equal(res:status(), libpq.PGRES_FATAL_ERROR)
+    assert.equal(c:result_cache_stat().entries, 1)
+
+    -- test that disable the result cache
+    assert(c:set_result_cache(0))
+    assert.is_nil(c:result_cache_stat())
+
+    -- test that throws an error if max_bytes is negative
+    local err = assert.throws(c.set_result_cache, c, -1)
+    assert.match(err, 'max_bytes must be greater than or equal to 0')
+end
+
+function testcase.insert_batcher()
+    local c = assert(libpq.connect())
+    local res = assert(c:exec([[
+        CREATE TEMP TABLE batch_test (
+            id integer PRIMARY KEY,
+            str text
+        )
+    ]]))
+    assert.equal(res:status(), libpq.PGRES_COMMAND_OK)
+
+    -- test that buffer the rows until max_rows is reached
+    local b = assert(c:insert_batcher('INSERT INTO batch_test (id, str) VALUES',
+                                      2, nil, 3))
+    assert.equal(b:conn(), c)
+    assert.is_true(b:add(1, 'foo'))
+    assert.is_true(b:add(2))
+    assert.equal({
+        b:pending(),
+    }, {
+        2,
+        8,
+    })
+    res = assert(b:add(3, true))
+    assert.equal(res:status(), libpq.PGRES_COMMAND_OK)
+    assert.equal(res:cmd_tuples(), 3)
+    assert.equal(b:pending(), 0)
+
+    -- test that flush the rest of rows
+    assert.is_true(b:add(4, 'bar'))
+    res = assert(b:flush())
+    assert.equal(res:cmd_tuples(), 1)
+    assert.is_true(b:flush())
+
+    -- test that reuse the prepared statement for a full batch
+    for i = 5, 10 do
+        res = assert(b:add(i, 'baz'))
+    end
+    assert.equal(res:status(), libpq.PGRES_COMMAND_OK)
+    assert.contains(b:stat(), {
+        flushes = 4,
+        rows = 10,
+        prepared_flushes = 3,
+    })
+
+    -- test that the batcher of the same shape reuses the prepared statement
+    local SQL_STMTS = 'SELECT * FROM pg_prepared_statements'
+    local nstmt = assert(c:exec(SQL_STMTS)):ntuples()
+    b = assert(c:insert_batcher('INSERT INTO batch_test (id, str) VALUES', 2,
+                                nil, 3))
+    for i = 11, 13 do
+        res = assert(b:add(i, 'baz'))
+    end
+    assert.equal(res:cmd_tuples(), 3)
+    assert.equal(b:stat().prepared_flushes, 1)
+    assert.equal(assert(c:exec(SQL_STMTS)):ntuples(), nstmt)
+    res = assert(c:exec('SELECT * FROM batch_test ORDER BY id LIMIT 4'))
+    assert.equal(libpq.util.get_result_rows(res), {
+        {
+            '1',
+            'foo',
+        },
+        {
+            '2',
+        },
+        {
+            '3',
+            'TRUE',
+        },
+        {
+            '4',
+            'bar',
+        },
+    })
+
+    -- test that append the suffix and flush by max_bytes
+    local upsert = 'ON CONFLICT (id) DO UPDATE SET str = EXCLUDED.str'
+    b = assert(c:insert_batcher('INSERT INTO batch_test (id, str) VALUES', 2,
+                                upsert, 100, 10))
+    assert.is_true(b:add(1, 'qux'))
+    res = assert(b:add(2, 'quux'))
+    assert.equal(res:cmd_tuples(), 2)
+    res = assert(c:exec('SELECT str FROM batch_test WHERE id <= 2 ORDER BY id'))
+    assert.equal(libpq.util.get_result_rows(res), {
+        {
+            'qux',
+        },
+        {
+            'quux',
+        },
+    })
+
+    -- test that max_rows is clamped by the parameter limit
+    b = assert(c:insert_batcher('INSERT INTO batch_test VALUES', 2, nil,
+                                100000))
+    assert.equal(b:stat().max_rows, 32767)
+
+    -- test that return the error result of the server
+    assert.is_true(b:add(1, 'dup'))
+    res = assert(b:flush())
+    assert.equal(res:status(), libpq.PGRES_FATAL_ERROR)
+
+    -- test that throws an error if too many values are passed
+    local err = assert.throws(b.add, b, 1, 'foo', 'bar')
+    assert.match(err, 'at most 2 values expected')
+
+    -- test that throws an error if ncol is out of range
+    err = assert.throws(c.insert_batcher, c, 'INSERT INTO batch_test VALUES',
+                        0)
+    assert.match(err, 'ncol must be in the range of 1 to 65535')
+end
+
+function testcase.exec_prepared()
+    local c = assert(libpq.connect())
+
+    -- test that prepare and execute the statement
+    local res = assert(c:prepare('stmt1', 'SELECT $1::int + $2::int'))
+    assert.equal(res:status(), libpq.PGRES_COMMAND_OK)
+    res = assert(c:exec_prepared('stmt1', 1, '2'))
+    assert.equal(res:status(), libpq.PGRES_TUPLES_OK)
+    assert.equal(res:get_value(1, 1), '3')
+    -- the parameter types are not cached because they are inferred
+    assert.is_nil(c:param_types('stmt1'))
+
+    -- test that the parameter types are cached if all of them are specified
+    assert(c:prepare('stmt2', 'SELECT $1 || $2', 25, 25))
+    assert.equal(c:param_types('stmt2'), {
+        25,
+        25,
+    })
+
+    -- test that return the error result
+    res = assert(c:prepare('stmt3', 'SELECT * FROM unknown_tbl'))
+    assert.equal(res:status(), libpq.PGRES_FATAL_ERROR)
+    res = assert(c:exec_prepared('unknown_stmt'))
+    assert.equal(res:status(), libpq.PGRES_FATAL_ERROR)
+
+    -- test that throws an error if the type is not integer
+    local err = assert.throws(c.prepare, c, 'stmt4', 'SELECT $1', 'int')
+    assert.match(err, 'integer expected')
+end
+
+function testcase.describe_prepared()
+    local c = assert(libpq.connect())
+    assert(c:prepare('stmt1', [[
+        SELECT $1::int2 AS a, $2::int4 AS b, $3::int8 AS c, $4::float4 AS d,
+               $5::float8 AS e, $6::bool AS f, $7::oid AS g, $8::text AS h
+    ]]))
+
+    -- test that describe the prepared statement and cache the types
+    local res = assert(c:describe_prepared('stmt1'))
+    assert.equal(res:status(), libpq.PGRES_COMMAND_OK)
+    assert.equal(res:nparams(), 8)
+    assert.equal(res:param_type(0), 21)
+    assert.equal(res:nfields(), 8)
+    assert.equal(c:param_types('stmt1'), {
+        21,
+        23,
+        20,
+        700,
+        701,
+        16,
+        26,
+        25,
+    })
+
+    -- test that the parameters are sent in the binary format of the types
+    res = assert(c:exec_prepared('stmt1', -32768, 2147483647,
+                                 -9007199254740992, 1.5, 0.1, true,
+                                 4294967295, 'foo'))
+    assert.equal(libpq.util.get_result_rows(res), {
+        {
+            '-32768',
+            '2147483647',
+            '-9007199254740992',
+            '1.5',
+            '0.1',
+            't',
+            '4294967295',
+            'foo',
+        },
+    })
+
+    -- test that the values that cannot be encoded are sent as text
+    res = assert(c:exec_prepared('stmt1', '1', 1.5, nil, '2.5', 'NaN', 'yes',
+                                 '26', 1))
+    assert.equal(res:status(), libpq.PGRES_FATAL_ERROR)
+    res = assert(c:exec_prepared('stmt1', '1', 2, '3', '2.5', 'NaN', 'yes',
+                                 '26', 1))
+    assert.equal(libpq.util.get_result_rows(res), {
+        {
+            '1',
+            '2',
+            '3',
+            '2.5',
+            'NaN',
+            't',
+            '26',
+            '1',
+        },
+    })
+
+    -- test that send the describe request
+    assert.is_true(c:send_describe_prepared('stmt1'))
+    res = assert(c:get_result())
+    assert.equal(res:nparams(), 8)
+    assert.is_nil(c:get_result())
+
+    -- test that send the prepared statement
+    assert.is_true(c:send_prepare('stmt2', 'SELECT $1', 23))
+    assert(c:get_result())
+    assert.is_nil(c:get_result())
+    -- test that the types are not cached until the statement is described
+    assert.is_nil(c:param_types('stmt2'))
+    assert.is_true(c:send_prepare('stmt2', 'SELECT $1', 25))
+    res = assert(c:get_result())
+    assert.equal(res:status(), libpq.PGRES_FATAL_ERROR)
+    assert.is_nil(c:get_result())
+    assert.is_nil(c:param_types('stmt2'))
+    assert.is_true(c:send_query_prepared('stmt2', 42))
+    res = assert(c:get_result())
+    assert.equal(res:get_value(1, 1), '42')
+    assert.is_nil(c:get_result())
+
+    -- test that clear the cached types
+    c:clear_param_types('stmt2')
+    assert.is_nil(c:param_types('stmt2'))
+    c:clear_param_types()
+    assert.is_nil(c:param_types('stmt1'))
+
+    -- test that describe the portal
+    assert(c:exec('BEGIN'))
+    assert(c:exec('DECLARE cur CURSOR FOR SELECT 1 AS a, 2 AS b'))
+    res = assert(c:describe_portal('cur'))
+    assert.equal(res:nfields(), 2)
+    assert.equal(res:fname(2), 'b')
+    assert.is_true(c:send_describe_portal('cur'))
+    res = assert(c:get_result())
+    assert.equal(res:nfields(), 2)
+    assert.is_nil(c:get_result())
+    assert(c:exec('COMMIT'))
+
+    -- test that return the error result of the unknown statement
+    res = assert(c:describe_prepared('unknown_stmt'))
+    assert.equal(res:status(), libpq.PGRES_FATAL_ERROR)
+end
+
+function testcase.transaction()
+    local c = assert(libpq.connect())
+    assert(c:exec('CREATE TEMP TABLE txn_test (id integer)'))
+
+    -- test that commit the transaction and return the values of function
+    local ok, a, b = c:transaction(function(conn)
+        assert.equal(conn, c)
+        local res = assert(conn:exec_params(
+                               'INSERT INTO txn_test VALUES ($1) RETURNING id',
+                               1))
+        assert.equal(res:get_value(1, 1), '1')
+        assert.equal(conn:transaction_status(), libpq.PQTRANS_INTRANS)
+        assert(conn:exec('INSERT INTO txn_test VALUES (2)'))
+        return 'foo', 'bar'
+    end)
+    assert.is_true(ok)
+    assert.equal(a, 'foo')
+    assert.equal(b, 'bar')
+    assert.equal(c:transaction_status(), libpq.PQTRANS_IDLE)
+    local res = assert(c:exec('SELECT count(*) FROM txn_test'))
+    assert.equal(res:get_value(1, 1), '2')
+
+    -- test that BEGIN is sent with the first query by exec
+    assert(c:transaction(function(conn)
+        res = assert(conn:exec('SHOW transaction_isolation'))
+        assert.equal(res:get_value(1, 1), 'serializable')
+        res = assert(conn:exec('SHOW transaction_read_only'))
+        assert.equal(res:get_value(1, 1), 'on')
+    end, {
+        isolation = 'serializable',
+        read_only = true,
+    }))
+
+    -- test that nothing is sent if the function does not execute a query
+    local stats = c:stats()
+    assert.is_true(c:transaction(function()
+    end))
+    assert.equal(c:stats().queries, stats.queries)
+
+    -- test that rollback the transaction if the function throws an error
+    local err
+    ok, err = c:transaction(function(conn)
+        assert(conn:exec('INSERT INTO txn_test VALUES (3)'))
+        error('test error')
+    end)
+    assert.is_false(ok)
+    assert.match(err, 'test error')
+    assert.equal(c:transaction_status(), libpq.PQTRANS_IDLE)
+    res = assert(c:exec('SELECT count(*) FROM txn_test'))
+    assert.equal(res:get_value(1, 1), '2')
+
+    -- test that BEGIN is sent again if the server rejected the first query
+    ok = c:transaction(function(conn)
+        res = assert(conn:exec('INSER INTO txn_test VALUES (3)'))
+        assert.equal(res:status(), libpq.PGRES_FATAL_ERROR)
+        assert.equal(conn:transaction_status(), libpq.PQTRANS_IDLE)
+        assert(conn:exec_params('INSERT INTO txn_test VALUES ($1)', 3))
+        assert.equal(conn:transaction_status(), libpq.PQTRANS_INTRANS)
+        error('test error')
+    end)
+    assert.is_false(ok)
+    res = assert(c:exec('SELECT count(*) FROM txn_test'))
+    assert.equal(res:get_value(1, 1), '2')
+
+    -- test that fail if the function ends the transaction
+    ok, err = c:transaction(function(conn)
+        assert(conn:exec('INSERT INTO txn_test VALUES (3)'))
+        assert(conn:exec('COMMIT'))
+        assert(conn:exec('DELETE FROM txn_test WHERE id = 3'))
+    end)
+    assert.is_false(ok)
+    assert.match(err, 'transaction has been ended by the function')
+    assert.equal(c:transaction_status(), libpq.PQTRANS_IDLE)
+
+    -- test that retry the transaction on serialization failure
+    local fail = [[
+        DO $$ BEGIN
+            RAISE 'test failure' USING ERRCODE = '40001';
+        END $$
+    ]]
+    local attempts = 0
+    stats = c:stats()
+    ok = c:transaction(function(conn)
+        attempts = attempts + 1
+        assert(conn:exec('INSERT INTO txn_test VALUES (4)'))
+        if attempts < 3 then
+            res = assert(conn:exec(fail))
+            assert.equal(res:status(), libpq.PGRES_FATAL_ERROR)
+        end
+    end, {
+        backoff = 1,
+    })
+    assert.is_true(ok)
+    assert.equal(attempts, 3)
+    assert.equal(c:stats().transaction_retries, stats.transaction_retries + 2)
+    res = assert(c:exec('SELECT count(*) FROM txn_test WHERE id = 4'))
+    assert.equal(res:get_value(1, 1), '1')
+
+    -- test that give up after the retries
+    attempts = 0
+    ok, err = c:transaction(function(conn)
+        attempts = attempts + 1
+        assert(conn:exec(fail))
+    end, {
+        retries = 1,
+        backoff = 1,
+    })
+    assert.is_false(ok)
+    assert.match(err, 'rolled back')
+    assert.equal(attempts, 2)
+    assert.equal(c:stats().transaction_failures, stats.transaction_failures + 1)
+
+    -- test that cannot be nested
+    ok = c:transaction(function(conn)
+        local nested_ok, nested_err = conn:transaction(function()
+        end)
+        assert.is_false(nested_ok)
+        assert.match(nested_err, 'already in progress')
+    end)
+    assert.is_true(ok)
+
+    -- test that throws an error if the option is invalid
+    err = assert.throws(c.transaction, c, function()
+    end, {
+        isolation = 'unknown',
+    })
+    assert.match(err, 'opts.isolation must be one of')
+    err = assert.throws(c.transaction, c, function()
+    end, {
+        retries = -1,
+    })
+    assert.match(err, 'opts.retries must be integer')
+end
+
 function testcase.send_query()
     local c = assert(libpq.connect())
 
@@ -514,6 +1258,101 @@ function testcase.get_result()
     assert.match(res, '^libpq.result: ', false)
 end
 
+function testcase.write_arrow()
+    local c = assert(libpq.connect())
+    local f = assert(io.tmpfile())
+
+    -- test that write the rows in the arrow IPC stream format
+    assert.equal(c:write_arrow([[
+        SELECT i AS id, 'v' || i AS name FROM generate_series(1, 10) AS i
+    ]], f, 4), 10)
+    f:seek('set')
+    local data = f:read('*a')
+    f:close()
+    assert.equal(data:sub(1, 4), '\255\255\255\255')
+    assert.equal(data:sub(-8), '\255\255\255\255\0\0\0\0')
+    assert.match(data, 'name')
+
+    -- test that the rows are written in the batches of batch_rows rows
+    local _, n = data:gsub('\255\255\255\255', '')
+    -- schema, 3 batches and end-of-stream
+    assert.equal(n, 5)
+
+    -- test that write only the schema if no row is returned
+    f = assert(io.tmpfile())
+    assert.equal(c:write_arrow('SELECT 1 AS id WHERE false', f), 0)
+    f:seek('set')
+    data = f:read('*a')
+    f:close()
+    _, n = data:gsub('\255\255\255\255', '')
+    assert.equal(n, 2)
+
+    -- test that return the error of the query
+    f = assert(io.tmpfile())
+    local res, err = c:write_arrow('SELECT * FROM unknown_table', f)
+    assert.is_nil(res)
+    assert.match(err, 'unknown_table')
+
+    -- test that throws an error if batch_rows is less than 1
+    err = assert.throws(c.write_arrow, c, 'SELECT 1', f, 0)
+    assert.match(err, 'batch_rows must be greater than 0')
+    f:close()
+end
+
+function testcase.exec_spill()
+    local c = assert(libpq.connect())
+    local sql = [[
+        SELECT i AS id, CASE WHEN i % 3 = 0 THEN NULL ELSE repeat('x', i) END
+        FROM generate_series(1, 1000) AS i
+    ]]
+
+    -- test that keep the rows in memory under the threshold
+    local s = assert(c:exec_spill(sql))
+    assert.match(tostring(s), '^libpq.spill: ')
+    assert.is_false(s:is_spilled())
+    assert.equal(s:ntuples(), 1000)
+    assert.equal(s:nfields(), 2)
+    assert.equal(s:fname(1), 'id')
+    assert.equal(s:fnumber('id'), 1)
+    assert.equal(s:get_value(10, 'id'), '10')
+    s:clear()
+
+    -- test that spill the rows to the file over the threshold
+    s = assert(c:exec_spill(sql, 1024))
+    assert.is_true(s:is_spilled())
+    assert.equal(s:ntuples(), 1000)
+    for _, row in ipairs({
+        1000,
+        1,
+        500,
+        501,
+        3,
+    }) do
+        assert.equal(s:get_value(row, 1), tostring(row))
+        if row % 3 == 0 then
+            assert.is_nil(s:get_value(row, 2))
+            assert.is_true(s:get_is_null(row, 2))
+        else
+            assert.equal(s:get_value(row, 2), string.rep('x', row))
+            assert.equal(s:get_length(row, 2), row)
+        end
+    end
+
+    -- test that return nil if out of range
+    assert.is_nil(s:get_value(1001, 1))
+    assert.is_nil(s:get_value(1, 3))
+    s:clear()
+
+    -- test that cannot use the cleared object
+    local err = assert.throws(s.ntuples, s)
+    assert.match(err, 'attempt to use a freed object')
+
+    -- test that return the error of the query
+    s, err = c:exec_spill('SELECT * FROM unknown_table')
+    assert.is_nil(s)
+    assert.match(err, 'unknown_table')
+end
+
 function testcase.is_busy()
     local c = assert(libpq.connect())
 
@@ -664,6 +1503,119 @@ function testcase.put_copy_data()
     })
 end
 
+function testcase.put_copy_rows()
+    local c = assert(libpq.connect())
+    local res = assert(c:exec([[
+        CREATE TEMP TABLE copy_test (
+            id integer,
+            str text,
+            flag boolean
+        )
+    ]]))
+    assert.equal(res:status(), libpq.PGRES_COMMAND_OK)
+    local long = string.rep('a\tb\nc\rd\\e', 100)
+
+    -- test that encode the rows into the COPY text format
+    res = assert(c:exec('COPY copy_test FROM STDIN'))
+    assert.equal(res:status(), libpq.PGRES_COPY_IN)
+    assert(c:put_copy_rows({
+        {
+            1,
+            'foo\tbar',
+            true,
+        },
+        {
+            2,
+            'back\\slash\nnewline\rreturn',
+            false,
+        },
+        {
+            3,
+            long,
+        },
+    }, 3))
+    -- test that the number of columns is the length of each row
+    assert(c:put_copy_rows({
+        {
+            4,
+            '\\N',
+            true,
+        },
+    }))
+    assert(c:put_copy_end())
+    res = assert(c:get_result())
+    assert.equal(res:status(), libpq.PGRES_COMMAND_OK)
+    assert.equal(res:cmd_tuples(), 4)
+
+    res = assert(c:exec('SELECT * FROM copy_test ORDER BY id'))
+    assert.equal(libpq.util.get_result_rows(res), {
+        {
+            '1',
+            'foo\tbar',
+            't',
+        },
+        {
+            '2',
+            'back\\slash\nnewline\rreturn',
+            'f',
+        },
+        {
+            '3',
+            long,
+        },
+        {
+            '4',
+            '\\N',
+            't',
+        },
+    })
+
+    -- test that decode the COPY text format into the table
+    res = assert(c:exec('COPY copy_test TO STDOUT'))
+    assert.equal(res:status(), libpq.PGRES_COPY_OUT)
+    local rows = {}
+    local row, ncol = c:get_copy_row(false, {})
+    while row do
+        assert.equal(ncol, 3)
+        rows[#rows + 1] = row
+        row, ncol = c:get_copy_row()
+    end
+    assert.equal(rows, {
+        {
+            '1',
+            'foo\tbar',
+            't',
+        },
+        {
+            '2',
+            'back\\slash\nnewline\rreturn',
+            'f',
+        },
+        {
+            '3',
+            long,
+        },
+        {
+            '4',
+            '\\N',
+            't',
+        },
+    })
+    res = assert(c:get_result())
+    assert.equal(res:status(), libpq.PGRES_COMMAND_OK)
+
+    -- test that throws an error if value is not supported
+    res = assert(c:exec('COPY copy_test FROM STDIN'))
+    assert.equal(res:status(), libpq.PGRES_COPY_IN)
+    local err = assert.throws(c.put_copy_rows, c, {
+        {
+            {},
+        },
+    })
+    assert.match(err, '<table> is not supported')
+    assert(c:put_copy_end('abort'))
+end
+
 function testcase.set_nonblocking()
     local c = assert(libpq.connect())
 
@@ -730,6 +1682,52 @@ function testcase.escape_identifier()
     assert.equal(str, '"hello_world"')
 end
 
+function testcase.escape_literals()
+    local c = assert(libpq.connect())
+
+    -- test that escape the values and join them with the separator
+    local str = assert(c:escape_literals({
+        "t' OR 't' = 't",
+        'back\\slash',
+        123,
+        true,
+    }))
+    assert.equal(str, [['t'' OR ''t'' = ''t', 'back\slash', '123', 'TRUE']])
+    assert.equal(c:escape_literals({
+        'foo',
+        'bar',
+    }, ','), "'foo','bar'")
+
+    -- test that the escaped values are evaluated as the original values
+    local res = assert(c:exec('SELECT ' .. str))
+    assert.equal(libpq.util.get_result_rows(res), {
+        {
+            "t' OR 't' = 't",
+            'back\\slash',
+            '123',
+            'TRUE',
+        },
+    })
+
+    -- test that return an empty string if no values
+    assert.equal(c:escape_literals({}), '')
+end
+
+function testcase.escape_identifiers()
+    local c = assert(libpq.connect())
+
+    -- test that escape the values and join them with the separator
+    local str = assert(c:escape_identifiers({
+        'hello_world',
+        'quote"d',
+    }))
+    assert.equal(str, '"hello_world", "quote""d"')
+    assert.equal(c:escape_identifiers({
+        'foo',
+        'bar',
+    }, '.'), '"foo"."bar"')
+end
+
 function testcase.escape_bytea_conn()
     local c = assert(libpq.connect())
 
@@ -763,3 +1761,70 @@ function testcase.encrypt_password_conn()
     assert.match(err, 'unrecognized password encryption algorithm')
 end
 
+
+function testcase.large_object()
+    local c = assert(libpq.connect())
+    assert(c:exec('BEGIN'))
+
+    -- test that create a large object and open it
+    local oid = assert(c:lo_creat())
+    local fd = assert(c:lo_open(oid, libpq.INV_READ + libpq.INV_WRITE))
+
+    -- test that read and write the large object
+    assert.equal(c:lo_write(fd, 'hello world'), 11)
+    assert.equal(c:lo_tell64(fd), 11)
+    assert.equal(c:lo_lseek64(fd, 6), 6)
+    assert.equal(c:lo_read(fd, 100), 'world')
+    assert.equal(c:lo_read(fd), '')
+    assert.equal(c:lo_lseek64(fd, -5, libpq.SEEK_END), 6)
+    assert(c:lo_truncate64(fd, 5))
+    assert.equal(c:lo_lseek64(fd, 0, libpq.SEEK_END), 5)
+
+    -- test that copy the large object to the file
+    local f = assert(io.tmpfile())
+    assert.equal(c:lo_lseek64(fd, 0), 0)
+    assert.equal(c:lo_copy_to_file(fd, f), 5)
+    f:seek('set')
+    assert.equal(f:read('*a'), 'hello')
+    f:close()
+
+    -- test that copy the file to the large object in chunks
+    local data = string.rep('0123456789', 30000)
+    f = assert(io.tmpfile())
+    f:write(data)
+    f:seek('set')
+    assert(c:lo_truncate64(fd, 0))
+    assert.equal(c:lo_lseek64(fd, 0), 0)
+    assert.equal(c:lo_copy_from_file(fd, f), #data)
+    assert.equal(c:lo_lseek64(fd, 0), 0)
+    assert.equal(c:lo_read(fd, #data + 1), data)
+
+    -- test that copy the specified number of bytes
+    f:seek('set')
+    assert.equal(c:lo_lseek64(fd, 0), 0)
+    assert.equal(c:lo_copy_from_file(fd, f, 3), 3)
+    assert.equal(c:lo_lseek64(fd, 0), 0)
+    assert.equal(c:lo_read(fd, 5), '01234')
+    f:close()
+    assert(c:lo_close(fd))
+
+    -- test that export and import the large object
+    local filename = os.tmpname()
+    assert(c:lo_export(oid, filename))
+    local oid2 = assert(c:lo_import(filename))
+    os.remove(filename)
+    fd = assert(c:lo_open(oid2))
+    assert.equal(c:lo_read(fd, #data + 1), data)
+    assert(c:lo_close(fd))
+
+    -- test that unlink the large object
+    assert(c:lo_unlink(oid))
+    assert(c:lo_unlink(oid2))
+
+    -- test that return error if the large object does not exist
+    local err
+    fd, err = c:lo_open(oid)
+    assert.is_nil(fd)
+    assert.match(err, 'does not exist')
+    assert(c:exec('ROLLBACK'))
+end
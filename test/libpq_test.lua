@@ -61,3 +61,19 @@ function testcase.valid_server_encoding_id()
     assert.is_false(libpq.valid_server_encoding_id(-123))
 end
 
+function testcase.unescape_bytea()
+    -- test that decode the hex format
+    assert.equal(libpq.unescape_bytea('\\x68656c6c6f'), 'hello')
+    assert.equal(libpq.unescape_bytea('\\x68656C6C6F00ff'), 'hello\0\255')
+    local data = string.rep('0123456789abcdef', 100)
+    assert.equal(libpq.unescape_bytea('\\x' .. data:gsub('.', function(c)
+        return string.format('%02x', c:byte())
+    end)), data)
+
+    -- test that decode the escape format
+    assert.equal(libpq.unescape_bytea('hello\\\\\\000\\377'), 'hello\\\0\255')
+
+    -- test that return an empty string
+    assert.equal(libpq.unescape_bytea(''), '')
+    assert.equal(libpq.unescape_bytea('\\x'), '')
+end
@@ -0,0 +1,177 @@
+local testcase = require('testcase')
+local libpq = require('libpq')
+local wait_readable = require('io.wait').readable
+
+-- waits for the completion fd of the pool and takes the completed query
+local function wait_result(pool)
+    assert(wait_readable(pool:fd(), 5))
+    local c, res, err = pool:get_result()
+    assert(c, 'the fd is readable but no query is completed')
+    return c, res, err
+end
+
+function testcase.offload_pool()
+    -- test that create the offload pool
+    local pool = assert(libpq.offload_pool(2))
+    assert.match(tostring(pool), '^libpq.offload: ')
+    assert.is_int(pool:fd())
+    assert.equal(pool:pending(), 0)
+
+    -- test that return nothing if no query is completed
+    assert.is_nil(pool:get_result())
+
+    -- test that the fd becomes readable when the query is completed, and is
+    -- drained after the result is taken
+    local c = assert(libpq.connect())
+    assert.is_true(pool:exec(c, 'SELECT pg_sleep(0.1)'))
+    assert.is_false(wait_readable(pool:fd(), 0))
+    assert.is_true(wait_readable(pool:fd(), 5))
+    assert.equal(pool:get_result(), c)
+    assert.is_false(wait_readable(pool:fd(), 0))
+    pool:close()
+
+    -- test that throws an error if nthreads is out of range
+    local err = assert.throws(libpq.offload_pool, 0)
+    assert.match(err, 'nthreads must be in the range')
+end
+
+function testcase.exec()
+    local pool = assert(libpq.offload_pool(2))
+    local c1 = assert(libpq.connect())
+    local c2 = assert(libpq.connect())
+
+    -- test that the queries on different connections run at the same time
+    assert.is_true(pool:exec(c1, 'SELECT 1 FROM pg_sleep(0.2)'))
+    assert.is_true(pool:exec(c2, 'SELECT 2 FROM pg_sleep(0.2)'))
+    assert.equal(pool:pending(), 2)
+
+    -- test that cannot use the connection until the query is completed
+    local err = assert.throws(c1.exec, c1, 'SELECT 1')
+    assert.match(err, 'attempt to use a connection in the offload pool')
+
+    local values = {}
+    for _ = 1, 2 do
+        local c, res = wait_result(pool)
+        values[c] = res:get_value(1, 1)
+        assert.equal(res:connection(), c)
+    end
+    assert.equal(values[c1], '1')
+    assert.equal(values[c2], '2')
+    assert.equal(pool:pending(), 0)
+
+    -- test that the connection can be used after the query is completed
+    assert(c1:exec('SELECT 1'))
+
+    -- test that return the error message of the query
+    assert.is_true(pool:exec(c1, 'SELECT * FROM unknown_table'))
+    local c, res = wait_result(pool)
+    assert.equal(c, c1)
+    assert.equal(res:status(), libpq.PGRES_FATAL_ERROR)
+    assert.match(res:error_message(), 'unknown_table')
+    pool:close()
+end
+
+function testcase.exec_params()
+    local pool = assert(libpq.offload_pool(1))
+    local c = assert(libpq.connect())
+
+    -- test that the parameters are sent with the query
+    assert.is_true(pool:exec_params(c, 'SELECT $1::text, $2::int, $3::text',
+                                    'foo', 10))
+    local conn, res = wait_result(pool)
+    assert.equal(conn, c)
+    assert.equal(res:get_value(1, 1), 'foo')
+    assert.equal(res:get_value(1, 2), '10')
+    assert.is_true(res:get_is_null(1, 3))
+
+    -- test that the query is counted by the stats of the connection
+    local stats = c:stats()
+    assert.is_true(pool:exec_params(c, 'SELECT $1::int', 1))
+    wait_result(pool)
+    assert.equal(c:stats().queries, stats.queries + 1)
+
+    -- test that cannot read or reset the stats until the query is completed
+    assert.is_true(pool:exec(c, 'SELECT pg_sleep(0.2)'))
+    for _, name in ipairs({
+        'stats',
+        'reset_stats',
+        'slowlog',
+    }) do
+        local err = assert.throws(c[name], c)
+        assert.match(err, 'attempt to use a connection in the offload pool')
+    end
+    wait_result(pool)
+    assert.equal(c:stats().queries, stats.queries + 2)
+    pool:close()
+end
+
+function testcase.notice()
+    local pool = assert(libpq.offload_pool(1))
+    local c = assert(libpq.connect())
+    local notices = {}
+    c:set_notice_processor(function(msg)
+        notices[#notices + 1] = msg
+    end)
+
+    -- test that the notices are passed to the processor on completion
+    assert.is_true(pool:exec(c, [[
+        DO $$ BEGIN RAISE NOTICE 'hello offload'; END $$
+    ]]))
+    assert.equal(#notices, 0)
+    wait_result(pool)
+    assert.equal(#notices, 1)
+    assert.match(notices[1], 'hello offload')
+
+    -- test that the processor is restored after the query is completed
+    assert(c:exec([[
+        DO $$ BEGIN RAISE NOTICE 'hello main'; END $$
+    ]]))
+    assert.equal(#notices, 2)
+    assert.match(notices[2], 'hello main')
+
+    -- test that the notices are passed to the receiver as the result object
+    local results = {}
+    c:set_notice_receiver(function(res)
+        results[#results + 1] = res
+    end)
+    assert.is_true(pool:exec(c, [[
+        DO $$ BEGIN
+            RAISE NOTICE 'hello receiver' USING HINT = 'offload hint';
+        END $$
+    ]]))
+    wait_result(pool)
+    assert.equal(#results, 1)
+    assert.equal(results[1]:status(), libpq.PGRES_NONFATAL_ERROR)
+    assert.match(results[1]:error_message(), 'hello receiver')
+    assert.equal(results[1]:error_field(libpq.PG_DIAG_MESSAGE_HINT),
+                 'offload hint')
+    assert.equal(results[1]:error_field(libpq.PG_DIAG_SQLSTATE), '00000')
+    assert.equal(#notices, 2)
+    pool:close()
+end
+
+function testcase.close()
+    local pool = assert(libpq.offload_pool(1))
+    local c = assert(libpq.connect())
+
+    -- test that close waits for the queries and release the connections
+    assert.is_true(pool:exec(c, 'SELECT pg_sleep(0.1)'))
+    pool:close()
+    assert(c:exec('SELECT 1'))
+
+    -- test that can be called more than once
+    pool:close()
+
+    -- test that cannot use closed pool
+    local err = assert.throws(pool.exec, pool, c, 'SELECT 1')
+    assert.match(err, 'attempt to use a freed object')
+
+    -- test that finish waits for the offloaded query
+    pool = assert(libpq.offload_pool(1))
+    assert.is_true(pool:exec(c, 'SELECT pg_sleep(0.1)'))
+    c:finish()
+    local conn, res = wait_result(pool)
+    assert.equal(conn, c)
+    assert(res)
+    pool:close()
+end
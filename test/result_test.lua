@@ -78,6 +78,45 @@ function testcase.get_attributes()
     assert.equal(res:nparams(), 0)
 end
 
+function testcase.fnumber()
+    local c = assert(libpq.connect())
+    local res = assert(c:exec([[
+        SELECT 1 AS id, 2 AS num, 3 AS "Str", 4 AS num
+    ]]))
+    assert.equal(res:status(), libpq.PGRES_TUPLES_OK)
+
+    -- test that get the column number of the specified column name
+    assert.equal(res:fnumber('id'), 1)
+    assert.equal(res:fnumber('num'), 2)
+    -- test that the names are case-folded unless double-quoted
+    assert.equal(res:fnumber('ID'), 1)
+    assert.equal(res:fnumber('"Str"'), 3)
+    assert.equal(res:fnumber('Str'), -1)
+    -- test that return -1 if not found
+    assert.equal(res:fnumber('unknown'), -1)
+
+    -- test that the column name can be used instead of the column number
+    assert.equal(res:get_value(1, 'num'), '2')
+    assert.equal(res:get_length(1, 'num'), 1)
+    assert.is_false(res:get_is_null(1, 'num'))
+    assert.equal(res:get_value(1, '"Str"'), '3')
+    local err = assert.throws(res.get_value, res, 1, 'unknown')
+    assert.match(err, 'unknown column name unknown')
+    assert.equal(res:get_values(1, 1, {
+        'num',
+        'id',
+    }), {
+        {
+            '2',
+            '1',
+        },
+    })
+    err = assert.throws(res.get_values, res, 1, 1, {
+        'unknown',
+    })
+    assert.match(err, 'cols#1 unknown column name unknown')
+end
+
 function testcase.get_value()
     local c = assert(libpq.connect())
     local res = assert(c:exec([[
@@ -131,3 +170,255 @@ function testcase.get_value()
     })
 end
 
+function testcase.get_values()
+    local c = assert(libpq.connect())
+    local res = assert(c:exec([[
+        SELECT id, 'str' || id AS str, NULLIF(id % 2, 0) AS num
+        FROM generate_series(1, 5) AS id
+    ]]))
+    assert.equal(res:status(), libpq.PGRES_TUPLES_OK)
+
+    -- test that get all columns of all rows
+    local rows, n = res:get_values(1)
+    assert.equal(n, 5)
+    assert.equal(rows, {
+        {
+            '1',
+            'str1',
+            '1',
+        },
+        {
+            '2',
+            'str2',
+        },
+        {
+            '3',
+            'str3',
+            '1',
+        },
+        {
+            '4',
+            'str4',
+        },
+        {
+            '5',
+            'str5',
+            '1',
+        },
+    })
+
+    -- test that get the specified columns of the range of rows
+    rows, n = res:get_values(2, 3, {
+        3,
+        2,
+    })
+    assert.equal(n, 2)
+    assert.equal(rows, {
+        {
+            nil,
+            'str2',
+        },
+        {
+            '1',
+            'str3',
+        },
+    })
+
+    -- test that fill the rows into the specified table and reuse the row tables
+    local tbl = {
+        {
+            'x',
+            'y',
+        },
+    }
+    local row1 = tbl[1]
+    rows, n = res:get_values(4, 10, {
+        1,
+        3,
+    }, tbl)
+    assert.equal(n, 2)
+    assert.equal(rows, tbl)
+    assert.equal(rows[1], row1)
+    assert.equal(tbl, {
+        {
+            '4',
+        },
+        {
+            '5',
+            '1',
+        },
+    })
+
+    -- test that return an empty table if row_from is next to the last row
+    rows, n = res:get_values(6)
+    assert.equal(n, 0)
+    assert.equal(rows, {})
+
+    -- test that the rows are limited by the number of rows
+    rows, n = res:get_values(5, 2 ^ 31 - 1)
+    assert.equal(n, 1)
+    assert.equal(#rows, 1)
+
+    -- test that throws an error if row_from is out of range
+    local err = assert.throws(res.get_values, res, 7)
+    assert.match(err, 'row_from must be between 1 and 6')
+
+    -- test that throws an error if column number is out of range
+    err = assert.throws(res.get_values, res, 1, 5, {
+        4,
+    })
+    assert.match(err, 'cols#1 must be integer between 1 and 3')
+end
+
+function testcase.get_bytea()
+    local c = assert(libpq.connect())
+    local data = 'hello\0world\255'
+
+    -- test that decode the bytea value in the text format
+    local res = assert(c:exec_params('SELECT $1::bytea, NULL::bytea',
+                                     c:escape_bytea_conn(data)))
+    assert.equal(res:fformat(1), 0)
+    assert.equal(res:get_bytea(1, 1), data)
+    assert.is_nil(res:get_bytea(1, 2))
+
+    -- test that return the raw bytes in the binary format
+    assert.equal(c:set_result_format(1), 0)
+    res = assert(c:exec_params('SELECT $1::bytea', c:escape_bytea_conn(data)))
+    assert.equal(c:set_result_format(0), 1)
+    assert.equal(res:fformat(1), 1)
+    assert.equal(res:get_value(1, 1), data)
+    assert.equal(res:get_bytea(1, 1), data)
+end
+
+function testcase.set_attrs_and_set_value()
+    local c = assert(libpq.connect())
+    local res = assert(c:make_empty_result(libpq.PGRES_TUPLES_OK))
+
+    -- test that set the attributes
+    assert(res:set_attrs({
+        {
+            name = 'id',
+            type = 23,
+            size = 4,
+        },
+        {
+            name = 'str',
+            type = 25,
+        },
+    }))
+    assert.equal(res:nfields(), 2)
+    assert.equal(res:fname(1), 'id')
+    assert.equal(res:fname(2), 'str')
+    assert.equal(res:ftype(1), 23)
+    assert.equal(res:fsize(1), 4)
+    assert.equal(res:fsize(2), -1)
+    assert.equal(res:fmod(2), -1)
+
+    -- test that cannot set the attributes twice
+    local ok, err = res:set_attrs({
+        {
+            name = 'foo',
+        },
+    })
+    assert.is_false(ok)
+    assert(err)
+
+    -- test that append the rows
+    assert(res:set_value(1, 1, '1'))
+    assert(res:set_value(1, 2, 'foo'))
+    assert(res:set_value(2, 1, '2'))
+    assert(res:set_value(2, 2))
+    assert.equal(res:ntuples(), 2)
+    assert.equal(res:get_value(1, 1), '1')
+    assert.equal(res:get_value(1, 2), 'foo')
+    assert.equal(res:get_value(2, 1), '2')
+    assert.is_nil(res:get_value(2, 2))
+    assert.is_true(res:get_is_null(2, 2))
+
+    -- test that overwrite the value
+    assert(res:set_value(1, 2, 'bar'))
+    assert.equal(res:get_value(1, 2), 'bar')
+
+    -- test that return false if row number is out of range
+    ok, err = res:set_value(4, 1, 'baz')
+    assert.is_false(ok)
+    assert(err)
+
+    -- test that throws an error if name is not string
+    res = assert(c:make_empty_result(libpq.PGRES_TUPLES_OK))
+    err = assert.throws(res.set_attrs, res, {
+        {
+            name = 1,
+        },
+    })
+    assert.match(err, 'attrs#1.name must be string')
+end
+
+function testcase.to_columns_buffer()
+    local c = assert(libpq.connect())
+    local res = assert(c:exec([[
+        SELECT g::int8 AS id, g % 2 = 0 AS even, g / 2.0::float8 AS half,
+               NULLIF('v' || g, 'v2') AS str,
+               timestamptz '2024-01-02 03:04:05+00' AS ts
+        FROM generate_series(1, 3) g
+    ]]))
+
+    -- test that decode the columns into the typed buffers
+    local cols = assert(res:to_columns_buffer(2))
+    assert.match(tostring(cols), '^libpq.columns: ')
+    assert.equal(cols:ntuples(), 3)
+    assert.equal(cols:nfields(), 5)
+    assert.equal(cols:fname(4), 'str')
+    assert.equal(cols:ftype(1), 20)
+    local formats = {}
+    for col = 1, cols:nfields() do
+        formats[col] = cols:format(col)
+    end
+    assert.equal(formats, {
+        'l',
+        'b',
+        'g',
+        'U',
+        'tsu:UTC',
+    })
+
+    -- test that the validity buffer does not exist if no null value
+    assert.equal(cols:null_count(1), 0)
+    assert.is_nil(cols:buffer(1, 0))
+    local ptr, len = cols:buffer(1, 1)
+    assert.equal(type(ptr), 'userdata')
+    assert.equal(len, 24)
+    ptr, len = cols:buffer(2, 1)
+    assert.equal(type(ptr), 'userdata')
+    assert.equal(len, 1)
+
+    -- test that the text column has the offsets and data buffers
+    assert.equal(cols:null_count(4), 1)
+    ptr, len = cols:buffer(4, 0)
+    assert.equal(type(ptr), 'userdata')
+    assert.equal(len, 1)
+    ptr, len = cols:buffer(4, 1)
+    assert.equal(type(ptr), 'userdata')
+    assert.equal(len, 32)
+    ptr, len = cols:buffer(4, 2)
+    assert.equal(type(ptr), 'userdata')
+    assert.equal(len, 4)
+
+    -- test that export the arrow C data interface structures
+    local schema, array = assert(cols:export_arrow())
+    assert.equal(type(schema), 'userdata')
+    assert.equal(type(array), 'userdata')
+
+    -- test that the columns outlive the result
+    res:clear()
+    assert.equal(cols:fname(1), 'id')
+
+    -- test that throws an error if column number is out of range
+    local err = assert.throws(cols.buffer, cols, 6, 1)
+    assert.match(err, 'column number must be between 1 and 5')
+
+    -- test that cannot use freed columns
+    cols:free()
+    err = assert.throws(cols.ntuples, cols)
+    assert.match(err, 'attempt to use a freed object')
+end
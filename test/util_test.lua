@@ -47,19 +47,60 @@ function testcase.get_result_stat()
         nfields = 1,
         ntuples = 2,
         oid_value = 0,
-        fields = {
-            {
-                col = 1,
-                format = 0,
-                name = 'id',
-            },
-            id = {
-                col = 1,
-                format = 0,
-                name = 'id',
-            },
-        },
     })
+    local fields = stat.fields
+    assert.equal(fields[1].col, 1)
+    assert.equal(fields[1].format, 0)
+    assert.equal(fields[1].name, 'id')
+    assert(rawequal(fields.id, fields[1]))
+
+    -- test that the fields table and its entries are read-only
+    for _, v in ipairs({
+        {
+            fields,
+            'id',
+        },
+        {
+            fields,
+            2,
+        },
+        {
+            fields[1],
+            'name',
+        },
+        {
+            fields.id,
+            'extra',
+        },
+    }) do
+        local err = assert.throws(function()
+            v[1][v[2]] = 'foo'
+        end)
+        assert.match(err, 'attempt to modify the field descriptor')
+    end
+    assert.equal(fields[1].name, 'id')
+    assert.is_nil(fields[2])
+
+    -- test that the fields table is cached in the result
+    assert(rawequal(libpq.util.get_result_stat(res).fields, fields))
+
+    -- test that the fields table is shared by the results of the same fields
+    res = assert(c:exec([[
+        SELECT id FROM test_tbl
+    ]]))
+    fields = assert(libpq.util.get_result_stat(res)).fields
+    res = assert(c:exec([[
+        SELECT id FROM test_tbl
+    ]]))
+    assert(rawequal(libpq.util.get_result_stat(res).fields, fields))
+
+    -- test that the fields table is not shared if the fields are different
+    res = assert(c:exec([[
+        SELECT id, str FROM test_tbl
+    ]]))
+    stat = assert(libpq.util.get_result_stat(res))
+    assert(not rawequal(stat.fields, fields))
+    assert.equal(stat.fields[2].name, 'str')
 end
 
 function testcase.get_result_rows()
@@ -102,6 +143,145 @@ function testcase.get_result_rows()
     })
 end
 
+function testcase.get_result_rows_decode()
+    local c = assert(libpq.connect())
+    local res = assert(c:exec([[
+        SELECT g::int AS id, g % 2 = 0 AS even, g / 2.0::float8 AS half,
+               'v' || g AS str, NULLIF(g, 2)::bigint AS num,
+               timestamptz '2024-01-02 03:04:05.5+00' AS ts,
+               CASE WHEN g = 2 THEN 'infinity' ELSE '2024-01-02' END::timestamp
+               AS inf
+        FROM generate_series(1, 3) g
+    ]]))
+
+    -- test that decode the values into the lua types
+    for _, nthreads in ipairs({
+        1,
+        4,
+    }) do
+        local rows = assert(libpq.util.get_result_rows(res, {
+            decode = true,
+            nthreads = nthreads,
+        }))
+        assert.equal(#rows, 3)
+        assert.equal(rows[1][1], 1)
+        assert.is_false(rows[1][2])
+        assert.is_true(rows[2][2])
+        assert.equal(rows[3][3], 1.5)
+        assert.equal(rows[2][4], 'v2')
+        assert.equal(rows[1][5], 1)
+        assert.is_nil(rows[2][5])
+        assert.equal(rows[3][5], 3)
+        assert.equal(rows[1][6], 1704164645.5)
+        -- test that the column falls back to text if cannot be decoded
+        assert.equal(rows[1][7], '2024-01-02 00:00:00')
+        assert.equal(rows[2][7], 'infinity')
+    end
+
+    -- test that decode the binary format
+    c:set_result_format(1)
+    res = assert(c:exec_params('SELECT 10::int2, 20::int8, 0.25::float4, '
+                                   .. "timestamp '1970-01-01 00:00:01'"))
+    assert.equal(libpq.util.get_result_rows(res, {
+        decode = true,
+    }), {
+        {
+            10,
+            20,
+            0.25,
+            1,
+        },
+    })
+
+    -- test that throws an error if nthreads is invalid
+    local err = assert.throws(libpq.util.get_result_rows, res, {
+        decode = true,
+        nthreads = 0,
+    })
+    assert.match(err, 'nthreads must be integer')
+end
+
+function testcase.get_result_rows_intern()
+    local c = assert(libpq.connect())
+    local res = assert(c:exec([[
+        SELECT g AS id, (ARRAY['active', 'deleted', 'pending'])[g % 3 + 1]
+               AS status, CASE WHEN g % 2 = 0 THEN 'JP' END AS country
+        FROM generate_series(1, 1000) g
+    ]]))
+    local expect = assert(libpq.util.get_result_rows(res))
+
+    -- test that the rows are the same as the rows without interning
+    assert.equal(libpq.util.get_result_rows(res, {
+        intern = true,
+    }), expect)
+
+    -- test that the text columns of the decoded rows are interned
+    local rows = assert(libpq.util.get_result_rows(res, {
+        intern = true,
+        decode = true,
+    }))
+    assert.equal(#rows, 1000)
+    for i, row in ipairs(rows) do
+        assert.equal(row[1], i)
+        assert.equal(row[2], expect[i][2])
+        assert.equal(row[3], expect[i][3])
+    end
+end
+
+function testcase.get_result_rows_arena()
+    local c = assert(libpq.connect())
+    local res = assert(c:exec([[
+        SELECT g AS id, 'v' || g AS str, NULLIF(g, 2) AS num
+        FROM generate_series(1, 3) g
+    ]]))
+    local arena = assert(libpq.arena())
+    assert.match(tostring(arena), '^libpq.arena: ')
+
+    -- test that the rows are copied into the arena
+    local rows = assert(libpq.util.get_result_rows(res, {
+        arena = arena,
+    }))
+    res:clear()
+    assert.match(tostring(rows), '^libpq.arena.rows: ')
+    assert.equal(#rows, 3)
+    assert.greater(arena:size(), 0)
+    local row = rows[2]
+    assert.equal(#row, 3)
+    assert.equal(row[1], '2')
+    assert.equal(row.str, 'v2')
+    assert.is_nil(row.num)
+    assert.is_nil(row[4])
+    assert.is_nil(rows[4])
+
+    -- test that the values are decoded into the lua types
+    res = assert(c:exec('SELECT 1::int AS id, true AS ok, 0.5::float8'))
+    rows = assert(libpq.util.get_result_rows(res, {
+        arena = arena,
+        decode = true,
+    }))
+    assert.equal(rows[1].id, 1)
+    assert.is_true(rows[1].ok)
+    assert.equal(rows[1][3], 0.5)
+
+    -- test that cannot use the proxies after the arena is released
+    arena:release()
+    assert.equal(arena:size(), 0)
+    local err = assert.throws(function()
+        return rows[1]
+    end)
+    assert.match(err, 'attempt to use a released arena')
+    err = assert.throws(function()
+        return row[1]
+    end)
+    assert.match(err, 'attempt to use a released arena')
+
+    -- test that throws an error if arena is not libpq.arena
+    err = assert.throws(libpq.util.get_result_rows, res, {
+        arena = {},
+    })
+    assert.match(err, 'libpq.arena expected')
+end
+
 function testcase.iterate_result_rows()
     local c = assert(libpq.connect())
     local res = assert(c:exec([[